@@ -77,6 +77,9 @@
  *
  */
 #endif
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L	/* mmap() and friends */
+#endif
 /* Modern standard headers — replaces the old OctTools port.h portability layer */
 #include <stdio.h>
 #include <stdlib.h>
@@ -85,6 +88,24 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if !defined(KD_NO_SIMD) && defined(__AVX2__)
+#define KD_AVX2
+#include <immintrin.h>
+#elif !defined(KD_NO_SIMD) && defined(__SSE2__)
+#define KD_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "kd.h"
 
@@ -111,19 +132,16 @@ static void kd_fatal(const char *fmt, ...) {
 
 char *kd_pkg_name = "kd";
 
-static char *mem_ret;		/* Memory allocation */
+static void *kd_alloc(void *ptr, size_t size);
 
-/* Note: these are NOT multi-callable */
 #define ALLOC(type) \
-((mem_ret = malloc(sizeof(type))) ? (type *) mem_ret : (type *) kd_fault(KDF_M))
+((type *) kd_alloc((void *) 0, sizeof(type)))
 
 #define MULTALLOC(type, num) \
-((mem_ret = malloc((unsigned) (sizeof(type) * (num)))) ? \
- (type *) mem_ret : (type *) kd_fault(KDF_M))
+((type *) kd_alloc((void *) 0, sizeof(type) * (size_t) (num)))
 
 #define REALLOC(type, ptr, newsize) \
-((mem_ret = realloc((char *) ptr, (unsigned) (sizeof(type) * (newsize)))) ? \
- (type *) mem_ret : (type *) kd_fault(KDF_M))
+((type *) kd_alloc((void *) (ptr), sizeof(type) * (size_t) (newsize)))
 
 #define FREE(ptr)		free((char *) ptr)
 
@@ -133,8 +151,15 @@ static char *mem_ret;		/* Memory allocation */
    ((b1)[KD_TOP] >= (b2)[KD_BOTTOM]) && \
    ((b2)[KD_TOP] >= (b1)[KD_BOTTOM]))
 
-static char kd_err_buf[1024];
+#define BOXWITHIN(b1, b2) \
+  (((b1)[KD_LEFT] >= (b2)[KD_LEFT]) && \
+   ((b1)[KD_BOTTOM] >= (b2)[KD_BOTTOM]) && \
+   ((b1)[KD_RIGHT] <= (b2)[KD_RIGHT]) && \
+   ((b1)[KD_TOP] <= (b2)[KD_TOP]))
+
+static _Thread_local char kd_err_buf[1024];	/* each thread sees its own errors */
 static int kd_build_depth = 100000; /* can you imagine a tree deeper than this? */
+static int kd_build_strategy = KD_BUILD_MEAN; /* how build_node picks its splits */
 
 #define Sprintf		(void) sprintf
 #define Printf		(void) printf
@@ -156,15 +181,84 @@ typedef struct KDElem_defn {
     int lo_min_bound;		/* Lower minimum boundary   */
     int hi_max_bound;		/* High maximum boundary    */
     int other_bound;		/* Discriminator dependent  */
+    int count;			/* Live items in the subtree */
     struct KDElem_defn *sons[2];/* Children                 */
 } KDElem;
 
+#define KD_COUNT(elem)	((elem) ? (elem)->count : 0)
+
+/*
+ * Frozen trees (kd_freeze) keep their nodes in one array laid out
+ * in van Emde Boas order,  so that any root-to-leaf path touches
+ * few cache lines.  Sons are 32 bit indices into that array;  the
+ * root is node 0,  which is never anyone's son,  so a zero son
+ * means there is none.  The item stored at nodes[i] is items[i];
+ * keeping them apart leaves only what the searches look at in the
+ * nodes:  the box,  holding the split key,  and the bounds.
+ */
+
+typedef struct KDFNode_defn {
+    int size[KD_BOX_MAX];	/* Size of item (split key at size[disc]) */
+    int lo_min_bound;		/* Lower minimum boundary   */
+    int hi_max_bound;		/* High maximum boundary    */
+    int other_bound;		/* Discriminator dependent  */
+    unsigned int sons[2];	/* Children,  zero if none  */
+} KDFNode;
+
+/*
+ * kd_freeze_buckets() may also collapse small subtrees into leaf
+ * buckets.  A bucket node keeps the bounding box of its subtree in
+ * `size',  KD_BUCKET plus the offset of its boxes in the bucket
+ * arrays in sons[0],  and their number in sons[1].  The boxes are
+ * stored an edge to an array,  in the order kd_next() would have
+ * visited them,  and each bucket is padded to KD_BUCKET_WIDTH so
+ * they can be tested that many at a time.
+ */
+
+#define KD_BUCKET		0x80000000u
+#define KD_IS_BUCKET(node)	((node)->sons[KD_LOSON] & KD_BUCKET)
+#define KD_BUCKET_START(node)	((node)->sons[KD_LOSON] & ~KD_BUCKET)
+#define KD_BUCKET_WIDTH		8
+
+typedef struct kd_frozen {
+	KDFNode *nodes;			/* Nodes,  the root first    */
+	kd_generic *items;		/* Item of each node         */
+	unsigned int num_nodes;	/* Length of both arrays     */
+	int depth;				/* Levels in the tree        */
+	int *bucket_box[KD_BOX_MAX];	/* Bucket boxes,  by edge */
+	kd_generic *bucket_items;	/* Bucket items,  0 if padding */
+	unsigned int bucket_len;	/* Length of bucket arrays   */
+	void *image;			/* Mapped file holding the arrays */
+	size_t image_len;		/* Its length                */
+} KDFrozen;
+
+/*
+ * Nodes are carved out of slabs owned by the tree rather than
+ * malloc'd one by one.  Nodes given back by deletes go on a free
+ * list (threaded through sons[0]) and are handed out again before
+ * any new slab space.  kd_destroy() frees the slabs wholesale.
+ */
+
+#define KD_SLAB_NODES	1024	/* Nodes in an ordinary slab */
+
+typedef struct kd_slab {
+	struct kd_slab *next;	/* Next slab owned by the tree */
+	int used;				/* Nodes handed out so far     */
+	int size;				/* Nodes in this slab          */
+	KDElem nodes[];
+} KDSlab;
+
 typedef struct KDTree_defn {
     KDElem *tree;		/* K-d tree itself      */
     int item_count;		/* Number of nodes in tree */
     int dead_count;		/* Number of dead nodes */
 	kd_box extent;      /* extents for the entire tree */
 	int items_balanced; /* how many where in the tree when built */
+	KDSlab *slabs;		/* Node storage, newest first */
+	KDElem *free_nodes;	/* Released nodes, through sons[0] */
+	KDFrozen *frozen;	/* Non-zero for read-only trees */
+	int max_depth;		/* Levels in the tree,  at most */
+	char flip;			/* Son kd_really_delete() takes from */
 } KDTree;
 
 /*
@@ -176,7 +270,7 @@ typedef struct KDTree_defn {
  */
 
 #define KD_INIT_STACK	15	/* Initial size of stack                */
-#define KD_GROWSIZE(s)	10	/* Linear expansion                     */
+#define KD_GROWSIZE(s)	(s)	/* Geometric expansion                  */
 #define	KD_THIS_ONE	-1	/* Indicates going through this element */
 #define KD_DONE		2	/* Entirely done searching this element */
 
@@ -184,17 +278,36 @@ typedef struct kd_save {
     short disc;			/* Discriminator             */
     short state;		/* Current state (see above) */
     KDElem *item;		/* Element saved             */
-	kd_box Bp;          /* for nearest neighbor, a saved bounds info */
+	unsigned int node;	/* Node saved,  frozen trees */
+	unsigned int pos;	/* Next boxes,  in a bucket  */
+	unsigned int hits;	/* Pending hits,  in a bucket */
+	kd_box Bp;          /* for nearest neighbor, a saved bounds info;
+						   region searches keep a box holding the subtree here */
 	kd_box Bn;          /* for nearest neighbor, a saved bounds info */
 } KDSave;
 
 typedef struct kd_state {
     kd_box extent;		/* Search area 		     */
-    short stack_size;		/* Allocated size of stack   */
-    short top_index;		/* Top of the stack          */
+    int stack_size;		/* Allocated size of stack   */
+    int top_index;		/* Top of the stack          */
     KDSave *stk;		/* Stack of active states    */
+	KDFrozen *frozen;	/* Tree,  if it is frozen    */
+	KDTree *tree;		/* Tree being searched       */
+	KDSave *local;		/* Frames in caller storage  */
+	int owned;			/* Allocated by kd_start     */
+	int inside;			/* First frame wholly in the area,  -1 if none */
+	int mode;			/* KD_INTERSECTS, KD_WITHIN or KD_CONTAINS */
+	kd_box prune;		/* Area as the son bound tests see it */
+	int tries;			/* Nodes looked at,  for kd_finish() */
 } KDState;
 
+/*
+ * kd_gen_init() puts the state and the first KD_GEN_FRAMES frames of
+ * its stack in caller storage;  only deeper trees need the heap.
+ */
+_Static_assert(sizeof(KDState) + KD_GEN_FRAMES * sizeof(KDSave) <= sizeof(kd_gen_storage),
+			   "kd_gen_storage too small");
+
 
 
 static char *kd_fault(int t)
@@ -221,6 +334,11 @@ static char *kd_fault(int t)
     case KDF_DUPL:
 	kd_fatal("attempt to insert duplicate item");
 	/* NOTREACHED */
+	break;
+    case KDF_FROZEN:
+	kd_fatal("attempt to modify a frozen tree");
+	/* NOTREACHED */
+	break;
     default:
 	kd_fatal("unknown fault: %d", t);
 	/* NOTREACHED */
@@ -229,6 +347,15 @@ static char *kd_fault(int t)
     return (char *) 0;
 }
 
+static void *kd_alloc(void *ptr, size_t size)
+/* malloc(),  or realloc() of `ptr' if there is one;  running out is fatal */
+{
+	void *mem = ptr ? realloc(ptr, size) : malloc(size);
+
+	if (!mem) (void) kd_fault(KDF_M);
+	return mem;
+}
+
 static int kd_set_error(int err)
 // int err;			/* Error number */
 /* Sets an error message in an area for later retrieval */
@@ -237,6 +364,15 @@ static int kd_set_error(int err)
     case KD_NOTFOUND:
 	Sprintf(kd_err_buf, "k-d error: data not found");
 	break;
+    case KD_NOTIMPL:
+	Sprintf(kd_err_buf, "k-d error: not supported on a frozen tree");
+	break;
+    case KD_BADFILE:
+	Sprintf(kd_err_buf, "k-d error: cannot read or write tree image");
+	break;
+    case KD_BADARG:
+	Sprintf(kd_err_buf, "k-d error: argument out of range");
+	break;
     default:
 	Sprintf(kd_err_buf, "k-d error: unknown error %d", err);
 	break;
@@ -251,7 +387,74 @@ char *kd_err_string(void)
 }
 
 
-static KDElem *kd_new_node(kd_generic item, kd_box size, int lomin, int himax, int other, KDElem *loson, KDElem *hison)
+static KDSlab *new_slab(KDTree *tree, int size)
+/*
+ * Adds a slab of `size' nodes to `tree'.  The slab goes behind
+ * the one currently being carved up,  so whatever is left in
+ * that one is not lost.
+ */
+{
+	KDSlab *slab;
+
+	slab = (KDSlab *) MULTALLOC(char, sizeof(KDSlab) + sizeof(KDElem) * (size_t) size);
+	slab->used = 0;
+	slab->size = size;
+	if (tree->slabs && tree->slabs->used < tree->slabs->size)
+	{
+		slab->next = tree->slabs->next;
+		tree->slabs->next = slab;
+	}
+	else
+	{
+		slab->next = tree->slabs;
+		tree->slabs = slab;
+	}
+	return slab;
+}
+
+static KDElem *new_elem(KDTree *tree)
+/* Returns an uninitialized node belonging to `tree' */
+{
+	KDElem *elem;
+
+	if ((elem = tree->free_nodes))
+	{
+		tree->free_nodes = elem->sons[0];
+		return elem;
+	}
+	if (!tree->slabs || tree->slabs->used >= tree->slabs->size)
+		(void) new_slab(tree, KD_SLAB_NODES);
+	return &tree->slabs->nodes[tree->slabs->used++];
+}
+
+static KDElem *new_elems(KDTree *tree, int num)
+/* Returns `num' contiguous uninitialized nodes belonging to `tree' */
+{
+	KDSlab *slab;
+
+	if (num <= KD_SLAB_NODES / 4)
+	{
+		if (!tree->slabs || tree->slabs->size - tree->slabs->used < num)
+			(void) new_slab(tree, KD_SLAB_NODES);
+		slab = tree->slabs;
+	}
+	else
+		slab = new_slab(tree, num);
+	slab->used += num;
+	return &slab->nodes[slab->used - num];
+}
+
+static void free_elem(KDTree *tree, KDElem *elem)
+/* Gives `elem' back to its tree for reuse */
+{
+	elem->item = (kd_generic) 0;
+	elem->sons[0] = tree->free_nodes;
+	tree->free_nodes = elem;
+}
+
+
+static KDElem *kd_new_node(KDTree *tree, kd_generic item, kd_box size, int lomin, int himax, int other, KDElem *loson, KDElem *hison)
+// KDTree *tree;		/* Owner of the node */
 // kd_generic item;		/* New node value */
 // kd_box size;			/* Size of item   */
 // int lomin, himax, other;	/* Bounds info    */
@@ -260,7 +463,7 @@ static KDElem *kd_new_node(kd_generic item, kd_box size, int lomin, int himax, i
 {
     KDElem *newElem;
 
-    newElem = ALLOC(KDElem);
+    newElem = new_elem(tree);
     newElem->item = item;
     newElem->size[0] = size[0];
     newElem->size[1] = size[1];
@@ -271,6 +474,7 @@ static KDElem *kd_new_node(kd_generic item, kd_box size, int lomin, int himax, i
     newElem->other_bound = other;
     newElem->sons[0] = loson;
     newElem->sons[1] = hison;
+    newElem->count = 1 + KD_COUNT(loson) + KD_COUNT(hison);
     return newElem;
 }
 
@@ -292,6 +496,11 @@ kd_tree kd_create(void)
     newTree = ALLOC(KDTree);
     newTree->tree = (KDElem *) 0;
     newTree->item_count = newTree->dead_count = 0;
+	newTree->slabs = (KDSlab *) 0;
+	newTree->free_nodes = (KDElem *) 0;
+	newTree->frozen = (KDFrozen *) 0;
+	newTree->max_depth = 0;
+	newTree->flip = 0;
     return (kd_tree) newTree;
 }
 
@@ -309,7 +518,7 @@ kd_tree kd_create(void)
 
 typedef KDElem kd_list;
 
-static kd_list *kd_tmp_ptr;
+static _Thread_local kd_list *kd_tmp_ptr;	/* builds may run on several threads */
 
 #define NIL			(kd_list *) 0
 #define CAR(list)		(list)->item
@@ -339,16 +548,37 @@ static kd_list *kd_tmp_ptr;
 
 
 /* Forward declarations */
-static kd_list *load_items(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic arg, kd_box extent, int *length, double *mean);
-static KDElem *build_node(kd_list *items, int num, kd_box extent, int disc, int level, int max_level, kd_list **spares, int *treecount, double mean);
+/* Nodes down to an item,  root first (see find_item()) */
+#define PATH_INIT	50
+#define PATH_INCR	10
+
+typedef struct {
+	KDElem **elems;			/* Nodes above the item      */
+	int length;				/* Number of them            */
+	int alloc;				/* Allocated size            */
+	KDElem *local[PATH_INIT];	/* Initial array            */
+} KDPath;
+
+static kd_list *load_items(KDTree *tree, int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic arg, kd_box extent, int *length, double *mean);
+static void build_tree(KDTree *newTree, kd_list *items, int item_count, kd_box extent, double mean, int nthreads);
+static KDElem *build_node(kd_list *items, int num, kd_box extent, int disc, int level, int max_level, kd_list **spares, int *treecount, double mean, int nthreads);
+static KDElem *build_median(KDElem **elems, int num, int disc, int level, int max_level, kd_list **spares, int *treecount, int nthreads);
 static void sel_k(kd_list *items, int k, int disc, kd_list **lo, kd_list **eq, kd_list **hi, double *lomean, double *himean, long *locount, long *hicount);
 static void resolve(kd_list **lo, kd_list **eq, kd_list **hi, int disc, double *lomean, double *himean, long *locount, long *hicount);
 static int get_min_max(kd_list *list, int disc, int *b_min, int *b_max);
 static void del_elem(KDElem *elem, void (*delfunc)(kd_generic item));
-static kd_status del_element(KDTree *tree, KDElem *elem, int spot);
-static KDElem *find_item(KDElem *elem, int disc, kd_generic item, kd_box size, int search_p, KDElem *items_elem);
+static kd_status del_element(KDTree *tree, KDElem *elem, KDPath *path, int spot);
+static KDElem *find_item(KDElem *elem, int level, kd_generic item, kd_box size, int search_p, KDPath *path, KDElem *items_elem, int *depth);
 static void bounds_update(KDElem *elem, int disc, kd_box size);
-static int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesdad, int *dir, int *newj);
+static int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesdad, int *dir, int *newj, KDElem **path, int *path_len);
+static void free_frozen(KDFrozen *fz, void (*delfunc)(kd_generic item));
+static void unmap_image(void *image, size_t len);
+static kd_status frozen_find(KDFrozen *fz, kd_generic item, kd_box size);
+static kd_status frozen_next(KDState *realGen, kd_generic *data, kd_box size);
+static int search_all(KDFrozen *fz, KDElem *elem, unsigned int node, kd_visitor visitor, kd_generic arg);
+struct KDPpriority;
+static int frozen_neighbor(KDFrozen *fz, kd_box Xq, int m, struct KDPpriority *list, kd_box Bp, kd_box Bn,
+						   kd_filter filter, kd_generic arg);
   
 int kd_set_build_depth(int depth)
 {
@@ -357,9 +587,34 @@ int kd_set_build_depth(int depth)
 	return retval;
 }
 
+int kd_set_build_strategy(int strategy)
+/*
+ * Chooses how later builds and rebuilds split their items:
+ * KD_BUILD_MEAN (the default) splits each node near the mean
+ * of the discriminating edge,  KD_BUILD_MEDIAN at its exact
+ * median.  Returns the previous strategy.
+ */
+{
+	int retval = kd_build_strategy;
+	kd_build_strategy = strategy;
+	return retval;
+}
+
 kd_tree kd_build(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic arg)
 // int (*itemfunc)();		/* Returns new items       */
 // kd_generic arg;			/* Data to itemfunc        */
+/*
+ * Single threaded kd_build_parallel();  see below.
+ */
+{
+	return kd_build_parallel(itemfunc, arg, 1);
+}
+
+
+kd_tree kd_build_parallel(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic arg, int nthreads)
+// int (*itemfunc)();		/* Returns new items       */
+// kd_generic arg;			/* Data to itemfunc        */
+// int nthreads;		/* Threads to build with   */
 /*
  * This routine builds a new, reasonably balanced k-d tree
  * from a list of items.  This list of items is collected
@@ -375,27 +630,162 @@ kd_tree kd_build(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size),
  * routine should return zero.  `itemfunc' is guaranteed to be
  * called for all items. `arg' is passed as a convenience (usually
  * for state information).
+ * The items are collected on the calling thread;  the balanced
+ * part of the tree is then built by up to `nthreads' threads.
+ * The result is the same tree for any number of threads.
  */
 {
     KDTree *newTree = (KDTree *) kd_create();
-    kd_list *items, *spares = (kd_list *)0;
+    kd_list *items;
     kd_box extent;
-	int item_count = 0,count;
+	int item_count = 0;
 	double mean;
     /* First build up list of items and their overall extent */
-    items = load_items(itemfunc, arg, extent, &item_count, &mean);
+    items = load_items(newTree, itemfunc, arg, extent, &item_count, &mean);
     if (!items)
 	{
 		(void) kd_fault(KDF_ZEROID);
 		/* NOTREACHED */
     }
 
+	build_tree(newTree, items, item_count, extent, mean, nthreads);
+    return (kd_tree) newTree;
+}
+
+
+kd_tree kd_build_from_arrays(const kd_box *boxes, const kd_generic *items, size_t n)
+// const kd_box *boxes;		/* Bounding box of each item  */
+// const kd_generic *items;	/* The items themselves       */
+// size_t n;			/* Number of entries in each  */
+/*
+ * Same as kd_build(),  but the items come from two parallel
+ * caller arrays instead of an item function.  There is no
+ * callback per item:  the extent and the mean of the left
+ * sides are found in one tight pass over `boxes',  and the
+ * nodes,  taken as one contiguous block,  are then filled
+ * straight from the arrays and handed to build_node().
+ * An empty array gives an empty tree.
+ */
+{
+    KDTree *newTree = (KDTree *) kd_create();
+    kd_list *list = NIL;
+	KDElem *nodes, *elem;
+    kd_box extent;
+	int lft = MAXINT, btm = MAXINT, rgt = MININT, top = MININT;
+	long long sum = 0;
+	size_t i;
+
+	if (n == 0) return (kd_tree) newTree;
+	if (n > (size_t) MAXINT) (void) kd_fault(KDF_M);
+
+	/* Extent and mean only: no stores, integer sum, so this vectorizes */
+	for (i = 0; i < n; i++)
+	{
+		lft = MIN(lft, boxes[i][KD_LEFT]);
+		btm = MIN(btm, boxes[i][KD_BOTTOM]);
+		rgt = MAX(rgt, boxes[i][KD_RIGHT]);
+		top = MAX(top, boxes[i][KD_TOP]);
+		sum += boxes[i][KD_LEFT];
+	}
+	extent[KD_LEFT] = lft;
+	extent[KD_BOTTOM] = btm;
+	extent[KD_RIGHT] = rgt;
+	extent[KD_TOP] = top;
+
+	/* Fill the nodes; build_node() takes them threaded through sons[0] */
+	nodes = new_elems(newTree, (int) n);
+	for (i = n; i-- > 0; )
+	{
+		if (!items[i]) (void) kd_fault(KDF_ZEROID);
+		elem = &nodes[i];
+		elem->item = items[i];
+		elem->size[0] = boxes[i][0];
+		elem->size[1] = boxes[i][1];
+		elem->size[2] = boxes[i][2];
+		elem->size[3] = boxes[i][3];
+		elem->sons[0] = list;
+		list = elem;
+	}
+
+	build_tree(newTree, list, (int) n, extent, (double) sum / (double) n, 1);
+    return (kd_tree) newTree;
+}
+
+
+static int tree_depth(KDElem *root)
+/* Returns the number of levels below and including `root' */
+{
+	typedef struct { KDElem *elem; int level; } KDLevel;
+	KDLevel *stk;
+	KDElem *elem;
+	int size = KD_INIT_STACK, top = 0, level, depth = 0, i;
+
+	if (!root) return 0;
+	stk = MULTALLOC(KDLevel, size);
+	stk[top].elem = root;
+	stk[top].level = 1;
+	top++;
+	while (top > 0)
+	{
+		top--;
+		elem = stk[top].elem;
+		level = stk[top].level;
+		depth = MAX(depth, level);
+		for (i = KD_LOSON;  i <= KD_HISON;  i++)
+		{
+			if (!elem->sons[i]) continue;
+			if (top >= size)
+			{
+				size += KD_GROWSIZE(size);
+				stk = REALLOC(KDLevel, stk, size);
+			}
+			stk[top].elem = elem->sons[i];
+			stk[top].level = level + 1;
+			top++;
+		}
+	}
+	FREE(stk);
+	return depth;
+}
+
+static void build_tree(KDTree *newTree, kd_list *items, int item_count, kd_box extent, double mean, int nthreads)
+// KDTree *newTree;		/* Empty tree to fill          */
+// kd_list *items;		/* Items to put in it          */
+// int item_count;		/* Length of `items'           */
+// kd_box extent;		/* Overall extent of `items'   */
+// double mean;			/* Mean of the left sides      */
+// int nthreads;		/* Threads for build_node      */
+/*
+ * Common tail of kd_build(), kd_build_from_arrays() and kd_rebuild():
+ * builds the balanced part of the tree down to kd_build_depth,  then
+ * inserts whatever was left over one at a time.
+ */
+{
+    kd_list *spares = (kd_list *)0;
+
     /* Then recursively fill the tree */
-	if( kd_build_depth )
+	if( kd_build_depth && kd_build_strategy == KD_BUILD_MEDIAN )
+	{
+		KDElem **elems;
+		int i;
+
+		elems = MULTALLOC(KDElem *, item_count);
+		for (i = 0; i < item_count; i++)
+		{
+			elems[i] = items;
+			items = CDR(items);
+		}
+		newTree->tree = build_median(elems, item_count, 0, 1,
+									 kd_build_depth, &spares,
+									 &(newTree->item_count), nthreads);
+		newTree->items_balanced = newTree->item_count;
+		FREE(elems);
+	}
+	else if( kd_build_depth )
 	{
 		newTree->tree = build_node(items, item_count, extent, 0, 1,
 								   kd_build_depth, &spares,
-								   &(newTree->item_count), mean);
+								   &(newTree->item_count), mean, nthreads);
 		newTree->items_balanced = newTree->item_count;
 	}
 	else
@@ -409,25 +799,20 @@ kd_tree kd_build(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size),
 	newTree->extent[1] = extent[1];
 	newTree->extent[2] = extent[2];
 	newTree->extent[3] = extent[3];
+	newTree->max_depth = tree_depth(newTree->tree);
 
-	count = 0;
-	
 	while( spares )
 	{
 		kd_list *ptr;
 		ptr = CDR(spares);
-		/* count++; */
-		/*if( count % 50000 == 0 )
-			printf(".%d", count),fflush(stdout);*/
-		
 		kd_insert((kd_tree)newTree,(kd_generic)spares->item,spares->size,(kd_generic)spares);
 		spares = ptr;
 	}
-    return (kd_tree) newTree;
 }
-
 
-static kd_list *load_items(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic arg, kd_box extent, int *length, double *mean)
+
+static kd_list *load_items(KDTree *tree, int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic arg, kd_box extent, int *length, double *mean)
+// KDTree *tree;		/* Tree the nodes belong to */
 // int (*itemfunc)();		/* Generate next item       */
 // kd_generic arg;			/* State passed to itemfunc */
 // kd_box extent;			/* Overall extent           */
@@ -453,7 +838,7 @@ static kd_list *load_items(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_b
     extent[KD_RIGHT] = extent[KD_TOP] = MININT;
     for (;;)
 	{
-		new_item = ALLOC(KDElem);
+		new_item = new_elem(tree);
 		if ((*itemfunc)(arg, &new_item->item, new_item->size))
 		{
 			if (!new_item->item) add_flag = 0;
@@ -473,11 +858,11 @@ static kd_list *load_items(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_b
 				(*length)++;
 			}
 			else
-				free(new_item);
+				free_elem(tree, new_item);
 		}
 		else
 		{
-			free(new_item);
+			free_elem(tree, new_item);
 			break;
 		}
     }
@@ -492,7 +877,7 @@ static kd_list *load_items(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_b
 		{
 			ptr = new_list;
 			new_list = CDR(new_list);
-			FREE(ptr);
+			free_elem(tree, ptr);
 			(*length)--;
 		}
     }
@@ -503,7 +888,47 @@ static kd_list *load_items(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_b
 
 #define NEXTDISC(val)	(((val)+1)%4)
 
-static KDElem *build_node(kd_list *items, int num, kd_box extent, int disc, int level, int max_level, kd_list **spares, int *treecount, double mean)
+/*
+ * Parallel builds.  The two sons of a node are built from disjoint
+ * lists and share nothing but `spares' and `treecount'.  Above
+ * KD_PAR_CUTOFF items the high son is handed to a new thread with
+ * its own spares list and count,  while the calling thread goes on
+ * with the low son.  After the join the high son's spares are put
+ * in front of the caller's list and its count is added in,  which
+ * is exactly where the sequential build would have left them.
+ */
+
+#define KD_PAR_CUTOFF	20000	/* Below this many items,  stay on one thread */
+
+typedef struct kd_build_task {
+	KDElem **elems;		/* Items for a median build    */
+	kd_list *items;		/* Items for this subtree      */
+	int num;			/* Number of items             */
+	kd_box extent;		/* Private copy of the extent  */
+	int disc, level, max_level;
+	kd_list *spares;	/* Private spares list         */
+	int treecount;		/* Private node count          */
+	double mean;
+	int nthreads;		/* Threads this task may use   */
+	KDElem *result;		/* Root of the subtree built   */
+} KDBuildTask;
+
+static void *build_task(void *arg)
+{
+	KDBuildTask *task = (KDBuildTask *) arg;
+
+	if (task->elems)
+		task->result = build_median(task->elems, task->num, task->disc,
+									task->level, task->max_level, &task->spares,
+									&task->treecount, task->nthreads);
+	else
+		task->result = build_node(task->items, task->num, task->extent, task->disc,
+								  task->level, task->max_level, &task->spares,
+								  &task->treecount, task->mean, task->nthreads);
+	return (void *) 0;
+}
+
+static KDElem *build_node(kd_list *items, int num, kd_box extent, int disc, int level, int max_level, kd_list **spares, int *treecount, double mean, int nthreads)
 // kd_list *items;			/* Items to insert          */
 // int num;			/* Number of items          */
 // kd_box extent;			/* Extent of items          */
@@ -514,6 +939,7 @@ static KDElem *build_node(kd_list *items, int num, kd_box extent, int disc, int
 // kd_list **spares;   /* ptr to a list head to attach spares to */
 // int *treecount;     /* keep a record of each node built */
 // double mean;          /* the geometric mean of the data under the node based on disc number */
+// int nthreads;        /* threads this subtree may be built with */
 /*
  * This routine builds a new node by finding an approximate median of
  * the items according to the edge given by `disc' and
@@ -559,13 +985,58 @@ static KDElem *build_node(kd_list *items, int num, kd_box extent, int disc, int
 		if( himean )
 			himean /= hicnt;
 		
-		tmp = extent[hort+2];  extent[hort+2] = m;
-		loson = build_node(lo, num_lo, extent, NEXTDISC(disc), level+1, max_level, spares, treecount, lomean);
-		extent[hort+2] = tmp;
+		if( nthreads > 1 && num_lo + num_hi >= KD_PAR_CUTOFF )
+		{
+			KDBuildTask task;
+			pthread_t thread;
+			kd_list *last;
+			int i, forked;
+
+			task.elems = (KDElem **) 0;
+			task.items = hi;
+			task.num = num_hi;
+			for (i = 0; i < KD_BOX_MAX; i++) task.extent[i] = extent[i];
+			task.extent[hort] = m;
+			task.disc = NEXTDISC(disc);
+			task.level = level+1;
+			task.max_level = max_level;
+			task.spares = NIL;
+			task.treecount = 0;
+			task.mean = himean;
+			task.nthreads = nthreads / 2;
+			forked = (pthread_create(&thread, NULL, build_task, &task) == 0);
+			if (!forked)
+			{
+				/* No thread to be had -- do it here, same result */
+				task.nthreads = 1;
+				(void) build_task(&task);
+			}
+
+			tmp = extent[hort+2];  extent[hort+2] = m;
+			loson = build_node(lo, num_lo, extent, NEXTDISC(disc), level+1, max_level, spares, treecount, lomean, nthreads - nthreads/2);
+			extent[hort+2] = tmp;
+
+			if (forked) (void) pthread_join(thread, NULL);
+			hison = task.result;
+			(*treecount) += task.treecount;
+			if (task.spares)
+			{
+				for (last = task.spares; CDR(last); last = CDR(last))
+					;
+				RCDR(last, *spares);
+				*spares = task.spares;
+			}
+		}
+		else
+		{
+			tmp = extent[hort+2];  extent[hort+2] = m;
+			loson = build_node(lo, num_lo, extent, NEXTDISC(disc), level+1, max_level, spares, treecount, lomean, 1);
+			extent[hort+2] = tmp;
 
-		tmp = extent[hort];    extent[hort] = m;
-		hison = build_node(hi, num_hi, extent, NEXTDISC(disc), level+1, max_level, spares, treecount, himean);
-		extent[hort] = tmp;
+			tmp = extent[hort];    extent[hort] = m;
+			hison = build_node(hi, num_hi, extent, NEXTDISC(disc), level+1, max_level, spares, treecount, himean, 1);
+			extent[hort] = tmp;
+		}
 	}
 	else
 	{
@@ -588,12 +1059,234 @@ static KDElem *build_node(kd_list *items, int num, kd_box extent, int disc, int
 	eq->other_bound = ((disc & 0x2) ? hi_min_bound : lo_max_bound);
 	eq->sons[0] = loson;
 	eq->sons[1] = hison;
+	eq->count = 1 + KD_COUNT(loson) + KD_COUNT(hison);
 	(*treecount)++;
     return eq;
 }
 
 
 
+/*
+ * Exact median builds (KD_BUILD_MEDIAN).
+ *
+ * Instead of walking lists around a running mean,  the items are
+ * put in an array and each node is the true median of its items
+ * under the same cyclical comparison find_item() uses: the
+ * discriminating edge first,  then the following edges in turn.
+ * Items that compare less go to the low son,  the rest (including
+ * exact duplicates) to the high son,  so searches and deletes find
+ * everything where they expect it.  The median is found by
+ * introselect -- quickselect that falls back on median of medians
+ * when it takes too many rounds -- so every level costs linear
+ * time,  the depth is about log2(n),  and the build is O(n log n)
+ * no matter how skewed the boxes are.
+ */
+
+static int key_cmp(KDElem *a, KDElem *b, int disc)
+/* Cyclical comparison of `a' and `b' starting at edge `disc' */
+{
+	int i, d;
+
+	for (i = 0, d = disc; i < KD_BOX_MAX; i++, d = NEXTDISC(d))
+	{
+		if (a->size[d] < b->size[d]) return -1;
+		if (a->size[d] > b->size[d]) return 1;
+	}
+	return 0;
+}
+
+#define ELEM_SWAP(a, i, j) \
+	{ KDElem *sw_tmp = (a)[i]; (a)[i] = (a)[j]; (a)[j] = sw_tmp; }
+
+static void partition3(KDElem **a, int lo, int hi, KDElem *pivot, int disc, int *lt, int *gt)
+/*
+ * Three way partition of a[lo..hi] around the value of `pivot':
+ * on return a[lo..lt-1] < pivot,  a[lt..gt] == pivot and
+ * a[gt+1..hi] > pivot.
+ */
+{
+	int i = lo, c;
+
+	*lt = lo;
+	*gt = hi;
+	while (i <= *gt)
+	{
+		c = key_cmp(a[i], pivot, disc);
+		if (c < 0)
+		{
+			ELEM_SWAP(a, *lt, i);
+			(*lt)++;
+			i++;
+		}
+		else if (c > 0)
+		{
+			ELEM_SWAP(a, i, *gt);
+			(*gt)--;
+		}
+		else
+			i++;
+	}
+}
+
+static void select_k(KDElem **a, int n, int k, int disc);
+
+static KDElem *median_of_medians(KDElem **a, int lo, int hi, int disc)
+/* Returns a pivot guaranteed to fall between the 30th and 70th percentile */
+{
+	int g, i, j, first, last, ngroups = 0;
+
+	for (first = lo; first <= hi; first += 5)
+	{
+		last = MIN(first + 4, hi);
+		/* Insertion sort of the group of (at most) five */
+		for (i = first + 1; i <= last; i++)
+			for (j = i; j > first && key_cmp(a[j-1], a[j], disc) > 0; j--)
+				ELEM_SWAP(a, j-1, j);
+		g = first + (last - first) / 2;
+		ELEM_SWAP(a, lo + ngroups, g);
+		ngroups++;
+	}
+	select_k(a + lo, ngroups, ngroups / 2, disc);
+	return a[lo + ngroups / 2];
+}
+
+static void select_k(KDElem **a, int n, int k, int disc)
+/*
+ * Rearranges a[0..n-1] so that a[k] is the item that would be there
+ * if the array were sorted,  with nothing greater before it and
+ * nothing less after it.
+ */
+{
+	int lo = 0, hi = n - 1, lt, gt, mid, budget;
+	KDElem *pivot;
+
+	for (budget = 4, mid = n; mid > 1; mid >>= 1) budget += 2;
+	while (hi > lo)
+	{
+		if (budget-- > 0)
+		{
+			/* Median of three */
+			mid = lo + (hi - lo) / 2;
+			if (key_cmp(a[mid], a[lo], disc) < 0) ELEM_SWAP(a, mid, lo);
+			if (key_cmp(a[hi], a[lo], disc) < 0) ELEM_SWAP(a, hi, lo);
+			if (key_cmp(a[hi], a[mid], disc) < 0) ELEM_SWAP(a, hi, mid);
+			pivot = a[mid];
+		}
+		else
+			pivot = median_of_medians(a, lo, hi, disc);
+		partition3(a, lo, hi, pivot, disc, &lt, &gt);
+		if (k < lt) hi = lt - 1;
+		else if (k > gt) lo = gt + 1;
+		else return;
+	}
+}
+
+static KDElem *build_median(KDElem **elems, int num, int disc, int level, int max_level, kd_list **spares, int *treecount, int nthreads)
+// KDElem **elems;		/* Items to insert, in any order */
+// int num;			/* Number of items               */
+// int disc;			/* Discriminator                 */
+// int level, max_level;	/* As for build_node()           */
+// kd_list **spares;		/* List to put leftovers on      */
+// int *treecount;		/* Count of nodes built          */
+// int nthreads;		/* Threads this subtree may use  */
+/*
+ * Builds the subtree for `elems' around their exact median and
+ * returns its root.  The array is reordered in place.
+ */
+{
+	KDElem *node, *loson, *hison;
+	int hort, k, j, i, num_hi;
+	int lo_min_bound, lo_max_bound, hi_min_bound, hi_max_bound;
+
+	if (num == 0) return (KDElem *) 0;
+
+	/* Find the median;  the low son gets only what is strictly less */
+	k = num / 2;
+	select_k(elems, num, k, disc);
+	node = elems[k];
+	for (i = j = 0; i < k; i++)
+		if (key_cmp(elems[i], node, disc) < 0)
+		{
+			ELEM_SWAP(elems, i, j);
+			j++;
+		}
+	ELEM_SWAP(elems, j, k);
+	node = elems[j];
+	num_hi = num - j - 1;
+
+	/* Bounds,  counting the node itself on both sides as build_node() does */
+	hort = disc & 0x01;
+	lo_min_bound = hi_min_bound = node->size[hort];
+	lo_max_bound = hi_max_bound = node->size[hort+2];
+	for (i = 0; i < j; i++)
+	{
+		lo_min_bound = MIN(lo_min_bound, elems[i]->size[hort]);
+		lo_max_bound = MAX(lo_max_bound, elems[i]->size[hort+2]);
+	}
+	for (i = j + 1; i < num; i++)
+	{
+		hi_min_bound = MIN(hi_min_bound, elems[i]->size[hort]);
+		hi_max_bound = MAX(hi_max_bound, elems[i]->size[hort+2]);
+	}
+
+	if( level >= max_level )
+	{
+		/* Out of depth: everything but the node is inserted later */
+		for (i = 0; i < num; i++)
+			if (i != j) *spares = CONS(elems[i], *spares);
+		loson = hison = (KDElem *) 0;
+	}
+	else if( nthreads > 1 && num >= KD_PAR_CUTOFF )
+	{
+		KDBuildTask task;
+		pthread_t thread;
+		kd_list *last;
+		int forked;
+
+		task.elems = elems + j + 1;
+		task.items = NIL;
+		task.num = num_hi;
+		task.disc = NEXTDISC(disc);
+		task.level = level+1;
+		task.max_level = max_level;
+		task.spares = NIL;
+		task.treecount = 0;
+		task.nthreads = nthreads / 2;
+		forked = (pthread_create(&thread, NULL, build_task, &task) == 0);
+		if (!forked)
+		{
+			task.nthreads = 1;
+			(void) build_task(&task);
+		}
+		loson = build_median(elems, j, NEXTDISC(disc), level+1, max_level, spares, treecount, nthreads - nthreads/2);
+		if (forked) (void) pthread_join(thread, NULL);
+		hison = task.result;
+		(*treecount) += task.treecount;
+		if (task.spares)
+		{
+			for (last = task.spares; CDR(last); last = CDR(last))
+				;
+			RCDR(last, *spares);
+			*spares = task.spares;
+		}
+	}
+	else
+	{
+		loson = build_median(elems, j, NEXTDISC(disc), level+1, max_level, spares, treecount, 1);
+		hison = build_median(elems + j + 1, num_hi, NEXTDISC(disc), level+1, max_level, spares, treecount, 1);
+	}
+
+	node->lo_min_bound = lo_min_bound;
+	node->hi_max_bound = hi_max_bound;
+	node->other_bound = ((disc & 0x2) ? hi_min_bound : lo_max_bound);
+	node->sons[0] = loson;
+	node->sons[1] = hison;
+	node->count = 1 + KD_COUNT(loson) + KD_COUNT(hison);
+	(*treecount)++;
+	return node;
+}
+
+
 #define KD_SIZE(val)	(val)->size
 
 #ifdef OLD_SELECT
@@ -819,8 +1512,8 @@ static void del_elem(KDElem *elem, void (*delfunc)(kd_generic item))
 // KDElem *elem;			/* Element to release */
 // void (*delfunc)();		/* Free function      */
 /*
- * Recursively releases resources associated with `elem'.
- * User data items are freed using `delfunc'.
+ * Recursively hands the user data items under `elem' to `delfunc'.
+ * The nodes themselves go away with their slabs.
  */
 {
     int i;
@@ -835,7 +1528,6 @@ static void del_elem(KDElem *elem, void (*delfunc)(kd_generic item))
 
     /* Now get rid of the rest of it */
     if (delfunc /* 18.02.98 Liburkin add this terrible:*/ && elem->item) (*delfunc)(elem->item);
-    FREE(elem);
 }
 
 void kd_destroy(kd_tree this_one, void (*delfunc)(kd_generic item))
@@ -843,11 +1535,21 @@ void kd_destroy(kd_tree this_one, void (*delfunc)(kd_generic item))
 // void (*delfunc)();		/* Free function called on user data */
 /*
  * This routine frees all resources associated with the
- * specified kd-tree.
+ * specified kd-tree.  Unless there is a `delfunc' to call,
+ * the nodes are not visited at all: their slabs are simply
+ * released.
  */
 {
+	KDTree *realTree = (KDTree *) this_one;
+	KDSlab *slab;
 	
-    del_elem(((KDTree *) this_one)->tree, delfunc);
+	if (realTree->frozen) free_frozen(realTree->frozen, delfunc);
+	if (delfunc) del_elem(realTree->tree, delfunc);
+	while ((slab = realTree->slabs))
+	{
+		realTree->slabs = slab->next;
+		FREE(slab);
+	}
 	FREE(this_one);
 }
 
@@ -878,9 +1580,13 @@ void kd_insert(kd_tree theTree, kd_generic data, kd_box size, kd_generic datas_e
 	KDElem *elem = (KDElem *)datas_elem;
 	
     if (!data) (void) kd_fault(KDF_ZEROID);
+	if (realTree->frozen) (void) kd_fault(KDF_FROZEN);
+	if (!elem)
+		elem = kd_new_node(realTree, data, size, size[0], size[2], size[0],
+						   (KDElem *) 0, (KDElem *) 0);
     if (realTree->tree)
 	{
-		if (find_item(realTree->tree, 0, data, size, 0, elem))
+		if (find_item(realTree->tree, 0, data, size, 0, (KDPath *) 0, elem, &realTree->max_depth))
 		{
 			realTree->item_count += 1;
 			if( size[KD_LEFT] < realTree->extent[KD_LEFT] ) /* the area doesn't contract with deletions,     */
@@ -899,23 +1605,19 @@ void kd_insert(kd_tree theTree, kd_generic data, kd_box size, kd_generic datas_e
     }
 	else
 	{
-		if( elem )
-		{
-			realTree->tree = elem;
-			realTree->tree->item = data;
-			realTree->tree->size[0] = size[0];
-			realTree->tree->size[1] = size[1];
-			realTree->tree->size[2] = size[2];
-			realTree->tree->size[3] = size[3];
-			realTree->tree->lo_min_bound = size[0];
-			realTree->tree->hi_max_bound = size[2];
-			realTree->tree->other_bound = size[0];
-			realTree->tree->sons[0] = 0;
-			realTree->tree->sons[1] = 0;
-		}
-		else
-			realTree->tree = kd_new_node(data, size, size[0], size[2], size[0],
-										 (KDElem *) 0, (KDElem *) 0);
+		realTree->tree = elem;
+		realTree->tree->item = data;
+		realTree->tree->size[0] = size[0];
+		realTree->tree->size[1] = size[1];
+		realTree->tree->size[2] = size[2];
+		realTree->tree->size[3] = size[3];
+		realTree->tree->lo_min_bound = size[0];
+		realTree->tree->hi_max_bound = size[2];
+		realTree->tree->other_bound = size[0];
+		realTree->tree->sons[0] = 0;
+		realTree->tree->sons[1] = 0;
+		realTree->tree->count = 1;
+		realTree->max_depth = MAX(realTree->max_depth, 1);
 		realTree->extent[0] = size[0];
 		realTree->extent[1] = size[1];
 		realTree->extent[2] = size[2];
@@ -927,63 +1629,47 @@ void kd_insert(kd_tree theTree, kd_generic data, kd_box size, kd_generic datas_e
 
 /*
  * The find_item() routine optionally produces a path down to the
- * item in the following global dynamic array if search_p is true.
- * find_item() uses NEW_PATH to record the decent down the tree
- * until it finds the object.  It uses LAST_PATH to mark the
- * last item.
+ * item in a KDPath belonging to the caller.  On the way down it
+ * records each node above the item with path_push(),  root first;
+ * the path is left empty if the item is the root.  The first
+ * PATH_INIT nodes live in the KDPath itself.
  */
 
-static int path_length = 0;
-static int path_alloc = 0;
-static int path_reset = 1;
-static KDElem **path_to_item = (KDElem **) 0;
+static void path_init(KDPath *path)
+{
+	path->elems = path->local;
+	path->length = 0;
+	path->alloc = PATH_INIT;
+}
 
-#define PATH_INIT	50
-#define PATH_INCR	10
+static void path_free(KDPath *path)
+{
+	if (path->elems != path->local) FREE(path->elems);
+}
 
-void NEW_PATH(KDElem *elem)
+static void path_push(KDPath *path, KDElem *elem)
 {
-	if (path_reset)
+	if (path->length >= path->alloc)
 	{
-		path_length = 0;
-		path_reset = 0;
-	}
-	if (path_length >= path_alloc)
-	{
-		if (path_alloc == 0)
+		path->alloc += PATH_INCR;
+		if (path->elems == path->local)
 		{
-			path_alloc = PATH_INIT;
-			path_to_item = MULTALLOC(KDElem *,path_alloc);
+			path->elems = MULTALLOC(KDElem *, path->alloc);
+			memcpy(path->elems, path->local, path->length * sizeof(KDElem *));
 		}
 		else
-		{
-			path_alloc += PATH_INCR;
-			path_to_item = REALLOC(KDElem *, path_to_item, path_alloc);
-		}
+			path->elems = REALLOC(KDElem *, path->elems, path->alloc);
 	}
-	path_to_item[path_length++] = (elem);
+	path->elems[path->length++] = elem;
 }
 
-/*
-  #define NEW_PATH(elem)	\
-  if (path_reset) { path_length = 0;  path_reset = 0; } \
-  if (path_length >= path_alloc) { \
-  if (path_alloc == 0) {path_alloc = PATH_INIT; path_to_item = MULTALLOC(KDElem *,path_alloc); } \
-  else { path_alloc += PATH_INCR; \
-  path_to_item = REALLOC(KDElem *, path_to_item, path_alloc);} \
-  } \
-  path_to_item[path_length++] = (elem)
-*/
-
-#define LAST_PATH 	path_reset = 1
-
-void kd_print_path(void) /* this routine is for debug */
+void kd_print_path(KDPath *path) /* this routine is for debug */
 {
 	int i;
-	for(i=0;i<path_length;i++)
+	for(i=0;i<path->length;i++)
 	{
 		KDElem *elem;
-		elem = path_to_item[i];
+		elem = path->elems[i];
 		printf("%d: \tElem: %ld [%lx] lo=%d hi=%d, other=%d, size= \t(%d\t%d\t%d\t%d)  Loson:%lx[%ld]  HiSon:%lx[%ld]\n",
 			   i,(long)elem->item, (unsigned long)elem,
 			   elem->lo_min_bound, elem->hi_max_bound, elem->other_bound,
@@ -993,17 +1679,19 @@ void kd_print_path(void) /* this routine is for debug */
 	}
 }
 
-
+
 
 /* bounds_update declared in forward declarations block above */
 
-static KDElem *find_item(KDElem *elem, int disc, kd_generic item, kd_box size, int search_p, KDElem *items_elem)
+static KDElem *find_item(KDElem *elem, int level, kd_generic item, kd_box size, int search_p, KDPath *path, KDElem *items_elem, int *depth)
 // KDElem *elem;			/* Search location */
-// int disc;			/* Discriminator   */
+// int level;			/* Level of elem,  root 0 */
 // kd_generic item;		/* Item to insert  */
 // kd_box size;			/* geographic Size of item    */
 // int search_p;			/* Search or insert */
-// KDElem *items_elem;		/* pre-malloc'd container for item */
+// KDPath *path;			/* Path to the item,  if wanted */
+// KDElem *items_elem;		/* node to insert,  holding `item' */
+// int *depth;			/* Raised to the new node's depth */
 /*
  * This routine either searches for or inserts `item'
  * into the node `elem'.  The size of `item' is passed
@@ -1012,18 +1700,19 @@ static KDElem *find_item(KDElem *elem, int disc, kd_generic item, kd_box size, i
  * the routine expects to find the item rather than
  * insert it.  The routine returns either the newly
  * created element or the element found (zero if
- * it couldn't be found).
+ * it couldn't be found).  On insert,  `*depth' is raised to the
+ * number of levels down to the new element if that is more.
  */
 {
     KDElem *result;
     int val, new_disc, vert;
+    int disc = KD_DISC(level);
 
     /* Compare current element against the one we are looking for */
     if (item == elem->item)
 	{
 		if (search_p)
 		{
-			LAST_PATH;
 			if (elem->item) return elem;
 			else return (KDElem *) 0;
 		}
@@ -1049,43 +1738,40 @@ static KDElem *find_item(KDElem *elem, int disc, kd_generic item, kd_box size, i
 		val = (val >= 0);
 		if (elem->sons[val])
 		{
-			if (search_p) NEW_PATH(elem);
-			result = find_item(elem->sons[val], NEXTDISC(disc), item,
-							   size, search_p, items_elem);
-			/* Bounds update if insert */
-			if (!search_p) bounds_update(elem, disc, size);
+			if (search_p && path) path_push(path, elem);
+			result = find_item(elem->sons[val], level + 1, item,
+							   size, search_p, path, items_elem, depth);
+			/* Bounds and count update if insert */
+			if (!search_p)
+			{
+				bounds_update(elem, disc, size);
+				if (result) elem->count++;
+			}
 			/* ^ this is where we jump up the tree after insert and fix the
 			   bounds above us in the tree */
 			return result;
 		}
 		else if (search_p)
 		{
-			LAST_PATH;
 			return (KDElem *) 0;
 		}
 		else
 		{
 			/* Insert here */
 			vert = NEXTDISC(disc) & 0x01;
-			if( items_elem )
-			{
-				elem->sons[val] = items_elem;
-				items_elem->size[0] = size[0];
-				items_elem->size[1] = size[1];
-				items_elem->size[2] = size[2];
-				items_elem->size[3] = size[3];
-				items_elem->lo_min_bound = size[vert];
-				items_elem->hi_max_bound = size[vert+2];
-				items_elem->other_bound = ((NEXTDISC(disc)&0x2) ? size[vert] : size[vert+2]);
-				items_elem->sons[0] = 0;
-				items_elem->sons[1] = 0;
-				
-			}
-			else
-				elem->sons[val] =
-					kd_new_node(item, size, size[vert], size[vert+2],
-								((NEXTDISC(disc)&0x2) ? size[vert] : size[vert+2]),
-								(KDElem *) 0, (KDElem *) 0);
+			elem->sons[val] = items_elem;
+			items_elem->size[0] = size[0];
+			items_elem->size[1] = size[1];
+			items_elem->size[2] = size[2];
+			items_elem->size[3] = size[3];
+			items_elem->lo_min_bound = size[vert];
+			items_elem->hi_max_bound = size[vert+2];
+			items_elem->other_bound = ((NEXTDISC(disc)&0x2) ? size[vert] : size[vert+2]);
+			items_elem->sons[0] = 0;
+			items_elem->sons[1] = 0;
+			items_elem->count = 1;
+			elem->count++;
+			if (level + 2 > *depth) *depth = level + 2;
 			/* Bounds update */
 			bounds_update(elem, disc, size);
 			return elem->sons[val];
@@ -1131,7 +1817,8 @@ kd_status kd_is_member(kd_tree theTree, kd_generic data, kd_box size)
 {
     KDTree *real_tree = (KDTree *) theTree;
     
-    if (find_item(real_tree->tree, 0, data, size, 1, 0)) {
+    if (real_tree->frozen) return frozen_find(real_tree->frozen, data, size);
+    if (find_item(real_tree->tree, 0, data, size, 1, (KDPath *) 0, 0, (int *) 0)) {
 	return KD_OK;
     } else {
 	return KD_NOTFOUND;
@@ -1165,20 +1852,31 @@ kd_status kd_delete(kd_tree theTree, kd_generic data, kd_box old_size)
 {
     KDTree *real_tree = (KDTree *) theTree;
     KDElem *elem;
+    KDPath path;
+    kd_status status;
 
-    elem = find_item(real_tree->tree, 0, data, old_size, 1, 0);
+    if (real_tree->frozen) return kd_set_error(KD_NOTIMPL);
+    path_init(&path);
+    elem = find_item(real_tree->tree, 0, data, old_size, 1, &path, 0, (int *) 0);
     if (elem) {
+	int i;
+
 	/* Delete element */
 	elem->item = (kd_generic) 0;
+	elem->count--;
+	for (i = 0;  i < path.length;  i++) path.elems[i]->count--;
 	(real_tree->dead_count)++;
-	return del_element(real_tree, elem, path_length);
+	status = del_element(real_tree, elem, &path, path.length);
     } else {
-	return kd_set_error(KD_NOTFOUND);
+	status = kd_set_error(KD_NOTFOUND);
     }
+    path_free(&path);
+    return status;
 }
 
-static long kddel_number_tried=0;
-static long kddel_number_deld=0;
+/* Work done by the last kd_really_delete() on this thread */
+static _Thread_local long kddel_number_tried=0;
+static _Thread_local long kddel_number_deld=0;
 
 
 void kd_delete_stats(int *tries,int *levs)
@@ -1215,37 +1913,49 @@ kd_status kd_really_delete(kd_tree theTree, kd_generic data, kd_box old_size, in
 {
     KDTree *real_tree = (KDTree *) theTree;
     KDElem *elem,*elemdad,*newelem;
+	KDPath path;
 	int j;
 	kddel_number_tried = 0;
 	kddel_number_deld = 1;
+	if (real_tree->frozen)
+	{
+		*num_tries = *num_del = 0;
+		return kd_set_error(KD_NOTIMPL);
+	}
 	
-    elem = find_item(real_tree->tree, 0, data, old_size, 1,0);
+    path_init(&path);
+    elem = find_item(real_tree->tree, 0, data, old_size, 1, &path, 0, (int *) 0);
     if (elem)
 	{
 		if (elem == real_tree->tree)
 		{
-			/* Deleting the root node -- path_to_item has no ancestors recorded,
-			   and path_length is stale. Root always has discriminator 0. */
+			/* Deleting the root node -- the path has no ancestors recorded.
+			   Root always has discriminator 0. */
 			j = 0;
 			newelem = kd_do_delete(real_tree, elem, j);
 			real_tree->tree = newelem;
 		}
 		else
 		{
-			elemdad = path_to_item[path_length-1];
+			int i;
+
+			for (i = 0;  i < path.length;  i++) path.elems[i]->count--;
+			elemdad = path.elems[path.length-1];
 			/* Delete element */
-			j = KD_DISC(path_length);
+			j = KD_DISC(path.length);
 			newelem = kd_do_delete(real_tree,elem,j);
 			if( elemdad->sons[KD_HISON] == elem )
 				elemdad->sons[KD_HISON] = newelem;
 			else
 				elemdad->sons[KD_LOSON] = newelem;
 		}
-		FREE(elem);
+		free_elem(real_tree, elem);
 		real_tree->item_count--;
+		path_free(&path);
 	}
 	else
 	{
+		path_free(&path);
 		*num_tries = 0;
 		*num_del = 0;
 		return KD_NOTFOUND;
@@ -1267,9 +1977,8 @@ KDElem *kd_do_delete(KDTree *real_tree, KDElem *elem, int j)
 {
 	KDElem *Q,*Qdad;
 	int Qson;
-	static char flip = 0;
 
-	flip = !flip;
+	real_tree->flip = !real_tree->flip;
 	
 	/* Delete element */
 	if( !elem->sons[KD_HISON] && !elem->sons[KD_LOSON])
@@ -1278,27 +1987,33 @@ KDElem *kd_do_delete(KDTree *real_tree, KDElem *elem, int j)
 	}
 	else
 	{
-		int newj;
+		KDElem **path;
+		int newj, path_len, i;
 
+		path = MULTALLOC(KDElem *, real_tree->max_depth);
 		Qdad = elem;
 		if( !elem->sons[KD_HISON])
-			flip = 0;
+			real_tree->flip = 0;
 		else if( !elem->sons[KD_LOSON] )
-			flip = 1;
-		if( !flip ) /* loson */
+			real_tree->flip = 1;
+		if( !real_tree->flip ) /* loson */
 		{
 			Q = elem->sons[KD_LOSON];
 			Qson = KD_LOSON;
 			newj = NEXTDISC(j);
-			kddel_number_tried += find_min_max_node(j,&Q,&Qdad,&Qson,&newj);
+			kddel_number_tried += find_min_max_node(j,&Q,&Qdad,&Qson,&newj,path,&path_len);
 		}
 		else  /* hison */
 		{
 			Q = elem->sons[KD_HISON];
 			Qson = KD_HISON;
 			newj = NEXTDISC(j);
-			kddel_number_tried += find_min_max_node(j,&Q,&Qdad,&Qson,&newj);
+			kddel_number_tried += find_min_max_node(j,&Q,&Qdad,&Qson,&newj,path,&path_len);
 		}
+		/* Q moves up out of the subtrees between here and its old spot */
+		if (Q->item)
+			for (i = 0;  i < path_len;  i++) path[i]->count--;
+		FREE(path);
 		Qdad->sons[Qson] = kd_do_delete(real_tree, Q, newj);
 		kddel_number_deld++;
 		Q->sons[KD_LOSON] = elem->sons[KD_LOSON];
@@ -1306,6 +2021,7 @@ KDElem *kd_do_delete(KDTree *real_tree, KDElem *elem, int j)
 		Q->lo_min_bound = elem->lo_min_bound; /* you have to inherit the bounds information as well */
 		Q->other_bound = elem->other_bound;
 		Q->hi_max_bound = elem->hi_max_bound;
+		Q->count = elem->count - (elem->item != 0);
 		/* fprintf(stderr,"<del=%d>",(int)(Q->item)+1); */
 		return Q;
 	}
@@ -1314,14 +2030,15 @@ KDElem *kd_do_delete(KDTree *real_tree, KDElem *elem, int j)
 
 
 
-static kd_status del_element(KDTree *tree, KDElem *elem, int spot)
+static kd_status del_element(KDTree *tree, KDElem *elem, KDPath *path, int spot)
 // KDTree *tree;			/* Tree              */
 // KDElem *elem;			/* Item to delete    */
+// KDPath *path;			/* Path down to it   */
 // int spot;			/* Last item in path */
 /*
  * This routine deletes `elem' from its tree.  It assumes that
  * the path information down to the element is stored in
- * path_to_item (see find_item() for details).  If the node
+ * `path' (see find_item() for details).  If the node
  * has no children,  it is deleted and the counts are modified
  * appropriately.  The routine is called recursively on its
  * parent.  If it has children,  it is left and the recursion
@@ -1334,24 +2051,24 @@ static kd_status del_element(KDTree *tree, KDElem *elem, int spot)
 		{
 			if (spot > 0)
 			{
-				if (path_to_item[spot-1]->sons[KD_LOSON] == elem)
+				if (path->elems[spot-1]->sons[KD_LOSON] == elem)
 				{
-					path_to_item[--spot]->sons[KD_LOSON] = (KDElem *) 0;
-				} else if (path_to_item[spot-1]->sons[KD_HISON] == elem)
+					path->elems[--spot]->sons[KD_LOSON] = (KDElem *) 0;
+				} else if (path->elems[spot-1]->sons[KD_HISON] == elem)
 				{
-					path_to_item[--spot]->sons[KD_HISON] = (KDElem *) 0;
+					path->elems[--spot]->sons[KD_HISON] = (KDElem *) 0;
 				} else
 				{
 					(void) kd_fault(KDF_F);
 				}
-				FREE(elem);
+				free_elem(tree, elem);
 				(tree->dead_count)--;
 				(tree->item_count)--;
-				return del_element(tree, path_to_item[spot], spot);
+				return del_element(tree, path->elems[spot], path, spot);
 			} else
 			{
 				tree->tree = (KDElem *) 0;
-				FREE(elem);
+				free_elem(tree, elem);
 				(tree->dead_count)--;
 				(tree->item_count)--;
 				return KD_OK;
@@ -1406,26 +2123,129 @@ static void kd_push(KDState *gen, KDElem *elem, short disc)
     (gen)->stk[(gen)->top_index].state = KD_THIS_ONE;		     \
     (gen)->stk[(gen)->top_index].item = (elem);			     \
     (gen)->top_index += 1;
+/* The bounds are copied out first:  they may live in the stack itself */
 #define KD_PUSHB(gen, elem, dk, Bxn, Bxp) \
+    {								     \
+    kd_box bn_, bp_;						     \
+    bn_[0] = Bxn[0];  bn_[1] = Bxn[1];  bn_[2] = Bxn[2];  bn_[3] = Bxn[3]; \
+    bp_[0] = Bxp[0];  bp_[1] = Bxp[1];  bp_[2] = Bxp[2];  bp_[3] = Bxp[3]; \
+    KD_PUSH(gen, elem, dk)					     \
+    KD_SETB(gen, bn_, bp_);					     \
+    }
+
+#endif
+
+/* Same as KD_PUSH,  for node `idx' of a frozen tree */
+#define KD_PUSHF(gen, idx, dk) \
     if ((gen)->top_index >= (gen)->stack_size) {                     \
 	(gen)->stack_size += KD_GROWSIZE((gen)->stack_size);	     \
 	(gen)->stk = REALLOC(KDSave, (gen)->stk, (gen)->stack_size); \
     }								     \
     (gen)->stk[(gen)->top_index].disc = (dk);		     	     \
     (gen)->stk[(gen)->top_index].state = KD_THIS_ONE;		     \
-    (gen)->stk[(gen)->top_index].item = (elem);			     \
-    (gen)->stk[(gen)->top_index].Bn[0] = Bxn[0];			     \
-    (gen)->stk[(gen)->top_index].Bn[1] = Bxn[1];			     \
-    (gen)->stk[(gen)->top_index].Bn[2] = Bxn[2];			     \
-    (gen)->stk[(gen)->top_index].Bn[3] = Bxn[3];			     \
-    (gen)->stk[(gen)->top_index].Bp[0] = Bxp[0];			     \
-    (gen)->stk[(gen)->top_index].Bp[1] = Bxp[1];			     \
-    (gen)->stk[(gen)->top_index].Bp[2] = Bxp[2];			     \
-    (gen)->stk[(gen)->top_index].Bp[3] = Bxp[3];			     \
-    (gen)->top_index += 1
+    (gen)->stk[(gen)->top_index].node = (idx);			     \
+    (gen)->top_index += 1;
 
-#endif
-static int kd_data_tries;
+/* Sets the nearest neighbor bounds of the element just pushed */
+#define KD_SETB(gen, Bxn, Bxp) \
+    (gen)->stk[(gen)->top_index-1].Bn[0] = Bxn[0];		     \
+    (gen)->stk[(gen)->top_index-1].Bn[1] = Bxn[1];		     \
+    (gen)->stk[(gen)->top_index-1].Bn[2] = Bxn[2];		     \
+    (gen)->stk[(gen)->top_index-1].Bn[3] = Bxn[3];		     \
+    (gen)->stk[(gen)->top_index-1].Bp[0] = Bxp[0];		     \
+    (gen)->stk[(gen)->top_index-1].Bp[1] = Bxp[1];		     \
+    (gen)->stk[(gen)->top_index-1].Bp[2] = Bxp[2];		     \
+    (gen)->stk[(gen)->top_index-1].Bp[3] = Bxp[3]
+
+/* Sets the box holding the subtree of the element just pushed */
+#define KD_SETBOX(gen, box) \
+    (gen)->stk[(gen)->top_index-1].Bp[0] = (box)[0];		     \
+    (gen)->stk[(gen)->top_index-1].Bp[1] = (box)[1];		     \
+    (gen)->stk[(gen)->top_index-1].Bp[2] = (box)[2];		     \
+    (gen)->stk[(gen)->top_index-1].Bp[3] = (box)[3]
+
+/*
+ * The son bound tests of kd_next() (see the bounds explanation there),
+ * for use on any kind of node:  can the low (high) son of `node',
+ * split on edge `m',  hold anything that touches `ext'?
+ */
+#define KD_LO_OVERLAP(ext, node, m, hort) \
+    (((m) & 0x02) ? \
+     (((ext)[hort] <= (node)->size[m]) && ((ext)[(hort)+2] >= (node)->lo_min_bound)) : \
+     (((ext)[hort] <= (node)->other_bound) && ((ext)[(hort)+2] >= (node)->lo_min_bound)))
+#define KD_HI_OVERLAP(ext, node, m, hort) \
+    (((m) & 0x02) ? \
+     (((ext)[hort] <= (node)->hi_max_bound) && ((ext)[(hort)+2] >= (node)->other_bound)) : \
+     (((ext)[hort] <= (node)->hi_max_bound) && ((ext)[(hort)+2] >= (node)->size[m])))
+
+/*
+ * Narrows `box',  which holds every item under `node',  to a box
+ * holding every item under its son `son':  the same bounds give how
+ * far the son's items can reach along edge `m'.
+ */
+#define KD_SON_BOX(box, node, m, son) \
+    do { \
+	int h_ = (m) & 0x01; \
+	if ((son) == KD_LOSON) { \
+	    (box)[h_] = MAX((box)[h_], (node)->lo_min_bound); \
+	    (box)[h_+2] = MIN((box)[h_+2], ((m) & 0x02) ? (node)->size[m] : (node)->other_bound); \
+	} else { \
+	    (box)[h_] = MAX((box)[h_], ((m) & 0x02) ? (node)->other_bound : (node)->size[m]); \
+	    (box)[h_+2] = MIN((box)[h_+2], (node)->hi_max_bound); \
+	} \
+    } while (0)
+
+/*
+ * kd_start_mode() tests.  An item matches `area' in `mode' if it
+ * touches it,  lies within it or contains it.  In KD_WITHIN mode a
+ * son can also be passed over by its key:  a low son split on a low
+ * edge has no box starting after the key,  and a high son split on a
+ * high edge none ending before it.
+ */
+#define KD_MATCH(mode, area, size) \
+    ((mode) == KD_INTERSECTS ? BOXINTERSECT(area, size) : \
+     (mode) == KD_WITHIN ? BOXWITHIN(size, area) : BOXWITHIN(area, size))
+#define KD_LO_WITHIN(ext, node, m)	(((m) & 0x02) || (ext)[m] <= (node)->size[m])
+#define KD_HI_WITHIN(ext, node, m)	(!((m) & 0x02) || (ext)[m] >= (node)->size[m])
+static _Thread_local int kd_data_tries;	/* readers may run on several threads at once */
+
+static void gen_begin(KDState *newState, kd_box area)
+/* Starts (or restarts) a generation of the items in `area' */
+{
+    int i;
+
+	newState->tries = 0;
+    for (i = 0;  i < KD_BOX_MAX;  i++) newState->extent[i] = area[i];
+	/*
+	 * A box containing the area reaches past both of its sides, so in
+	 * KD_CONTAINS mode the son bound tests are given the area turned
+	 * inside out:  a son passes if its boxes can start before the
+	 * area starts and end after it ends.
+	 */
+	for (i = 0;  i < KD_BOX_MAX;  i++)
+		newState->prune[i] = (newState->mode == KD_CONTAINS) ? area[i ^ 2] : area[i];
+    newState->top_index = 0;
+	newState->inside = -1;
+
+    /* Initialize search state */
+	if (newState->frozen)
+	{
+		if (newState->frozen->num_nodes)
+		{
+			KD_PUSHF(newState, 0, 0);
+			KD_SETBOX(newState, newState->tree->extent);
+		}
+	}
+    else if (newState->tree->tree)
+	{
+		KD_PUSH(newState, newState->tree->tree, 0);
+		KD_SETBOX(newState, newState->tree->extent);
+    }
+	else
+	{
+		newState->top_index = -1;
+    }
+}
 
 kd_gen kd_start(kd_tree theTree, kd_box area)
 // kd_tree theTree;		/* Tree to generate from */
@@ -1435,34 +2255,116 @@ kd_gen kd_start(kd_tree theTree, kd_box area)
  * to generate all items intersecting `area'.
  * The items are actually returned by kd_next.  Once the
  * sequence is finished,  kd_end should be called.
+ * The stack is sized from the depth of the tree,  so it
+ * does not normally have to grow.
+ */
+{
+	return kd_start_mode(theTree, area, KD_INTERSECTS);
+}
+
+kd_gen kd_start_mode(kd_tree theTree, kd_box area, int mode)
+/*
+ * Same as kd_start(),  but generates the items that intersect
+ * `area',  lie within it or contain it,  as `mode' is
+ * KD_INTERSECTS,  KD_WITHIN or KD_CONTAINS.  Any other mode
+ * returns zero and sets KD_BADARG.
  */
 {
-    KDElem *realTree = ((KDTree *) theTree)->tree;
     KDState *newState;
-    int i;
 
+	if (mode != KD_INTERSECTS && mode != KD_WITHIN && mode != KD_CONTAINS)
+	{
+		kd_set_error(KD_BADARG);
+		return (kd_gen) 0;
+	}
     newState = ALLOC(KDState);
+	newState->mode = mode;
+    newState->tree = (KDTree *) theTree;
+	newState->frozen = newState->tree->frozen;
+    newState->stack_size = MAX(KD_INIT_STACK, newState->tree->max_depth + 1);
+    newState->stk = MULTALLOC(KDSave, newState->stack_size);
+	newState->local = (KDSave *) 0;
+	newState->owned = 1;
+	gen_begin(newState, area);
+    return (kd_gen) newState;
+}
 
-	kd_data_tries = 0;
-    for (i = 0;  i < KD_BOX_MAX;  i++) newState->extent[i] = area[i];
-
-    newState->stack_size = KD_INIT_STACK;
-    newState->top_index = 0;
-    newState->stk = MULTALLOC(KDSave, KD_INIT_STACK);
-
-    /* Initialize search state */
-    if (realTree)
+kd_gen kd_gen_init(kd_gen_storage *buf, kd_tree theTree, kd_box area)
+/*
+ * Same as kd_start(),  but the generator lives in `buf',  which
+ * belongs to the caller:  the stack is kept there too unless the
+ * tree is more than KD_GEN_FRAMES levels deep.  kd_finish() must
+ * still be called,  but frees nothing else.
+ */
+{
+    KDState *newState = (KDState *) buf;
+
+    newState->tree = (KDTree *) theTree;
+	newState->frozen = newState->tree->frozen;
+	newState->local = (KDSave *) (newState + 1);
+	newState->owned = 0;
+	newState->mode = KD_INTERSECTS;
+	if (newState->tree->max_depth + 1 <= KD_GEN_FRAMES)
 	{
-		KD_PUSH(newState, realTree, 0);
-    }
+		newState->stack_size = KD_GEN_FRAMES;
+		newState->stk = newState->local;
+	}
 	else
 	{
-		newState->top_index = -1;
-    }
+		newState->stack_size = newState->tree->max_depth + 1;
+		newState->stk = MULTALLOC(KDSave, newState->stack_size);
+	}
+	gen_begin(newState, area);
     return (kd_gen) newState;
 }
 
-
+void kd_gen_reset(kd_gen theGen, kd_box area)
+/*
+ * Starts `theGen' over on the same tree with a new `area',  keeping
+ * its stack and mode.  The tree must not have been changed since the
+ * generator was started.
+ */
+{
+	gen_begin((KDState *) theGen, area);
+}
+
+
+static int next_inside(KDState *realGen, kd_generic *data, kd_box size)
+/*
+ * kd_next() below realGen->inside,  where every subtree lies wholly in
+ * the area:  the frames there are just nodes still to be visited,  and
+ * every live item is returned without testing anything.  Returns zero
+ * once they are all done.
+ */
+{
+	KDElem *elem;
+
+	while (realGen->top_index > realGen->inside)
+	{
+		elem = realGen->stk[--realGen->top_index].item;
+		realGen->tries++;
+		if (elem->sons[KD_HISON])
+		{
+			KD_PUSH(realGen, elem->sons[KD_HISON], 0);
+		}
+		if (elem->sons[KD_LOSON])
+		{
+			KD_PUSH(realGen, elem->sons[KD_LOSON], 0);
+		}
+		if (elem->item)
+		{
+			*data = elem->item;
+			if (size) {
+			    size[0] = elem->size[0];  size[1] = elem->size[1];
+			    size[2] = elem->size[2];  size[3] = elem->size[3];
+			}
+			return 1;
+		}
+	}
+	realGen->inside = -1;
+	return 0;
+}
+
 kd_status kd_next(kd_gen theGen, kd_generic *data, kd_box size)
 // kd_gen theGen;			/* Current generator */
 // kd_generic *data;		/* Returned data     */
@@ -1478,7 +2380,12 @@ kd_status kd_next(kd_gen theGen, kd_generic *data, kd_box size)
     register KDElem *top_item;
     short hort,m;
 
+    if (realGen->frozen) return frozen_next(realGen, data, size);
     while (realGen->top_index > 0) {
+	if (realGen->inside >= 0) {
+	    if (next_inside(realGen, data, size)) return KD_OK;
+	    continue;
+	}
 	top_elem = &(realGen->stk[realGen->top_index-1]);
 	top_item = top_elem->item;
 	hort = top_elem->disc & 0x01;/* the split line is zero: vertical, one: horizontal */
@@ -1486,10 +2393,15 @@ kd_status kd_next(kd_gen theGen, kd_generic *data, kd_box size)
 	
 	switch (top_elem->state) {
 	case KD_THIS_ONE:
+	    if (realGen->mode != KD_CONTAINS && BOXWITHIN(top_elem->Bp, realGen->extent)) {
+		/* All of this subtree is in the area */
+		realGen->inside = realGen->top_index - 1;
+		break;
+	    }
 		/* Check this one */
-		kd_data_tries++;
+		realGen->tries++;
 	
-	    if (top_item->item && BOXINTERSECT(realGen->extent, top_item->size)) {
+	    if (top_item->item && KD_MATCH(realGen->mode, realGen->extent, top_item->size)) {
 		*data = top_item->item;
 		if (size) {
 		    size[0] = top_item->size[0];  size[1] = top_item->size[1];
@@ -1517,15 +2429,22 @@ kd_status kd_next(kd_gen theGen, kd_generic *data, kd_box size)
 	    /* See if we push on the loson */
 	    if (top_item->sons[KD_LOSON] &&
 		((m & 0x02) ?			/* RIGHT or TOP */
-		 ((realGen->extent[hort] <= top_item->size[m]) && /* LEFT or BOTTOM of region less thn key (an upper bound for left)*/
-		  (realGen->extent[hort+2] >= top_item->lo_min_bound)) /* RIGHT or TOP grthan lominbound */
+		 ((realGen->prune[hort] <= top_item->size[m]) && /* LEFT or BOTTOM of region less thn key (an upper bound for left)*/
+		  (realGen->prune[hort+2] >= top_item->lo_min_bound)) /* RIGHT or TOP grthan lominbound */
 		 :						/* LEFT or BOTTOM */
-		 ((realGen->extent[hort] <= top_item->other_bound) && /* LEFT or BOTTOM of reg lessthan obound */
-		  (realGen->extent[hort+2] >= top_item->lo_min_bound)))) /* RIGHT or TOP grthan lominbound */
+		 ((realGen->prune[hort] <= top_item->other_bound) && /* LEFT or BOTTOM of reg lessthan obound */
+		  (realGen->prune[hort+2] >= top_item->lo_min_bound))) && /* RIGHT or TOP grthan lominbound */
+		(realGen->mode != KD_WITHIN || KD_LO_WITHIN(realGen->extent, top_item, m)))
 		{
+			kd_box son_box;
+
+			son_box[0] = top_elem->Bp[0];  son_box[1] = top_elem->Bp[1];
+			son_box[2] = top_elem->Bp[2];  son_box[3] = top_elem->Bp[3];
+			KD_SON_BOX(son_box, top_item, m, KD_LOSON);
 			top_elem->state += 1;
 			KD_PUSH(realGen, top_item->sons[KD_LOSON],
 					NEXTDISC(m));
+			KD_SETBOX(realGen, son_box);
 	    } else
 		{
 			top_elem->state += 1;
@@ -1535,15 +2454,22 @@ kd_status kd_next(kd_gen theGen, kd_generic *data, kd_box size)
 	    /* See if we push on the hison */
 	    if (top_item->sons[KD_HISON] &&
 		((m & 0x02) ?			/* RIGHT or TOP */
-		 ((realGen->extent[hort] <= top_item->hi_max_bound) && /* LEFT or BOTTOM of region lessthan himax */
-		  (realGen->extent[hort+2] >= top_item->other_bound)) /* RIGHT or TOP grthan obound */
+		 ((realGen->prune[hort] <= top_item->hi_max_bound) && /* LEFT or BOTTOM of region lessthan himax */
+		  (realGen->prune[hort+2] >= top_item->other_bound)) /* RIGHT or TOP grthan obound */
 		 :						/* LEFT or BOTTOM */
-		 ((realGen->extent[hort] <= top_item->hi_max_bound) && /* LEFT or BOTTOM of region lessthn himax */
-		  (realGen->extent[hort+2] >= top_item->size[m])))) /* RIGHT or TOP grthan key (a minimum for the right side*/
+		 ((realGen->prune[hort] <= top_item->hi_max_bound) && /* LEFT or BOTTOM of region lessthn himax */
+		  (realGen->prune[hort+2] >= top_item->size[m]))) && /* RIGHT or TOP grthan key (a minimum for the right side*/
+		(realGen->mode != KD_WITHIN || KD_HI_WITHIN(realGen->extent, top_item, m)))
 		{
+			kd_box son_box;
+
+			son_box[0] = top_elem->Bp[0];  son_box[1] = top_elem->Bp[1];
+			son_box[2] = top_elem->Bp[2];  son_box[3] = top_elem->Bp[3];
+			KD_SON_BOX(son_box, top_item, m, KD_HISON);
 			top_elem->state += 1;
 			KD_PUSH(realGen, top_item->sons[KD_HISON],
 					NEXTDISC(m));
+			KD_SETBOX(realGen, son_box);
 	    } else
 		{
 			top_elem->state += 1;
@@ -1569,10 +2495,11 @@ int kd_finish(kd_gen theGen)
  */
 {
     KDState *realGen = (KDState *) theGen;
+	int tries = realGen->tries;
 
-    FREE(realGen->stk);
-    FREE(realGen);
-	return kd_data_tries;
+    if (realGen->stk != realGen->local) FREE(realGen->stk);
+    if (realGen->owned) FREE(realGen);
+	return tries;
 }
 
 
@@ -1623,7 +2550,7 @@ void kd_print(kd_tree tree)
 {
     KDTree *realTree = (KDTree *) tree;
 
-    pr_tree(realTree->tree, 0, 0);
+    if (realTree->tree) pr_tree(realTree->tree, 0, 0);
 }
 
 #endif
@@ -1632,26 +2559,28 @@ void kd_print(kd_tree tree)
 /* ************** kd_tree_badness -- some metrics of tree health   ************************************** */
 /* Coded by Steve Murphy,  Sept 1990                                                  */
 
-static double kd_tree_badness_factor1 = 0.0;
-static double kd_tree_badness_factor2 = 0.0;
-static double kd_tree_badness_factor3 = 0.0;  /* count of one-son nodes */
-static int kd_tree_max_levels = 0;
+typedef struct {
+	double factor1;
+	double factor2;
+	double factor3;		/* count of one-son nodes */
+	int max_levels;
+} KDBadness;
 
-static void kd_tree_badness_level(KDElem *elem, int level)
+static void kd_tree_badness_level(KDBadness *bad, KDElem *elem, int level)
 {
     if( !elem )
 	return;
     if( (elem->sons[1] || elem->sons[0]) && !(elem->sons[1] && elem->sons[0]))
 	{
-		kd_tree_badness_factor3++;
+		bad->factor3++;
 	}
-	if( level > kd_tree_max_levels )
-		kd_tree_max_levels = level;
+	if( level > bad->max_levels )
+		bad->max_levels = level;
 	
 	if( elem->sons[0] )
-		kd_tree_badness_level(elem->sons[0], level+1);
+		kd_tree_badness_level(bad, elem->sons[0], level+1);
 	if( elem->sons[1] )
-		kd_tree_badness_level(elem->sons[1], level+1);
+		kd_tree_badness_level(bad, elem->sons[1], level+1);
 }
 
 /* right now, fact1 is not used. fact2 is the ratio of current tree max depth to minimum possible depth with number
@@ -1659,20 +2588,21 @@ static void kd_tree_badness_level(KDElem *elem, int level)
 static void kd_tree_badness(KDTree *tree, double *fact1, double *fact2, double *fact3, int *levs)
 {
 	double targdepth,log(double),floor(double);
-	kd_tree_badness_factor1 = 0.0;
-	kd_tree_badness_factor2 = 0.0;
-	kd_tree_badness_factor3 = 0.0;
-	kd_tree_max_levels = 0;
+	KDBadness bad;
+	bad.factor1 = 0.0;
+	bad.factor2 = 0.0;
+	bad.factor3 = 0.0;
+	bad.max_levels = 0;
 	targdepth = tree->item_count;
 	targdepth = log(targdepth)/log(2.0);
 	targdepth = floor(targdepth);
 	targdepth++;
-	kd_tree_badness_level(tree->tree,1);
-	*fact1 = kd_tree_badness_factor1;
-	targdepth = (double)kd_tree_max_levels/targdepth;
+	kd_tree_badness_level(&bad, tree->tree,1);
+	*fact1 = bad.factor1;
+	targdepth = (double)bad.max_levels/targdepth;
 	*fact2 = targdepth;
-	*fact3 = kd_tree_badness_factor3;
-	*levs = kd_tree_max_levels;
+	*fact3 = bad.factor3;
+	*levs = bad.max_levels;
 }
 
 void kd_badness(kd_tree tree)
@@ -1694,18 +2624,27 @@ void collect_nodes(kd_tree, kd_list *, kd_list **, kd_box, long *, double *);
 /* NOT TESTED YET!  */
 
 kd_tree kd_rebuild(kd_tree Tree)
+{
+	return kd_rebuild_parallel(Tree, 1);
+}
+
+kd_tree kd_rebuild_parallel(kd_tree Tree, int nthreads)
 {
 	KDTree *newTree= (KDTree *)Tree;
 	
-    kd_list *items = (kd_list *)0, *spares = (kd_list *)0;
+    kd_list *items = (kd_list *)0;
     kd_box extent;
-	long item_count = 0,count=0;
+	long item_count = 0;
 	double mean=0.0;
 	/* rip the tree apart, discarding dead nodes, and rebuild it */
 
+	if (!newTree->tree || newTree->frozen)
+		return (kd_tree) newTree;
+
     /* First build up list of items and their overall extent */
     unload_items((kd_tree)newTree, &items, newTree->extent, &item_count, &mean);
-	
+	newTree->tree = (KDElem *) 0;
+	newTree->max_depth = 0;
 
 	/* rebuild the tree */
     if (!items)
@@ -1714,29 +2653,11 @@ kd_tree kd_rebuild(kd_tree Tree)
     }
 
     /* Then recursively fill the tree */
-	if( kd_build_depth )
-	{
-		newTree->tree = build_node(items, item_count, extent, 0, 1, kd_build_depth, &spares, &(newTree->item_count), mean);
-		newTree->items_balanced = newTree->item_count;
-	}
-	else
-	{
-		spares = items;
-	}
-	
-	count = 0;
-	
-	while( spares )
-	{
-		kd_list *ptr;
-		ptr = CDR(spares);
-		/* count++; */
-		/*if( count % 50000 == 0 )
-			printf(".%d", count),fflush(stdout);*/
-		
-		kd_insert((kd_tree)newTree,(kd_generic)spares->item,spares->size,(kd_generic)spares);
-		spares = ptr;
-	}
+	extent[0] = newTree->extent[0];
+	extent[1] = newTree->extent[1];
+	extent[2] = newTree->extent[2];
+	extent[3] = newTree->extent[3];
+	build_tree(newTree, items, (int) item_count, extent, mean, nthreads);
     return (kd_tree) newTree;
 }
 
@@ -1768,7 +2689,7 @@ void collect_nodes(kd_tree atree, kd_list *nodeptr, kd_list **nodelist, kd_box e
 	if( ! nodeptr->item ) /* a dead node */
 	{
 		/* free it and move on */
-		free((char *)nodeptr);
+		free_elem(tree, nodeptr);
 		tree->dead_count--;
 		tree->item_count--;
 	}
@@ -1822,16 +2743,33 @@ static int nodecmp(KDElem *a, KDElem *b, int disc)
 	return val;
 }
 
-int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesdad, int *dir, int *newj)
+static void min_max_path(KDState *realGen, KDElem **path, int *path_len)
+/*
+ * Saves the path down to the node find_min_max_node() just chose:
+ * every frame below the top one on its stack.  kd_do_delete() moves
+ * that node out of the subtree,  so the nodes above it lose a count.
+ */
+{
+	int i;
+
+	for (i = 0;  i < realGen->top_index-1;  i++)
+		path[i] = realGen->stk[i].item;
+	*path_len = realGen->top_index-1;
+}
+
+int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesdad, int *dir, int *newj, KDElem **path, int *path_len)
 // KDElem **kd_minval_node,**kd_minval_nodesdad; /* q is the maximum loson, or the minimum hison, depending on dir, and qdad is q's dad. */
 // int j,*dir,*newj; /* j is the discriminator index (0-3), dir is HISON or LOSON (qdad[dir]==q. newj is minval_node's disc*/
+// KDElem **path; int *path_len; /* the nodes from the subtree root down to qdad (returned) */
 {
 	KDState *realGen;
     int kd_minval = (*kd_minval_node)->size[j];
+	int tries;
 	
     realGen = ALLOC(KDState);
 	
-	kd_data_tries = 0;
+	tries = 0;
+	*path_len = 0;
 	
     realGen->stack_size = KD_INIT_STACK;
     realGen->top_index = 0;
@@ -1864,7 +2802,7 @@ int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesda
 			{
 			case KD_THIS_ONE:
 				/* Check this one */
-				kd_data_tries++;
+				tries++;
 				
 				if (top_item->item && !nodecmp(top_item,*kd_minval_node,j) && top_item != *kd_minval_node)
 				{				/* when items have equal discriminators, choose the deepest to the left */
@@ -1876,6 +2814,7 @@ int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesda
 						*dir = KD_HISON;
 					*newj = m;
 					kd_minval = top_item->size[j];
+					min_max_path(realGen, path, path_len);
 					top_elem->state += 1;
 				} else
 				{
@@ -1919,7 +2858,7 @@ int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesda
 		}
 		FREE(realGen->stk);
 		FREE(realGen);
-		return kd_data_tries;
+		return tries;
 	}
 	else /* we are trying to find the maximal value of k[j], in the LOSON subree. */
 	{
@@ -1938,7 +2877,7 @@ int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesda
 			{
 			case KD_THIS_ONE:
 				/* Check this one */
-				kd_data_tries++;
+				tries++;
 				
 				if (top_item->item && nodecmp(top_item,*kd_minval_node,j) && top_item != *kd_minval_node)
 				{				/* when items have equal discriminators, choose the deepest to the right */
@@ -1950,6 +2889,7 @@ int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesda
 					else
 						*dir = KD_HISON;
 					*newj = m;
+					min_max_path(realGen, path, path_len);
 					top_elem->state += 1;
 				} else
 				{
@@ -1991,7 +2931,7 @@ int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesda
 		}
 		FREE(realGen->stk);
 		FREE(realGen);
-		return kd_data_tries;
+		return tries;
 	}
 }
 
@@ -2022,7 +2962,7 @@ int find_min_max_node(int j, KDElem **kd_minval_node, KDElem **kd_minval_nodesda
 typedef struct KDPpriority
 {
 	double dist;
-	KDElem *elem;
+	kd_generic elem;
 } KDPriority;
 
 
@@ -2033,19 +2973,19 @@ typedef struct KDPpriority
  * consistent with coord_dist (used by bounds_overlap_ball for pruning).
  * The final results are converted back to actual distance in kd_neighbor.
  */
-static double KDdist(kd_box Xq, KDElem *elem)
+static double KDdist(const int *Xq, const int *size)
 {
 	double dx = 0.0, dy = 0.0;
 
-	if( Xq[KD_LEFT] > elem->size[KD_RIGHT] )
-		dx = (double)(Xq[KD_LEFT] - elem->size[KD_RIGHT]);
-	else if( Xq[KD_RIGHT] < elem->size[KD_LEFT] )
-		dx = (double)(elem->size[KD_LEFT] - Xq[KD_RIGHT]);
+	if( Xq[KD_LEFT] > size[KD_RIGHT] )
+		dx = (double)(Xq[KD_LEFT] - size[KD_RIGHT]);
+	else if( Xq[KD_RIGHT] < size[KD_LEFT] )
+		dx = (double)(size[KD_LEFT] - Xq[KD_RIGHT]);
 
-	if( Xq[KD_BOTTOM] > elem->size[KD_TOP] )
-		dy = (double)(Xq[KD_BOTTOM] - elem->size[KD_TOP]);
-	else if( Xq[KD_TOP] < elem->size[KD_BOTTOM] )
-		dy = (double)(elem->size[KD_BOTTOM] - Xq[KD_TOP]);
+	if( Xq[KD_BOTTOM] > size[KD_TOP] )
+		dy = (double)(Xq[KD_BOTTOM] - size[KD_TOP]);
+	else if( Xq[KD_TOP] < size[KD_BOTTOM] )
+		dy = (double)(size[KD_BOTTOM] - Xq[KD_TOP]);
 
 	return dx*dx + dy*dy;
 }
@@ -2058,11 +2998,10 @@ static double coord_dist(long x, long y)
 	return d;
 }
 
-static void add_priority(int m, KDPriority *P, kd_box Xq, KDElem *elem)
+static void add_priority(int m, KDPriority *P, double d, kd_generic elem)
+/* Files `elem' at distance `d' in the sorted list P of length m */
 {
 	int x;
-	double d;
-	d = KDdist(Xq,elem);
 	for(x=m-1;x>=0;x--)
 	{
 		if( d < P[x].dist )
@@ -2079,6 +3018,29 @@ static void add_priority(int m, KDPriority *P, kd_box Xq, KDElem *elem)
 	}
 }
 
+static void filter_priority(int m, KDPriority *P, double d, kd_generic elem, kd_box size,
+							kd_filter filter, kd_generic arg)
+/*
+ * add_priority(),  for kd_nearest_filtered(),  if `elem' passes `filter'.
+ * The filter is asked only about items near enough to make the list,
+ * so the ball shrinks on accepted items alone;  it is handed a copy
+ * of `size',  which lies in the tree.
+ */
+{
+	kd_box box;
+
+	if (d >= P[m-1].dist) return;
+	if (filter)
+	{
+		box[0] = size[0];
+		box[1] = size[1];
+		box[2] = size[2];
+		box[3] = size[3];
+		if (!(*filter)(elem, box, arg)) return;
+	}
+	add_priority(m, P, d, elem);
+}
+
 int kd_nearest(kd_tree tree, int x, int y, int m, kd_priority **alist);
 
 
@@ -2092,12 +3054,8 @@ void kd_print_nearest(kd_tree tree, int x, int y, int m)
 			xz, m);
 	for(i=0;i<m;i++)
 	{
-		fprintf(stderr,"Nearest Neighbor: dist to center: %g units. elem=%lx. item=%ld. ([%d,%d]->[%d,%d])\n",
-				list[i].dist, (unsigned long)list[i].elem,(long)list[i].elem->item,
-				list[i].elem->size[KD_LEFT],
-				list[i].elem->size[KD_BOTTOM],
-				list[i].elem->size[KD_RIGHT],
-				list[i].elem->size[KD_TOP]);
+		fprintf(stderr,"Nearest Neighbor: dist to center: %g units. item=%ld.\n",
+				list[i].dist, (long)list[i].elem);
 	}
 	free(list);
 }
@@ -2127,7 +3085,8 @@ static int bounds_overlap_ball(kd_box Xq, kd_box Bp, kd_box Bn, int m, KDPriorit
 	return 1;
 }
 
-static int  kd_neighbor(KDElem *node, kd_box Xq, int m, KDPriority *list, kd_box Bp, kd_box Bn)
+static int  kd_neighbor(KDElem *node, kd_box Xq, int m, KDPriority *list, kd_box Bp, kd_box Bn,
+						kd_filter filter, kd_generic arg)
 {
 	KDState *realGen;
     int p,d;
@@ -2170,7 +3129,8 @@ static int  kd_neighbor(KDElem *node, kd_box Xq, int m, KDPriority *list, kd_box
 			/* Check this one */
 			kd_data_tries++;
 			if( top_item->item ) /* really shouldn't add dead nodes to the list! */
-				add_priority(m,list,Xq,top_item);
+				filter_priority(m,list,KDdist(Xq,top_item->size),top_item->item,
+								top_item->size,filter,arg);
 			top_elem->state += 1;
 			break;
 		case KD_LOSON:
@@ -2292,17 +3252,28 @@ static int  kd_neighbor(KDElem *node, kd_box Xq, int m, KDPriority *list, kd_box
 	}
 	FREE(realGen->stk);
 	FREE(realGen);
-	/* Convert squared distances back to actual distances, and change
-	   KDElem * to kd_generic for the user's results. */
+	/* Convert squared distances back to actual distances for the user's
+	   results.  Slots that found nothing keep a zero elem. */
 	for(p=0;p<m;p++)
 	{
 		list[p].dist = sqrt(list[p].dist);
-		list[p].elem = (KDElem *)list[p].elem->item;
 	}
 	return kd_data_tries;
 }
 
 int kd_nearest(kd_tree tree, int x, int y, int m, kd_priority **alist)
+{
+	return kd_nearest_filtered(tree, x, y, m, (kd_filter) 0, (kd_generic) 0, alist);
+}
+
+int kd_nearest_filtered(kd_tree tree, int x, int y, int m, kd_filter filter, kd_generic arg,
+						kd_priority **alist)
+/*
+ * kd_nearest(),  counting only items for which `filter' returns
+ * non-zero,  so the m nearest that pass come back in one search
+ * rather than from a longer list thinned afterwards.  A zero filter
+ * passes every item.
+ */
 {
 	kd_box Bp,Bn,Xq;
 	int i;
@@ -2323,5 +3294,3411 @@ int kd_nearest(kd_tree tree, int x, int y, int m, kd_priority **alist)
 		Bp[i] = MAXINT;
 		Bn[i] = MININT;
 	}
-	return kd_neighbor(realTree->tree,Xq,m,*list,Bp,Bn);
+	if (realTree->frozen)
+		return frozen_neighbor(realTree->frozen,Xq,m,*list,Bp,Bn,filter,arg);
+	return kd_neighbor(realTree->tree,Xq,m,*list,Bp,Bn,filter,arg);
+}
+
+
+
+/* ************** kd_freeze -- compact read-only trees             ********************************** */
+
+#define KD_NO_SON	0xFFFFFFFFu	/* No son,  while flattening */
+
+/*
+ * Lays out the subtrees rooted at `root' (in the preorder numbering
+ * made by kd_freeze) in van Emde Boas order:  the top half of the
+ * levels first,  then each subtree hanging below them,  each laid
+ * out the same way.  `place' receives the new index of every node.
+ * The recursion is kept on explicit stacks,  since trees built by
+ * insertion alone can be very deep.  Returns the number of nodes
+ * placed.
+ */
+
+typedef struct {
+	unsigned int node;		/* Subtree root              */
+	int levels;				/* Levels still to lay out   */
+} KDVebTask;
+
+static unsigned int veb_layout(unsigned int root, unsigned int n, unsigned int (*sons)[2],
+							   int *height, unsigned int *place)
+{
+	KDVebTask *tasks, *dfs;
+	unsigned int *bottoms;
+	unsigned int next = 0, ntasks = 0, nb, nd, node, s;
+	int h, top, lev, i;
+
+	tasks = MULTALLOC(KDVebTask, n);
+	dfs = MULTALLOC(KDVebTask, n);
+	bottoms = MULTALLOC(unsigned int, n);
+	tasks[ntasks].node = root;
+	tasks[ntasks].levels = height[root];
+	ntasks++;
+	while (ntasks > 0)
+	{
+		ntasks--;
+		node = tasks[ntasks].node;
+		h = MIN(tasks[ntasks].levels, height[node]);
+		if (h <= 1)
+		{
+			place[node] = next++;
+			continue;
+		}
+		top = h / 2;
+		/* Find the roots of the bottom subtrees,  left to right */
+		nb = nd = 0;
+		dfs[nd].node = node;
+		dfs[nd].levels = 0;
+		nd++;
+		while (nd > 0)
+		{
+			nd--;
+			s = dfs[nd].node;
+			lev = dfs[nd].levels;
+			if (lev == top)
+			{
+				bottoms[nb++] = s;
+				continue;
+			}
+			for (i = 1;  i >= 0;  i--)
+			{
+				if (sons[s][i] != KD_NO_SON)
+				{
+					dfs[nd].node = sons[s][i];
+					dfs[nd].levels = lev + 1;
+					nd++;
+				}
+			}
+		}
+		/* Bottoms go under the top,  which is popped first */
+		while (nb > 0)
+		{
+			tasks[ntasks].node = bottoms[--nb];
+			tasks[ntasks].levels = h - top;
+			ntasks++;
+		}
+		tasks[ntasks].node = node;
+		tasks[ntasks].levels = top;
+		ntasks++;
+	}
+	FREE(bottoms);
+	FREE(dfs);
+	FREE(tasks);
+	return next;
+}
+
+static KDFrozen *new_frozen(unsigned int n)
+{
+	KDFrozen *fz;
+	int i;
+
+	fz = ALLOC(KDFrozen);
+	fz->num_nodes = n;
+	fz->depth = 0;
+	fz->nodes = (KDFNode *) 0;
+	fz->items = (kd_generic *) 0;
+	for (i = 0;  i < KD_BOX_MAX;  i++) fz->bucket_box[i] = (int *) 0;
+	fz->bucket_items = (kd_generic *) 0;
+	fz->bucket_len = 0;
+	fz->image = (void *) 0;
+	fz->image_len = 0;
+	if (n)
+	{
+		fz->nodes = MULTALLOC(KDFNode, n);
+		fz->items = MULTALLOC(kd_generic, n);
+	}
+	return fz;
+}
+
+static void free_frozen(KDFrozen *fz, void (*delfunc)(kd_generic item))
+{
+	unsigned int i;
+
+	/* Items in a mapped image were written by another process */
+	if (delfunc && !fz->image)
+	{
+		for (i = 0;  i < fz->num_nodes;  i++)
+			if (fz->items[i]) (*delfunc)(fz->items[i]);
+		for (i = 0;  i < fz->bucket_len;  i++)
+			if (fz->bucket_items[i]) (*delfunc)(fz->bucket_items[i]);
+	}
+	if (fz->image)
+	{
+		/* The arrays all live in the image */
+		unmap_image(fz->image, fz->image_len);
+		FREE(fz);
+		return;
+	}
+	if (fz->nodes) FREE(fz->nodes);
+	if (fz->items) FREE(fz->items);
+	if (fz->bucket_len)
+	{
+		for (i = 0;  i < KD_BOX_MAX;  i++) FREE(fz->bucket_box[i]);
+		FREE(fz->bucket_items);
+	}
+	FREE(fz);
+}
+
+static void new_buckets(KDFrozen *fz, unsigned int len)
+{
+	int i;
+
+	fz->bucket_len = len;
+	if (!len) return;
+	for (i = 0;  i < KD_BOX_MAX;  i++) fz->bucket_box[i] = MULTALLOC(int, len);
+	fz->bucket_items = MULTALLOC(kd_generic, len);
+}
+
+typedef struct {
+	KDElem *elem;			/* Node to number            */
+	unsigned int dad;		/* Its father's number       */
+	int son;				/* Which son it is           */
+} KDFlat;
+
+kd_tree kd_freeze(kd_tree theTree)
+/*
+ * Returns a new,  read-only copy of `theTree'.  The copy keeps its
+ * nodes in a single array in van Emde Boas order,  with 32 bit son
+ * indices instead of pointers,  and answers kd_start()/kd_next(),
+ * kd_nearest(),  kd_is_member() and kd_count() exactly as the
+ * original does.  `theTree' itself is left alone.
+ */
+{
+	return kd_freeze_buckets(theTree, 0);
+}
+
+kd_tree kd_freeze_buckets(kd_tree theTree, int bucket_size)
+/*
+ * Same as kd_freeze(),  but every subtree of at most `bucket_size'
+ * nodes (and more than one) becomes a single leaf bucket,  which
+ * searches scan KD_BUCKET_WIDTH boxes at a time.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDTree *newTree;
+	KDFrozen *fz, *old;
+	KDElem **elems, *elem;
+	KDFlat *stack;
+	KDFNode *node;
+	unsigned int (*sons)[2], *place, *weight, *bstart;
+	char *bucket;
+	int *height;
+	unsigned int n = 0, sp, i, j, k, len, placed;
+
+	newTree = (KDTree *) kd_create();
+	newTree->item_count = realTree->item_count;
+	newTree->dead_count = realTree->dead_count;
+	newTree->items_balanced = realTree->items_balanced;
+	for (i = 0;  i < KD_BOX_MAX;  i++) newTree->extent[i] = realTree->extent[i];
+
+	if (realTree->frozen)
+	{
+		/* Already laid out -- just copy it */
+		old = realTree->frozen;
+		n = old->num_nodes;
+		fz = new_frozen(n);
+		fz->depth = old->depth;
+		if (n)
+		{
+			memcpy(fz->nodes, old->nodes, n * sizeof(KDFNode));
+			memcpy(fz->items, old->items, n * sizeof(kd_generic));
+		}
+		new_buckets(fz, old->bucket_len);
+		if (old->bucket_len)
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++)
+				memcpy(fz->bucket_box[i], old->bucket_box[i], old->bucket_len * sizeof(int));
+			memcpy(fz->bucket_items, old->bucket_items, old->bucket_len * sizeof(kd_generic));
+		}
+		newTree->frozen = fz;
+		newTree->max_depth = fz->depth;
+		return (kd_tree) newTree;
+	}
+
+	/* Count the nodes,  dead ones included:  they still route searches */
+	if (realTree->tree)
+	{
+		elems = MULTALLOC(KDElem *, realTree->item_count + realTree->dead_count + 1);
+		sp = 0;
+		elems[sp++] = realTree->tree;
+		while (sp > 0)
+		{
+			elem = elems[--sp];
+			n++;
+			if (elem->sons[KD_LOSON]) elems[sp++] = elem->sons[KD_LOSON];
+			if (elem->sons[KD_HISON]) elems[sp++] = elem->sons[KD_HISON];
+		}
+		FREE(elems);
+	}
+	if (!n)
+	{
+		newTree->frozen = new_frozen(0);
+		return (kd_tree) newTree;
+	}
+
+	/*
+	 * Number the nodes in preorder,  so sons follow their fathers and
+	 * every subtree is a run of numbers in the order kd_next() visits.
+	 */
+	elems = MULTALLOC(KDElem *, n);
+	sons = (unsigned int (*)[2]) MULTALLOC(unsigned int, 2 * n);
+	height = MULTALLOC(int, n);
+	weight = MULTALLOC(unsigned int, n);
+	place = MULTALLOC(unsigned int, n);
+	bucket = MULTALLOC(char, n);
+	bstart = MULTALLOC(unsigned int, n);
+	stack = MULTALLOC(KDFlat, n);
+	j = 0;
+	sp = 0;
+	stack[sp].elem = realTree->tree;
+	stack[sp].dad = KD_NO_SON;
+	sp++;
+	while (sp > 0)
+	{
+		sp--;
+		i = j++;
+		elems[i] = stack[sp].elem;
+		if (stack[sp].dad != KD_NO_SON) sons[stack[sp].dad][stack[sp].son] = i;
+		for (k = KD_HISON + 1;  k-- > KD_LOSON; )
+		{
+			sons[i][k] = KD_NO_SON;
+			if (elems[i]->sons[k])
+			{
+				stack[sp].elem = elems[i]->sons[k];
+				stack[sp].dad = i;
+				stack[sp].son = k;
+				sp++;
+			}
+		}
+	}
+	for (i = n;  i-- > 0; )
+	{
+		weight[i] = 1;
+		for (k = KD_LOSON;  k <= KD_HISON;  k++)
+			if (sons[i][k] != KD_NO_SON) weight[i] += weight[sons[i][k]];
+	}
+
+	/* Pick the buckets:  the largest small enough subtrees */
+	len = 0;
+	memset(bucket, 0, n);
+	for (i = 0;  i < n; )
+	{
+		if (weight[i] > 1 && weight[i] <= (unsigned int) bucket_size)
+		{
+			bucket[i] = 1;
+			bstart[i] = len;
+			for (j = i;  j < i + weight[i];  j++)
+				if (elems[j]->item) len++;
+			len = (len + KD_BUCKET_WIDTH - 1) / KD_BUCKET_WIDTH * KD_BUCKET_WIDTH;
+			sons[i][KD_LOSON] = sons[i][KD_HISON] = KD_NO_SON;
+			i += weight[i];
+		}
+		else
+			i++;
+	}
+	for (i = n;  i-- > 0; )
+	{
+		height[i] = 1;
+		for (k = KD_LOSON;  k <= KD_HISON;  k++)
+			if (sons[i][k] != KD_NO_SON)
+				height[i] = MAX(height[i], height[sons[i][k]] + 1);
+	}
+
+	memset(place, 0xFF, n * sizeof(unsigned int));
+	placed = veb_layout(0, n, sons, height, place);
+	fz = new_frozen(placed);
+	fz->depth = height[0];
+	newTree->max_depth = fz->depth;
+	new_buckets(fz, len);
+	newTree->frozen = fz;
+	for (i = 0;  i < len;  i++)
+	{
+		/* Padding:  no box at all */
+		fz->bucket_box[KD_LEFT][i] = fz->bucket_box[KD_BOTTOM][i] = MAXINT;
+		fz->bucket_box[KD_RIGHT][i] = fz->bucket_box[KD_TOP][i] = MININT;
+		fz->bucket_items[i] = (kd_generic) 0;
+	}
+	for (i = 0;  i < n;  i++)
+	{
+		if (place[i] == KD_NO_SON) continue;
+		node = &fz->nodes[place[i]];
+		elem = elems[i];
+		for (j = 0;  j < KD_BOX_MAX;  j++) node->size[j] = elem->size[j];
+		node->lo_min_bound = elem->lo_min_bound;
+		node->hi_max_bound = elem->hi_max_bound;
+		node->other_bound = elem->other_bound;
+		for (j = KD_LOSON;  j <= KD_HISON;  j++)
+			node->sons[j] = (sons[i][j] == KD_NO_SON) ? 0 : place[sons[i][j]];
+		fz->items[place[i]] = elem->item;
+		if (bucket[i])
+		{
+			/* The node's box becomes the bounding box of the bucket */
+			node->size[KD_LEFT] = node->size[KD_BOTTOM] = MAXINT;
+			node->size[KD_RIGHT] = node->size[KD_TOP] = MININT;
+			k = bstart[i];
+			for (j = i;  j < i + weight[i];  j++)
+			{
+				if (!elems[j]->item) continue;
+				fz->bucket_box[KD_LEFT][k] = elems[j]->size[KD_LEFT];
+				fz->bucket_box[KD_BOTTOM][k] = elems[j]->size[KD_BOTTOM];
+				fz->bucket_box[KD_RIGHT][k] = elems[j]->size[KD_RIGHT];
+				fz->bucket_box[KD_TOP][k] = elems[j]->size[KD_TOP];
+				fz->bucket_items[k] = elems[j]->item;
+				node->size[KD_LEFT] = MIN(node->size[KD_LEFT], elems[j]->size[KD_LEFT]);
+				node->size[KD_BOTTOM] = MIN(node->size[KD_BOTTOM], elems[j]->size[KD_BOTTOM]);
+				node->size[KD_RIGHT] = MAX(node->size[KD_RIGHT], elems[j]->size[KD_RIGHT]);
+				node->size[KD_TOP] = MAX(node->size[KD_TOP], elems[j]->size[KD_TOP]);
+				k++;
+			}
+			node->sons[KD_LOSON] = KD_BUCKET | bstart[i];
+			node->sons[KD_HISON] = k - bstart[i];
+			fz->items[place[i]] = (kd_generic) 0;
+		}
+	}
+	FREE(stack);
+	FREE(bstart);
+	FREE(bucket);
+	FREE(place);
+	FREE(weight);
+	FREE(height);
+	FREE(sons);
+	FREE(elems);
+	return (kd_tree) newTree;
+}
+
+static unsigned int bucket_hits(KDFrozen *fz, unsigned int pos, const int *ext)
+/*
+ * Returns a mask of the KD_BUCKET_WIDTH bucket boxes from `pos' on
+ * that touch `ext',  bit i standing for box pos+i.  This is
+ * BOXINTERSECT() done with vector compares where there are any:
+ * a box misses if ext left > box right,  box left > ext right,
+ * and so on.
+ */
+{
+#if defined(KD_AVX2)
+	__m256i miss;
+
+	miss = _mm256_or_si256(
+		_mm256_or_si256(
+			_mm256_cmpgt_epi32(_mm256_set1_epi32(ext[KD_LEFT]),
+				_mm256_loadu_si256((__m256i *) (fz->bucket_box[KD_RIGHT] + pos))),
+			_mm256_cmpgt_epi32(_mm256_loadu_si256((__m256i *) (fz->bucket_box[KD_LEFT] + pos)),
+				_mm256_set1_epi32(ext[KD_RIGHT]))),
+		_mm256_or_si256(
+			_mm256_cmpgt_epi32(_mm256_set1_epi32(ext[KD_BOTTOM]),
+				_mm256_loadu_si256((__m256i *) (fz->bucket_box[KD_TOP] + pos))),
+			_mm256_cmpgt_epi32(_mm256_loadu_si256((__m256i *) (fz->bucket_box[KD_BOTTOM] + pos)),
+				_mm256_set1_epi32(ext[KD_TOP]))));
+	return ~(unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(miss)) & 0xFF;
+#elif defined(KD_SSE2)
+	__m128i miss;
+	unsigned int mask = 0;
+	int half;
+
+	for (half = 0;  half < KD_BUCKET_WIDTH;  half += 4)
+	{
+		miss = _mm_or_si128(
+			_mm_or_si128(
+				_mm_cmpgt_epi32(_mm_set1_epi32(ext[KD_LEFT]),
+					_mm_loadu_si128((__m128i *) (fz->bucket_box[KD_RIGHT] + pos + half))),
+				_mm_cmpgt_epi32(_mm_loadu_si128((__m128i *) (fz->bucket_box[KD_LEFT] + pos + half)),
+					_mm_set1_epi32(ext[KD_RIGHT]))),
+			_mm_or_si128(
+				_mm_cmpgt_epi32(_mm_set1_epi32(ext[KD_BOTTOM]),
+					_mm_loadu_si128((__m128i *) (fz->bucket_box[KD_TOP] + pos + half))),
+				_mm_cmpgt_epi32(_mm_loadu_si128((__m128i *) (fz->bucket_box[KD_BOTTOM] + pos + half)),
+					_mm_set1_epi32(ext[KD_TOP]))));
+		mask |= (~(unsigned int) _mm_movemask_ps(_mm_castsi128_ps(miss)) & 0xF) << half;
+	}
+	return mask;
+#else
+	unsigned int mask = 0;
+	int i;
+
+	for (i = 0;  i < KD_BUCKET_WIDTH;  i++)
+	{
+		if (ext[KD_LEFT] <= fz->bucket_box[KD_RIGHT][pos+i] &&
+			fz->bucket_box[KD_LEFT][pos+i] <= ext[KD_RIGHT] &&
+			ext[KD_BOTTOM] <= fz->bucket_box[KD_TOP][pos+i] &&
+			fz->bucket_box[KD_BOTTOM][pos+i] <= ext[KD_TOP])
+			mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+static int low_bit(unsigned int mask)
+/* Index of the lowest set bit of a non-zero mask */
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(mask);
+#else
+	int i = 0;
+
+	while (!(mask & 1))
+	{
+		mask >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+static kd_status frozen_find(KDFrozen *fz, kd_generic item, kd_box size)
+/* kd_is_member() for frozen trees:  the search half of find_item() */
+{
+	KDFNode *node;
+	unsigned int idx = 0, i;
+	int disc = 0, new_disc, val;
+
+	if (!fz->num_nodes) return KD_NOTFOUND;
+	for (;;)
+	{
+		node = &fz->nodes[idx];
+		if (KD_IS_BUCKET(node))
+		{
+			/* The whole subtree is here */
+			for (i = KD_BUCKET_START(node);  i < KD_BUCKET_START(node) + node->sons[KD_HISON];  i++)
+				if (fz->bucket_items[i] == item) return KD_OK;
+			return KD_NOTFOUND;
+		}
+		if (item == fz->items[idx]) return item ? KD_OK : KD_NOTFOUND;
+		val = size[disc] - node->size[disc];
+		if (val == 0)
+		{
+			/* Cyclical comparison required */
+			new_disc = NEXTDISC(disc);
+			while (new_disc != disc)
+			{
+				val = size[new_disc] - node->size[new_disc];
+				if (val != 0) break;
+				new_disc = NEXTDISC(new_disc);
+			}
+			if (val == 0) val = 1; /* Force upward if equal */
+		}
+		idx = node->sons[val >= 0];
+		if (!idx) return KD_NOTFOUND;
+		disc = NEXTDISC(disc);
+	}
+}
+
+static int frozen_next_inside(KDState *realGen, kd_generic *data, kd_box size)
+/* next_inside() for frozen trees:  buckets are returned whole */
+{
+	KDFrozen *fz = realGen->frozen;
+	KDSave *top_elem;
+	KDFNode *node;
+	unsigned int idx, end, i;
+
+	while (realGen->top_index > realGen->inside) {
+	top_elem = &(realGen->stk[realGen->top_index-1]);
+	idx = top_elem->node;
+	node = &fz->nodes[idx];
+	if (KD_IS_BUCKET(node)) {
+		end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+		if (top_elem->state == KD_THIS_ONE) {
+			realGen->tries += node->sons[KD_HISON];
+			top_elem->state = KD_DONE;
+			top_elem->pos = KD_BUCKET_START(node);
+		}
+		while (top_elem->pos < end && !fz->bucket_items[top_elem->pos]) top_elem->pos++;
+		if (top_elem->pos >= end) {
+			realGen->top_index -= 1;
+			continue;
+		}
+		i = top_elem->pos++;
+		*data = fz->bucket_items[i];
+		if (size) {
+		    size[0] = fz->bucket_box[0][i];  size[1] = fz->bucket_box[1][i];
+		    size[2] = fz->bucket_box[2][i];  size[3] = fz->bucket_box[3][i];
+		}
+		return 1;
+	}
+	realGen->top_index -= 1;
+	realGen->tries++;
+	if (node->sons[KD_HISON]) {
+		KD_PUSHF(realGen, node->sons[KD_HISON], 0);
+	}
+	if (node->sons[KD_LOSON]) {
+		KD_PUSHF(realGen, node->sons[KD_LOSON], 0);
+	}
+	if (fz->items[idx]) {
+		*data = fz->items[idx];
+		if (size) {
+		    size[0] = node->size[0];  size[1] = node->size[1];
+		    size[2] = node->size[2];  size[3] = node->size[3];
+		}
+		return 1;
+	}
+    }
+	realGen->inside = -1;
+	return 0;
+}
+
+static kd_status frozen_next(KDState *realGen, kd_generic *data, kd_box size)
+/* kd_next() for frozen trees */
+{
+	KDFrozen *fz = realGen->frozen;
+	KDSave *top_elem;
+	KDFNode *node;
+	kd_box son_box;
+	unsigned int idx, end, i;
+	short hort, m;
+
+	while (realGen->top_index > 0) {
+	if (realGen->inside >= 0) {
+		if (frozen_next_inside(realGen, data, size)) return KD_OK;
+		continue;
+	}
+	top_elem = &(realGen->stk[realGen->top_index-1]);
+	idx = top_elem->node;
+	node = &fz->nodes[idx];
+	hort = top_elem->disc & 0x01;
+	m = top_elem->disc;
+
+	if (KD_IS_BUCKET(node)) {
+		/* Scan the bucket a block at a time,  keeping the hits */
+		end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+		if (top_elem->state == KD_THIS_ONE) {
+			if (realGen->mode != KD_CONTAINS && BOXWITHIN(node->size, realGen->extent)) {
+				realGen->inside = realGen->top_index - 1;
+				continue;
+			}
+			realGen->tries += node->sons[KD_HISON];
+			if (realGen->mode == KD_CONTAINS ? !BOXWITHIN(realGen->extent, node->size)
+				: !BOXINTERSECT(realGen->extent, node->size)) {
+				realGen->top_index -= 1;
+				continue;
+			}
+			top_elem->state = KD_DONE;
+			top_elem->pos = KD_BUCKET_START(node);
+			top_elem->hits = 0;
+		}
+		for (;;) {
+			while (!top_elem->hits && top_elem->pos < end) {
+				top_elem->hits = bucket_hits(fz, top_elem->pos, realGen->extent);
+				if (end - top_elem->pos < KD_BUCKET_WIDTH)
+					top_elem->hits &= (1u << (end - top_elem->pos)) - 1;
+				top_elem->pos += KD_BUCKET_WIDTH;
+			}
+			if (!top_elem->hits) break;
+			i = top_elem->pos - KD_BUCKET_WIDTH + low_bit(top_elem->hits);
+			top_elem->hits &= top_elem->hits - 1;
+			son_box[0] = fz->bucket_box[0][i];  son_box[1] = fz->bucket_box[1][i];
+			son_box[2] = fz->bucket_box[2][i];  son_box[3] = fz->bucket_box[3][i];
+			/* The blocks are tested for touching the area only */
+			if (!KD_MATCH(realGen->mode, realGen->extent, son_box)) continue;
+			*data = fz->bucket_items[i];
+			if (size) {
+			    size[0] = son_box[0];  size[1] = son_box[1];
+			    size[2] = son_box[2];  size[3] = son_box[3];
+			}
+			return KD_OK;
+		}
+		realGen->top_index -= 1;
+		continue;
+	}
+
+	switch (top_elem->state) {
+	case KD_THIS_ONE:
+		if (realGen->mode != KD_CONTAINS && BOXWITHIN(top_elem->Bp, realGen->extent)) {
+			/* All of this subtree is in the area */
+			realGen->inside = realGen->top_index - 1;
+			break;
+		}
+		realGen->tries++;
+		top_elem->state += 1;
+		if (fz->items[idx] && KD_MATCH(realGen->mode, realGen->extent, node->size)) {
+		*data = fz->items[idx];
+		if (size) {
+		    size[0] = node->size[0];  size[1] = node->size[1];
+		    size[2] = node->size[2];  size[3] = node->size[3];
+		}
+		return KD_OK;
+	    }
+	    break;
+	case KD_LOSON:
+		top_elem->state += 1;
+	    if (node->sons[KD_LOSON] && KD_LO_OVERLAP(realGen->prune, node, m, hort) &&
+			(realGen->mode != KD_WITHIN || KD_LO_WITHIN(realGen->extent, node, m))) {
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = top_elem->Bp[i];
+			KD_SON_BOX(son_box, node, m, KD_LOSON);
+			KD_PUSHF(realGen, node->sons[KD_LOSON], NEXTDISC(m));
+			KD_SETBOX(realGen, son_box);
+	    }
+	    break;
+	case KD_HISON:
+		top_elem->state += 1;
+	    if (node->sons[KD_HISON] && KD_HI_OVERLAP(realGen->prune, node, m, hort) &&
+			(realGen->mode != KD_WITHIN || KD_HI_WITHIN(realGen->extent, node, m))) {
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = top_elem->Bp[i];
+			KD_SON_BOX(son_box, node, m, KD_HISON);
+			KD_PUSHF(realGen, node->sons[KD_HISON], NEXTDISC(m));
+			KD_SETBOX(realGen, son_box);
+	    }
+	    break;
+	default:
+	    realGen->top_index -= 1;
+	    break;
+	}
+    }
+    return KD_NOMORE;
+}
+
+static void frozen_son_bounds(KDFNode *node, int d, int son, kd_box Bp, kd_box Bn)
+/* Narrows Bp/Bn to son `son' of `node',  as kd_neighbor() does */
+{
+	int hort = d & 1;
+
+	if (son == KD_LOSON)
+	{
+		Bp[hort] = (d & 2) ? node->size[d] : node->other_bound;
+		Bn[hort] = node->lo_min_bound;
+	}
+	else
+	{
+		Bp[hort] = node->hi_max_bound;
+		Bn[hort] = (d & 2) ? node->other_bound : node->size[d];
+	}
+}
+
+static int frozen_neighbor(KDFrozen *fz, kd_box Xq, int m, KDPriority *list, kd_box Bp, kd_box Bn,
+						   kd_filter filter, kd_generic arg)
+/* kd_neighbor() for frozen trees:  nearer son first,  then the other */
+{
+	KDState *realGen;
+	KDSave *top_elem;
+	KDFNode *node;
+	kd_box box;
+	unsigned int idx, i;
+	int p, d, son;
+
+	realGen = ALLOC(KDState);
+	kd_data_tries = 0;
+	realGen->stack_size = KD_INIT_STACK;
+	realGen->top_index = 0;
+	realGen->stk = MULTALLOC(KDSave, KD_INIT_STACK);
+	if (fz->num_nodes)
+	{
+		KD_PUSHF(realGen, 0, 0);
+		KD_SETB(realGen, Bn, Bp);
+	}
+
+	while (realGen->top_index > 0)
+	{
+		top_elem = &(realGen->stk[realGen->top_index-1]);
+		idx = top_elem->node;
+		node = &fz->nodes[idx];
+		d = top_elem->disc;
+
+		if (KD_IS_BUCKET(node))
+		{
+			if (KDdist(Xq,node->size) < list[m-1].dist)
+			{
+				for (i = KD_BUCKET_START(node);  i < KD_BUCKET_START(node) + node->sons[KD_HISON];  i++)
+				{
+					kd_data_tries++;
+					for (p = 0;  p < KD_BOX_MAX;  p++) box[p] = fz->bucket_box[p][i];
+					filter_priority(m,list,KDdist(Xq,box),fz->bucket_items[i],box,filter,arg);
+				}
+			}
+			realGen->top_index -= 1;
+			continue;
+		}
+
+		switch (top_elem->state)
+		{
+		case KD_THIS_ONE:
+			kd_data_tries++;
+			if (fz->items[idx])
+				filter_priority(m,list,KDdist(Xq,node->size),fz->items[idx],
+								node->size,filter,arg);
+			top_elem->state += 1;
+			break;
+		case KD_LOSON:
+		case KD_HISON:
+			/* LOSON state visits the nearer son,  HISON the farther */
+			son = (Xq[d] <= node->size[d]) ? KD_LOSON : KD_HISON;
+			if (top_elem->state == KD_HISON) son = !son;
+			top_elem->state += 1;
+			if (node->sons[son])
+			{
+				frozen_son_bounds(node, d, son, top_elem->Bp, top_elem->Bn);
+				if (bounds_overlap_ball(Xq,top_elem->Bp,top_elem->Bn,m,list))
+				{
+					kd_box sBn, sBp;
+
+					for (p = 0;  p < KD_BOX_MAX;  p++)
+					{
+						sBn[p] = top_elem->Bn[p];
+						sBp[p] = top_elem->Bp[p];
+					}
+					KD_PUSHF(realGen, node->sons[son], NEXTDISC(d));
+					KD_SETB(realGen, sBn, sBp);
+				}
+			}
+			break;
+		default:
+			realGen->top_index -= 1;
+			break;
+		}
+	}
+	FREE(realGen->stk);
+	FREE(realGen);
+	for (p = 0;  p < m;  p++)
+	{
+		list[p].dist = sqrt(list[p].dist);
+	}
+	return kd_data_tries;
+}
+
+
+
+/* ************** kd_query_batch -- many regions in one pass      ********************************** */
+
+/*
+ * A batch walks the tree once for a whole set of regions.  Each
+ * frame on its stack carries the regions still active at that
+ * node,  as a run of region numbers in `active';  a son is only
+ * pushed with the regions that pass its bound test.  The runs are
+ * stacked the same way as the frames,  so popping a frame frees its
+ * run.  A region holding the whole box of a subtree takes all of it
+ * at once (see search_all()) and drops out of the run.
+ */
+
+typedef struct {
+	KDElem *elem;			/* Node,  pointer trees      */
+	unsigned int node;		/* Node,  frozen trees       */
+	short disc;				/* Discriminator             */
+	short state;			/* As in KDSave              */
+	int start;				/* First active region       */
+	int count;				/* Number of active regions  */
+	kd_box box;				/* Holds its subtree         */
+} KDBatchSave;
+
+typedef struct {
+	KDBatchSave *stk;		/* Stack of frames           */
+	int stack_size;			/* Allocated size of stack   */
+	int top_index;			/* Top of the stack          */
+	int *active;			/* Runs of active regions    */
+	int active_size;		/* Allocated size of active  */
+	int active_top;			/* End of the last run       */
+} KDBatch;
+
+typedef struct {
+	kd_batch_func func;		/* Caller's function         */
+	int region;				/* Region taking a subtree   */
+	kd_generic arg;			/* Caller's argument         */
+} KDBatchAll;
+
+static int batch_all(kd_generic item, kd_box size, kd_generic arg)
+/* search_all() visitor handing a whole subtree to one region */
+{
+	KDBatchAll *all = (KDBatchAll *) arg;
+
+	(*all->func)(all->region, item, size, all->arg);
+	return 0;
+}
+
+static void batch_push(KDBatch *b, KDElem *elem, unsigned int node, int disc, int count, const int *box)
+/* Pushes a frame whose regions are the `count' just past active_top */
+{
+	KDBatchSave *f;
+
+	if (b->top_index >= b->stack_size)
+	{
+		b->stack_size += KD_GROWSIZE(b->stack_size);
+		b->stk = REALLOC(KDBatchSave, b->stk, b->stack_size);
+	}
+	f = &b->stk[b->top_index++];
+	f->elem = elem;
+	f->node = node;
+	f->disc = disc;
+	f->state = KD_THIS_ONE;
+	f->start = b->active_top;
+	f->count = count;
+	f->box[0] = box[0];  f->box[1] = box[1];
+	f->box[2] = box[2];  f->box[3] = box[3];
+	b->active_top += count;
+}
+
+static void batch_reserve(KDBatch *b, int count)
+/* Makes room for a run of `count' regions past active_top */
+{
+	if (b->active_top + count > b->active_size)
+	{
+		b->active_size = MAX(2 * b->active_size, b->active_top + count);
+		b->active = REALLOC(int, b->active, b->active_size);
+	}
+}
+
+kd_status kd_query_batch(kd_tree theTree, const kd_box *regions, int nregions,
+						 kd_batch_func func, kd_generic arg)
+/*
+ * Calls `func' once for every pair of region and item that touch,
+ * with the region's index in `regions',  the item,  its size and
+ * `arg'.  For each region,  the items come in the order kd_next()
+ * would give them.  The tree is walked once for all the regions,
+ * so the upper levels are only visited once.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDFrozen *fz = realTree->frozen;
+	KDBatch b;
+	KDBatchSave *f;
+	KDBatchAll all;
+	KDFNode *node = (KDFNode *) 0;
+	KDElem *elem = (KDElem *) 0;
+	int *size;
+	kd_generic item;
+	kd_box box, son_box;
+	unsigned int pos, end, hits, son_node = 0;
+	KDElem *son_elem = (KDElem *) 0;
+	int i, r, n, m, e, hort, son;
+
+	kd_data_tries = 0;
+	if (nregions <= 0) return KD_OK;
+	if (fz ? !fz->num_nodes : !realTree->tree) return KD_OK;
+
+	b.stack_size = KD_INIT_STACK;
+	b.top_index = 0;
+	b.stk = MULTALLOC(KDBatchSave, KD_INIT_STACK);
+	b.active_size = 2 * nregions;
+	b.active_top = 0;
+	b.active = MULTALLOC(int, b.active_size);
+	for (i = 0;  i < nregions;  i++) b.active[i] = i;
+	batch_push(&b, realTree->tree, 0, 0, nregions, realTree->extent);
+	all.func = func;
+	all.arg = arg;
+
+	while (b.top_index > 0)
+	{
+		f = &b.stk[b.top_index-1];
+		m = f->disc;
+		hort = m & 0x01;
+		if (fz) node = &fz->nodes[f->node];
+		else elem = f->elem;
+
+		switch (f->state)
+		{
+		case KD_THIS_ONE:
+			f->state += 1;
+			/* Regions holding the whole subtree take it now */
+			n = 0;
+			for (i = f->start;  i < f->start + f->count;  i++)
+			{
+				r = b.active[i];
+				if (BOXWITHIN((fz && KD_IS_BUCKET(node)) ? node->size : f->box, regions[r]))
+				{
+					all.region = r;
+					(void) search_all(fz, elem, f->node, batch_all, (kd_generic) &all);
+				}
+				else
+					b.active[f->start + n++] = r;
+			}
+			f->count = n;
+			b.active_top = f->start + n;
+			if (!n)
+			{
+				f->state = KD_DONE;
+				break;
+			}
+			kd_data_tries++;
+			if (fz && KD_IS_BUCKET(node))
+			{
+				/* Every active region against the whole bucket */
+				f->state = KD_DONE;
+				end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+				for (i = f->start;  i < f->start + f->count;  i++)
+				{
+					r = b.active[i];
+					if (!BOXINTERSECT(regions[r], node->size)) continue;
+					for (pos = KD_BUCKET_START(node);  pos < end;  pos += KD_BUCKET_WIDTH)
+					{
+						hits = bucket_hits(fz, pos, regions[r]);
+						if (end - pos < KD_BUCKET_WIDTH) hits &= (1u << (end - pos)) - 1;
+						while (hits)
+						{
+							n = pos + low_bit(hits);
+							hits &= hits - 1;
+							for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][n];
+							(*func)(r, fz->bucket_items[n], box, arg);
+						}
+					}
+				}
+				break;
+			}
+			item = fz ? fz->items[f->node] : elem->item;
+			size = fz ? node->size : elem->size;
+			if (!item) break;
+			for (i = f->start;  i < f->start + f->count;  i++)
+			{
+				r = b.active[i];
+				if (BOXINTERSECT(regions[r], size))
+				{
+					for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = size[e];
+					(*func)(r, item, box, arg);
+				}
+			}
+			break;
+		case KD_LOSON:
+		case KD_HISON:
+			son = f->state;
+			f->state += 1;
+			if (fz)
+			{
+				if (!(son_node = node->sons[son])) break;
+			}
+			else
+			{
+				if (!(son_elem = elem->sons[son])) break;
+			}
+			/* Gather the regions that can reach into the son */
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = f->box[i];
+			if (fz) KD_SON_BOX(son_box, node, m, son);
+			else KD_SON_BOX(son_box, elem, m, son);
+			batch_reserve(&b, f->count);
+			f = &b.stk[b.top_index-1];
+			n = 0;
+			for (i = f->start;  i < f->start + f->count;  i++)
+			{
+				r = b.active[i];
+				if (fz ? (son == KD_LOSON ? KD_LO_OVERLAP(regions[r], node, m, hort)
+									: KD_HI_OVERLAP(regions[r], node, m, hort))
+					: (son == KD_LOSON ? KD_LO_OVERLAP(regions[r], elem, m, hort)
+									: KD_HI_OVERLAP(regions[r], elem, m, hort)))
+					b.active[b.active_top + n++] = r;
+			}
+			if (n) batch_push(&b, son_elem, son_node, NEXTDISC(m), n, son_box);
+			break;
+		default:
+			/* Done with this node -- its run goes with it */
+			b.active_top = f->start;
+			b.top_index -= 1;
+			break;
+		}
+	}
+	FREE(b.active);
+	FREE(b.stk);
+	return KD_OK;
+}
+
+
+/* ************** kd_search -- region search with a visitor       ********************************** */
+
+/*
+ * kd_search() needs no generator:  it keeps the nodes still to be
+ * visited on a small array on the C stack,  and only goes to the
+ * heap if a very unbalanced tree outgrows it.  Sons are pushed high
+ * first,  so nodes come off in the order kd_next() visits them,  and
+ * a walk never holds more than one pending son per level.  Each node
+ * also carries a box holding its subtree;  once that is inside the
+ * area,  search_all_tree() hands over the whole subtree untested.
+ */
+
+#define KD_SEARCH_STACK	128	/* Frames kept on the C stack */
+
+typedef struct {
+	KDElem *elem;			/* Node,  pointer trees      */
+	unsigned int node;		/* Node,  frozen trees       */
+	int disc;				/* Its discriminator         */
+	kd_box box;				/* Holds its subtree         */
+} KDSearchSave;
+
+typedef struct {
+	KDSearchSave *stk;		/* Stack of pending nodes    */
+	int stack_size;			/* Allocated size            */
+	int top_index;			/* Top of the stack          */
+	KDSearchSave local[KD_SEARCH_STACK];	/* Initial stack  */
+} KDSearch;
+
+static int visit_copy(kd_visitor visitor, kd_generic item, const int *size, kd_generic arg)
+/* Calls `visitor' on a copy of `size',  so that it cannot write into the tree */
+{
+	kd_box box;
+
+	box[0] = size[0];
+	box[1] = size[1];
+	box[2] = size[2];
+	box[3] = size[3];
+	return (*visitor)(item, box, arg);
+}
+
+static void search_push(KDSearch *sr, KDElem *elem, unsigned int node, int disc, const int *box)
+/* Pushes a node,  with the box holding its subtree if there is one */
+{
+	if (sr->top_index >= sr->stack_size)
+	{
+		/* Spill to the heap:  the tree is deeper than expected */
+		if (sr->stk == sr->local)
+		{
+			sr->stk = MULTALLOC(KDSearchSave, 2 * sr->stack_size);
+			memcpy(sr->stk, sr->local, sr->stack_size * sizeof(KDSearchSave));
+		}
+		else
+			sr->stk = REALLOC(KDSearchSave, sr->stk, 2 * sr->stack_size);
+		sr->stack_size *= 2;
+	}
+	sr->stk[sr->top_index].elem = elem;
+	sr->stk[sr->top_index].node = node;
+	sr->stk[sr->top_index].disc = disc;
+	if (box)
+	{
+		sr->stk[sr->top_index].box[0] = box[0];
+		sr->stk[sr->top_index].box[1] = box[1];
+		sr->stk[sr->top_index].box[2] = box[2];
+		sr->stk[sr->top_index].box[3] = box[3];
+	}
+	sr->top_index++;
+}
+
+static int search_all_tree(KDSearch *sr, KDElem *root, kd_visitor visitor, kd_generic arg)
+/*
+ * Visits every live item under `root',  which lies wholly in the
+ * area,  without testing anything;  returns non-zero if stopped.
+ */
+{
+	KDElem *elem;
+	int base = sr->top_index;
+
+	search_push(sr, root, 0, 0, (int *) 0);
+	while (sr->top_index > base)
+	{
+		elem = sr->stk[--sr->top_index].elem;
+		kd_data_tries++;
+		if (elem->item && visit_copy(visitor, elem->item, elem->size, arg))
+			return 1;
+		if (elem->sons[KD_HISON])
+			search_push(sr, elem->sons[KD_HISON], 0, 0, (int *) 0);
+		if (elem->sons[KD_LOSON])
+			search_push(sr, elem->sons[KD_LOSON], 0, 0, (int *) 0);
+	}
+	return 0;
+}
+
+static int search_all_frozen(KDSearch *sr, KDFrozen *fz, unsigned int root, kd_visitor visitor, kd_generic arg)
+/* search_all_tree() for frozen trees */
+{
+	KDFNode *node;
+	kd_box box;
+	unsigned int idx, pos, end;
+	int e, base = sr->top_index;
+
+	search_push(sr, (KDElem *) 0, root, 0, (int *) 0);
+	while (sr->top_index > base)
+	{
+		idx = sr->stk[--sr->top_index].node;
+		node = &fz->nodes[idx];
+		if (KD_IS_BUCKET(node))
+		{
+			kd_data_tries += node->sons[KD_HISON];
+			end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+			for (pos = KD_BUCKET_START(node);  pos < end;  pos++)
+			{
+				if (!fz->bucket_items[pos]) continue;
+				for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][pos];
+				if ((*visitor)(fz->bucket_items[pos], box, arg)) return 1;
+			}
+			continue;
+		}
+		kd_data_tries++;
+		if (fz->items[idx] && visit_copy(visitor, fz->items[idx], node->size, arg))
+			return 1;
+		if (node->sons[KD_HISON])
+			search_push(sr, (KDElem *) 0, node->sons[KD_HISON], 0, (int *) 0);
+		if (node->sons[KD_LOSON])
+			search_push(sr, (KDElem *) 0, node->sons[KD_LOSON], 0, (int *) 0);
+	}
+	return 0;
+}
+
+static int search_all(KDFrozen *fz, KDElem *elem, unsigned int node, kd_visitor visitor, kd_generic arg)
+/* search_all_tree() or search_all_frozen() on a stack of its own */
+{
+	KDSearch sr;
+	int stopped;
+
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	stopped = fz ? search_all_frozen(&sr, fz, node, visitor, arg)
+		: search_all_tree(&sr, elem, visitor, arg);
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return stopped;
+}
+
+static int search_tree(KDSearch *sr, KDElem *root, int disc, const int *extent, const int *area, kd_visitor visitor, kd_generic arg)
+/*
+ * kd_search() on a pointer tree,  or on the subtree under `root',
+ * split on `disc' and held by `extent';  returns non-zero if stopped
+ */
+{
+	KDElem *elem;
+	kd_box box, son_box;
+	int m, hort, i;
+
+	search_push(sr, root, 0, disc, extent);
+	while (sr->top_index > 0)
+	{
+		sr->top_index--;
+		elem = sr->stk[sr->top_index].elem;
+		m = sr->stk[sr->top_index].disc;
+		hort = m & 0x01;
+		for (i = 0;  i < KD_BOX_MAX;  i++) box[i] = sr->stk[sr->top_index].box[i];
+		if (BOXWITHIN(box, area))
+		{
+			/* All of this subtree is in the area */
+			if (search_all_tree(sr, elem, visitor, arg)) return 1;
+			continue;
+		}
+		kd_data_tries++;
+		if (elem->item && BOXINTERSECT(area, elem->size) &&
+			visit_copy(visitor, elem->item, elem->size, arg))
+			return 1;
+		if (elem->sons[KD_HISON] && KD_HI_OVERLAP(area, elem, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, elem, m, KD_HISON);
+			search_push(sr, elem->sons[KD_HISON], 0, NEXTDISC(m), son_box);
+		}
+		if (elem->sons[KD_LOSON] && KD_LO_OVERLAP(area, elem, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, elem, m, KD_LOSON);
+			search_push(sr, elem->sons[KD_LOSON], 0, NEXTDISC(m), son_box);
+		}
+	}
+	return 0;
+}
+
+static int search_frozen(KDSearch *sr, KDFrozen *fz, unsigned int root, int disc, const int *extent, const int *area, kd_visitor visitor, kd_generic arg)
+/* search_tree() on a frozen tree */
+{
+	KDFNode *node;
+	kd_box box, son_box;
+	unsigned int idx, pos, end, hits;
+	int m, hort, i, e;
+
+	search_push(sr, (KDElem *) 0, root, disc, extent);
+	while (sr->top_index > 0)
+	{
+		sr->top_index--;
+		idx = sr->stk[sr->top_index].node;
+		m = sr->stk[sr->top_index].disc;
+		hort = m & 0x01;
+		node = &fz->nodes[idx];
+		for (i = 0;  i < KD_BOX_MAX;  i++) box[i] = sr->stk[sr->top_index].box[i];
+		if (BOXWITHIN(KD_IS_BUCKET(node) ? node->size : box, area))
+		{
+			/* All of this subtree is in the area */
+			if (search_all_frozen(sr, fz, idx, visitor, arg)) return 1;
+			continue;
+		}
+		if (KD_IS_BUCKET(node))
+		{
+			kd_data_tries += node->sons[KD_HISON];
+			if (!BOXINTERSECT(area, node->size)) continue;
+			end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+			for (pos = KD_BUCKET_START(node);  pos < end;  pos += KD_BUCKET_WIDTH)
+			{
+				hits = bucket_hits(fz, pos, area);
+				if (end - pos < KD_BUCKET_WIDTH) hits &= (1u << (end - pos)) - 1;
+				while (hits)
+				{
+					i = pos + low_bit(hits);
+					hits &= hits - 1;
+					for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][i];
+					if ((*visitor)(fz->bucket_items[i], box, arg)) return 1;
+				}
+			}
+			continue;
+		}
+		kd_data_tries++;
+		if (fz->items[idx] && BOXINTERSECT(area, node->size) &&
+			visit_copy(visitor, fz->items[idx], node->size, arg))
+			return 1;
+		if (node->sons[KD_HISON] && KD_HI_OVERLAP(area, node, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, node, m, KD_HISON);
+			search_push(sr, (KDElem *) 0, node->sons[KD_HISON], NEXTDISC(m), son_box);
+		}
+		if (node->sons[KD_LOSON] && KD_LO_OVERLAP(area, node, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, node, m, KD_LOSON);
+			search_push(sr, (KDElem *) 0, node->sons[KD_LOSON], NEXTDISC(m), son_box);
+		}
+	}
+	return 0;
+}
+
+kd_status kd_search(kd_tree theTree, kd_box area, kd_visitor visitor, kd_generic arg)
+/*
+ * Calls `visitor' with each item touching `area',  its size and
+ * `arg',  in the order kd_next() would return them.  If the visitor
+ * returns non-zero the search stops there and KD_STOPPED is
+ * returned;  otherwise KD_OK once every item has been seen.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDSearch sr;
+	int stopped = 0;
+
+	kd_data_tries = 0;
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	if (realTree->frozen)
+	{
+		if (realTree->frozen->num_nodes)
+			stopped = search_frozen(&sr, realTree->frozen, 0, 0, realTree->extent, area, visitor, arg);
+	}
+	else if (realTree->tree)
+		stopped = search_tree(&sr, realTree->tree, 0, realTree->extent, area, visitor, arg);
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return stopped ? KD_STOPPED : KD_OK;
+}
+
+
+/* ************** kd_count_region -- counts without a search     ********************************** */
+
+/*
+ * Every node knows how many live items are under it.  kd_count_region()
+ * walks down like kd_search(),  carrying a box known to hold the whole
+ * subtree:  the tree extent at the root,  narrowed at each son by the
+ * node's bounds.  Once that box is inside the area everything under it
+ * touches the area,  and the node's count is taken without going on.
+ */
+
+static int count_item(kd_generic item, kd_box size, kd_generic arg)
+/* kd_search() visitor for kd_count_region() on frozen trees */
+{
+	(void) item;  (void) size;
+	*((int *) arg) += 1;
+	return 0;
+}
+
+int kd_count_region(kd_tree theTree, kd_box area)
+/*
+ * Returns the number of items touching `area',  that is,  the number
+ * kd_next() would generate for it.  Frozen trees keep no counts and
+ * are counted item by item.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDSearch sr;
+	KDElem *elem;
+	kd_box box, son_box;
+	int count = 0, m, hort, i;
+
+	if (realTree->frozen)
+	{
+		(void) kd_search(theTree, area, count_item, (kd_generic) &count);
+		return count;
+	}
+	if (!realTree->tree) return 0;
+	kd_data_tries = 0;
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	search_push(&sr, realTree->tree, 0, 0, realTree->extent);
+	while (sr.top_index > 0)
+	{
+		sr.top_index--;
+		elem = sr.stk[sr.top_index].elem;
+		m = sr.stk[sr.top_index].disc;
+		hort = m & 0x01;
+		for (i = 0;  i < KD_BOX_MAX;  i++) box[i] = sr.stk[sr.top_index].box[i];
+		kd_data_tries++;
+		if (BOXWITHIN(box, area))
+		{
+			count += elem->count;
+			continue;
+		}
+		if (elem->item && BOXINTERSECT(area, elem->size)) count++;
+		if (elem->sons[KD_HISON] && KD_HI_OVERLAP(area, elem, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, elem, m, KD_HISON);
+			search_push(&sr, elem->sons[KD_HISON], 0, NEXTDISC(m), son_box);
+		}
+		if (elem->sons[KD_LOSON] && KD_LO_OVERLAP(area, elem, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, elem, m, KD_LOSON);
+			search_push(&sr, elem->sons[KD_LOSON], 0, NEXTDISC(m), son_box);
+		}
+	}
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return count;
+}
+
+
+/* ************** kd_stab -- point queries                        ********************************** */
+
+/*
+ * A point touches a box if it lies between its edges.  With the area
+ * shrunk to a point,  the son bound tests of kd_next() come down to
+ * comparing one coordinate against the bounds of the edge being split,
+ * and no box holding the subtree is needed.  kd_stab() goes down the
+ * first son that can hold the point straight away,  and keeps the
+ * other on a KDSearch stack only when both can.
+ */
+
+#define KD_LO_STAB(c, node, m) \
+    ((c) >= (node)->lo_min_bound && \
+     (c) <= (((m) & 0x02) ? (node)->size[m] : (node)->other_bound))
+#define KD_HI_STAB(c, node, m) \
+    ((c) <= (node)->hi_max_bound && \
+     (c) >= (((m) & 0x02) ? (node)->other_bound : (node)->size[m]))
+#define KD_STABS(x, y, size) \
+    ((size)[KD_LEFT] <= (x) && (x) <= (size)[KD_RIGHT] && \
+     (size)[KD_BOTTOM] <= (y) && (y) <= (size)[KD_TOP])
+
+static int stab_tree(KDSearch *sr, KDElem *elem, int x, int y, kd_visitor visitor, kd_generic arg)
+/* kd_stab() on a pointer tree;  returns non-zero if stopped */
+{
+	KDElem *lo, *hi;
+	int m = 0, c;
+
+	for (;;)
+	{
+		kd_data_tries++;
+		if (elem->item && KD_STABS(x, y, elem->size) &&
+			visit_copy(visitor, elem->item, elem->size, arg))
+			return 1;
+		c = (m & 0x01) ? y : x;
+		lo = elem->sons[KD_LOSON];
+		if (lo && !KD_LO_STAB(c, elem, m)) lo = (KDElem *) 0;
+		hi = elem->sons[KD_HISON];
+		if (hi && !KD_HI_STAB(c, elem, m)) hi = (KDElem *) 0;
+		m = NEXTDISC(m);
+		if (lo)
+		{
+			if (hi) search_push(sr, hi, 0, m, (int *) 0);
+			elem = lo;
+		}
+		else if (hi)
+			elem = hi;
+		else if (sr->top_index > 0)
+		{
+			sr->top_index--;
+			elem = sr->stk[sr->top_index].elem;
+			m = sr->stk[sr->top_index].disc;
+		}
+		else
+			return 0;
+	}
+}
+
+static int stab_frozen(KDSearch *sr, KDFrozen *fz, int x, int y, kd_visitor visitor, kd_generic arg)
+/* kd_stab() on a frozen tree;  returns non-zero if stopped */
+{
+	KDFNode *node;
+	kd_box point, box;
+	unsigned int idx = 0, lo, hi, pos, end, hits;
+	int m = 0, c, i, e;
+
+	point[KD_LEFT] = point[KD_RIGHT] = x;
+	point[KD_BOTTOM] = point[KD_TOP] = y;
+	for (;;)
+	{
+		node = &fz->nodes[idx];
+		if (KD_IS_BUCKET(node))
+		{
+			kd_data_tries += node->sons[KD_HISON];
+			end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+			if (!KD_STABS(x, y, node->size)) end = KD_BUCKET_START(node);
+			for (pos = KD_BUCKET_START(node);  pos < end;  pos += KD_BUCKET_WIDTH)
+			{
+				hits = bucket_hits(fz, pos, point);
+				if (end - pos < KD_BUCKET_WIDTH) hits &= (1u << (end - pos)) - 1;
+				while (hits)
+				{
+					i = pos + low_bit(hits);
+					hits &= hits - 1;
+					for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][i];
+					if ((*visitor)(fz->bucket_items[i], box, arg)) return 1;
+				}
+			}
+			lo = hi = 0;
+		}
+		else
+		{
+			kd_data_tries++;
+			if (fz->items[idx] && KD_STABS(x, y, node->size) &&
+				visit_copy(visitor, fz->items[idx], node->size, arg))
+				return 1;
+			c = (m & 0x01) ? y : x;
+			lo = node->sons[KD_LOSON];
+			if (lo && !KD_LO_STAB(c, node, m)) lo = 0;
+			hi = node->sons[KD_HISON];
+			if (hi && !KD_HI_STAB(c, node, m)) hi = 0;
+			m = NEXTDISC(m);
+		}
+		if (lo)
+		{
+			if (hi) search_push(sr, (KDElem *) 0, hi, m, (int *) 0);
+			idx = lo;
+		}
+		else if (hi)
+			idx = hi;
+		else if (sr->top_index > 0)
+		{
+			sr->top_index--;
+			idx = sr->stk[sr->top_index].node;
+			m = sr->stk[sr->top_index].disc;
+		}
+		else
+			return 0;
+	}
+}
+
+kd_status kd_stab(kd_tree theTree, int x, int y, kd_visitor visitor, kd_generic arg)
+/*
+ * Calls `visitor' with each item whose box holds the point (x,y),
+ * edges included,  its size and `arg':  the items kd_search() would
+ * find for a box of no area at that point,  in the same order.  As
+ * with kd_search(),  a non-zero return from the visitor stops the
+ * search and KD_STOPPED is returned;  otherwise KD_OK.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDSearch sr;
+	int stopped = 0;
+
+	kd_data_tries = 0;
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	if (realTree->frozen)
+	{
+		if (realTree->frozen->num_nodes)
+			stopped = stab_frozen(&sr, realTree->frozen, x, y, visitor, arg);
+	}
+	else if (realTree->tree)
+		stopped = stab_tree(&sr, realTree->tree, x, y, visitor, arg);
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return stopped ? KD_STOPPED : KD_OK;
+}
+
+
+/* ************** kd_search_segment -- line queries               ********************************** */
+
+/*
+ * A segment touches a box if their bounding boxes touch and the line
+ * through the segment does not leave all four corners strictly on
+ * one side.  The walk is kd_search()'s:  the son bound tests are run
+ * on the bounding box of the whole line,  which is cheap,  and then
+ * the box holding the son's subtree is tested against the segments
+ * themselves,  so that a long diagonal line does not drag in the
+ * subtrees sitting in the empty corners of its bounding box.  A
+ * polyline is the same walk testing each segment in turn;  an item
+ * touching several segments is still found once.
+ */
+
+typedef struct {
+	const int *points;		/* x,y pairs                 */
+	int npoints;			/* Number of pairs           */
+	kd_box ext;				/* Bounding box of the line  */
+} KDLine;
+
+static int cross_sign(long long ax, long long ay, long long bx, long long by)
+/* Sign of ax*by - ay*bx,  exactly:  the products can need 64 bits */
+{
+#if defined(__SIZEOF_INT128__)
+	__int128 d = (__int128) ax * by - (__int128) ay * bx;
+#else
+	long double d = (long double) ax * by - (long double) ay * bx;
+#endif
+
+	return (d > 0) - (d < 0);
+}
+
+static int segment_touches(const int *seg, const int *box)
+/* Does the segment seg[0],seg[1] - seg[2],seg[3] touch `box'? */
+{
+	static const int corners[4][2] = {
+		{ KD_LEFT, KD_BOTTOM }, { KD_RIGHT, KD_BOTTOM },
+		{ KD_LEFT, KD_TOP }, { KD_RIGHT, KD_TOP }
+	};
+	long long dx = (long long) seg[2] - seg[0];
+	long long dy = (long long) seg[3] - seg[1];
+	int i, s, side = 0;
+
+	if (MAX(seg[0], seg[2]) < box[KD_LEFT] || MIN(seg[0], seg[2]) > box[KD_RIGHT] ||
+		MAX(seg[1], seg[3]) < box[KD_BOTTOM] || MIN(seg[1], seg[3]) > box[KD_TOP])
+		return 0;
+	for (i = 0;  i < 4;  i++)
+	{
+		s = cross_sign(dx, dy, (long long) box[corners[i][0]] - seg[0],
+					   (long long) box[corners[i][1]] - seg[1]);
+		if (s == 0 || (side && s != side)) return 1;
+		side = s;
+	}
+	return 0;
+}
+
+static int line_touches(const KDLine *ln, const int *box)
+/* Does any segment of the line touch `box'? */
+{
+	int i;
+
+	if (!BOXINTERSECT(ln->ext, box)) return 0;
+	if (ln->npoints == 1) return 1;
+	for (i = 0;  i + 1 < ln->npoints;  i++)
+		if (segment_touches(ln->points + 2*i, box)) return 1;
+	return 0;
+}
+
+static int line_tree(KDSearch *sr, KDElem *root, const int *extent, const KDLine *ln, kd_visitor visitor, kd_generic arg)
+/* kd_search_polyline() on a pointer tree;  returns non-zero if stopped */
+{
+	KDElem *elem;
+	kd_box box, son_box;
+	int m, hort, i;
+
+	if (!line_touches(ln, extent)) return 0;
+	search_push(sr, root, 0, 0, extent);
+	while (sr->top_index > 0)
+	{
+		sr->top_index--;
+		elem = sr->stk[sr->top_index].elem;
+		m = sr->stk[sr->top_index].disc;
+		hort = m & 0x01;
+		for (i = 0;  i < KD_BOX_MAX;  i++) box[i] = sr->stk[sr->top_index].box[i];
+		kd_data_tries++;
+		if (elem->item && line_touches(ln, elem->size) &&
+			visit_copy(visitor, elem->item, elem->size, arg))
+			return 1;
+		if (elem->sons[KD_HISON] && KD_HI_OVERLAP(ln->ext, elem, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, elem, m, KD_HISON);
+			if (line_touches(ln, son_box))
+				search_push(sr, elem->sons[KD_HISON], 0, NEXTDISC(m), son_box);
+		}
+		if (elem->sons[KD_LOSON] && KD_LO_OVERLAP(ln->ext, elem, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, elem, m, KD_LOSON);
+			if (line_touches(ln, son_box))
+				search_push(sr, elem->sons[KD_LOSON], 0, NEXTDISC(m), son_box);
+		}
+	}
+	return 0;
+}
+
+static int line_frozen(KDSearch *sr, KDFrozen *fz, const int *extent, const KDLine *ln, kd_visitor visitor, kd_generic arg)
+/* kd_search_polyline() on a frozen tree;  returns non-zero if stopped */
+{
+	KDFNode *node;
+	kd_box box, son_box;
+	unsigned int idx, pos, end, hits;
+	int m, hort, i, e;
+
+	if (!line_touches(ln, extent)) return 0;
+	search_push(sr, (KDElem *) 0, 0, 0, extent);
+	while (sr->top_index > 0)
+	{
+		sr->top_index--;
+		idx = sr->stk[sr->top_index].node;
+		m = sr->stk[sr->top_index].disc;
+		hort = m & 0x01;
+		node = &fz->nodes[idx];
+		for (i = 0;  i < KD_BOX_MAX;  i++) box[i] = sr->stk[sr->top_index].box[i];
+		if (KD_IS_BUCKET(node))
+		{
+			kd_data_tries += node->sons[KD_HISON];
+			if (!line_touches(ln, node->size)) continue;
+			end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+			for (pos = KD_BUCKET_START(node);  pos < end;  pos += KD_BUCKET_WIDTH)
+			{
+				hits = bucket_hits(fz, pos, ln->ext);
+				if (end - pos < KD_BUCKET_WIDTH) hits &= (1u << (end - pos)) - 1;
+				while (hits)
+				{
+					i = pos + low_bit(hits);
+					hits &= hits - 1;
+					for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][i];
+					if (line_touches(ln, box) &&
+						(*visitor)(fz->bucket_items[i], box, arg))
+						return 1;
+				}
+			}
+			continue;
+		}
+		kd_data_tries++;
+		if (fz->items[idx] && line_touches(ln, node->size) &&
+			visit_copy(visitor, fz->items[idx], node->size, arg))
+			return 1;
+		if (node->sons[KD_HISON] && KD_HI_OVERLAP(ln->ext, node, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, node, m, KD_HISON);
+			if (line_touches(ln, son_box))
+				search_push(sr, (KDElem *) 0, node->sons[KD_HISON], NEXTDISC(m), son_box);
+		}
+		if (node->sons[KD_LOSON] && KD_LO_OVERLAP(ln->ext, node, m, hort))
+		{
+			for (i = 0;  i < KD_BOX_MAX;  i++) son_box[i] = box[i];
+			KD_SON_BOX(son_box, node, m, KD_LOSON);
+			if (line_touches(ln, son_box))
+				search_push(sr, (KDElem *) 0, node->sons[KD_LOSON], NEXTDISC(m), son_box);
+		}
+	}
+	return 0;
+}
+
+kd_status kd_search_polyline(kd_tree theTree, const int *points, int npoints, kd_visitor visitor, kd_generic arg)
+/*
+ * Calls `visitor' with each item touching the polyline through the
+ * `npoints' points in `points' (x,y pairs),  once per item,  in the
+ * order kd_next() would return them.  A single point is a line of no
+ * length.  Returns KD_STOPPED if the visitor stopped the search,
+ * otherwise KD_OK.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDSearch sr;
+	KDLine ln;
+	int stopped = 0, i;
+
+	kd_data_tries = 0;
+	if (npoints <= 0) return KD_OK;
+	ln.points = points;
+	ln.npoints = npoints;
+	ln.ext[KD_LEFT] = ln.ext[KD_RIGHT] = points[0];
+	ln.ext[KD_BOTTOM] = ln.ext[KD_TOP] = points[1];
+	for (i = 1;  i < npoints;  i++)
+	{
+		ln.ext[KD_LEFT] = MIN(ln.ext[KD_LEFT], points[2*i]);
+		ln.ext[KD_RIGHT] = MAX(ln.ext[KD_RIGHT], points[2*i]);
+		ln.ext[KD_BOTTOM] = MIN(ln.ext[KD_BOTTOM], points[2*i+1]);
+		ln.ext[KD_TOP] = MAX(ln.ext[KD_TOP], points[2*i+1]);
+	}
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	if (realTree->frozen)
+	{
+		if (realTree->frozen->num_nodes)
+			stopped = line_frozen(&sr, realTree->frozen, realTree->extent, &ln, visitor, arg);
+	}
+	else if (realTree->tree)
+		stopped = line_tree(&sr, realTree->tree, realTree->extent, &ln, visitor, arg);
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return stopped ? KD_STOPPED : KD_OK;
+}
+
+kd_status kd_search_segment(kd_tree theTree, int x0, int y0, int x1, int y1, kd_visitor visitor, kd_generic arg)
+/* kd_search_polyline() for the one segment (x0,y0) - (x1,y1) */
+{
+	int points[4];
+
+	points[0] = x0;  points[1] = y0;
+	points[2] = x1;  points[3] = y1;
+	return kd_search_polyline(theTree, points, 2, visitor, arg);
+}
+
+
+/* ************** kd_join -- pairs of touching items in two trees  ********************************** */
+
+/*
+ * kd_join() walks both trees at once.  Its stack holds pairs of
+ * subtrees,  one from each tree,  each with the box holding it;  a
+ * pair whose boxes are apart can hold no touching items and is never
+ * pushed.  For a pair of nodes A and B,  the items under A times the
+ * items under B are:
+ *
+ *	A's item	times everything under B
+ *	B's item	times everything under A's sons
+ *	each son of A	times each son of B
+ *
+ * The first two are ordinary searches of one subtree with one item's
+ * box;  the last are the pairs pushed.  A leaf bucket has no sons,
+ * and all its items are searched for in the other subtree.  Every
+ * touching pair turns up exactly once.
+ */
+
+typedef struct {
+	KDSearchSave a, b;		/* One subtree of each tree  */
+} KDJoinSave;
+
+typedef struct {
+	KDJoinSave *stk;		/* Stack of pending pairs    */
+	int stack_size;			/* Allocated size            */
+	int top_index;			/* Top of the stack          */
+	KDJoinSave local[KD_SEARCH_STACK];	/* Initial stack    */
+} KDJoin;
+
+typedef struct {
+	kd_join_func func;		/* Caller's function         */
+	kd_generic arg;			/* and its argument          */
+	kd_generic item;		/* Item being searched for   */
+	kd_box size;			/* and its box               */
+	int swap;				/* Item is from the b tree   */
+	atomic_int *stop;		/* Set when any thread stops */
+} KDJoinHalf;
+
+static int join_half(kd_generic item, kd_box size, kd_generic arg)
+/* kd_search() visitor:  hands a pair to the caller,  a tree's item first */
+{
+	KDJoinHalf *half = (KDJoinHalf *) arg;
+	int stopped;
+
+	if (half->stop && atomic_load_explicit(half->stop, memory_order_relaxed)) return 1;
+	stopped = half->swap ? (*half->func)(item, size, half->item, half->size, half->arg)
+		: (*half->func)(half->item, half->size, item, size, half->arg);
+	if (stopped && half->stop) atomic_store(half->stop, 1);
+	return stopped;
+}
+
+static int search_sub(KDFrozen *fz, const KDSearchSave *sub, const int *area, kd_visitor visitor, kd_generic arg)
+/* search_tree() or search_frozen() on one subtree,  on a stack of its own */
+{
+	KDSearch sr;
+	int stopped;
+
+	if (!BOXINTERSECT(sub->box, area)) return 0;
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	stopped = fz ? search_frozen(&sr, fz, sub->node, sub->disc, sub->box, area, visitor, arg)
+		: search_tree(&sr, sub->elem, sub->disc, sub->box, area, visitor, arg);
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return stopped;
+}
+
+static int join_items(KDFrozen *fz, const KDSearchSave *at, KDFrozen *ofz, const KDSearchSave *other, KDJoinHalf *half)
+/*
+ * Searches the subtree `other' for each item kept at the node `at'
+ * itself:  its own item,  or all of a leaf bucket.  Returns non-zero
+ * if stopped.
+ */
+{
+	KDFNode *node;
+	unsigned int pos, end;
+	int e;
+
+	if (!fz)
+	{
+		if (!at->elem->item) return 0;
+		half->item = at->elem->item;
+		for (e = 0;  e < KD_BOX_MAX;  e++) half->size[e] = at->elem->size[e];
+		return search_sub(ofz, other, half->size, join_half, (kd_generic) half);
+	}
+	node = &fz->nodes[at->node];
+	if (!KD_IS_BUCKET(node))
+	{
+		if (!fz->items[at->node]) return 0;
+		half->item = fz->items[at->node];
+		for (e = 0;  e < KD_BOX_MAX;  e++) half->size[e] = node->size[e];
+		return search_sub(ofz, other, half->size, join_half, (kd_generic) half);
+	}
+	end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+	for (pos = KD_BUCKET_START(node);  pos < end;  pos++)
+	{
+		if (!fz->bucket_items[pos]) continue;
+		half->item = fz->bucket_items[pos];
+		for (e = 0;  e < KD_BOX_MAX;  e++) half->size[e] = fz->bucket_box[e][pos];
+		if (search_sub(ofz, other, half->size, join_half, (kd_generic) half)) return 1;
+	}
+	return 0;
+}
+
+static int join_son(KDFrozen *fz, const KDSearchSave *f, int son, KDSearchSave *out)
+/* Fills `out' with son `son' of the subtree `f';  zero if there is none */
+{
+	int i;
+
+	for (i = 0;  i < KD_BOX_MAX;  i++) out->box[i] = f->box[i];
+	out->disc = NEXTDISC(f->disc);
+	if (fz)
+	{
+		if (KD_IS_BUCKET(&fz->nodes[f->node])) return 0;
+		out->elem = (KDElem *) 0;
+		out->node = fz->nodes[f->node].sons[son];
+		if (!out->node) return 0;
+		KD_SON_BOX(out->box, &fz->nodes[f->node], f->disc, son);
+	}
+	else
+	{
+		out->elem = f->elem->sons[son];
+		out->node = 0;
+		if (!out->elem) return 0;
+		KD_SON_BOX(out->box, f->elem, f->disc, son);
+	}
+	return 1;
+}
+
+static int is_bucket(KDFrozen *fz, const KDSearchSave *f)
+/* Is the subtree `f' a leaf bucket? */
+{
+	return fz && KD_IS_BUCKET(&fz->nodes[f->node]);
+}
+
+static void join_push(KDJoin *jn, const KDSearchSave *a, const KDSearchSave *b)
+/* Pushes a pair of subtrees,  growing the stack like search_push() */
+{
+	if (jn->top_index >= jn->stack_size)
+	{
+		if (jn->stk == jn->local)
+		{
+			jn->stk = MULTALLOC(KDJoinSave, 2 * jn->stack_size);
+			memcpy(jn->stk, jn->local, jn->stack_size * sizeof(KDJoinSave));
+		}
+		else
+			jn->stk = REALLOC(KDJoinSave, jn->stk, 2 * jn->stack_size);
+		jn->stack_size *= 2;
+	}
+	jn->stk[jn->top_index].a = *a;
+	jn->stk[jn->top_index].b = *b;
+	jn->top_index++;
+}
+
+static int join_trees(KDJoin *jn, KDFrozen *fa, KDFrozen *fb, KDJoinHalf *half)
+/* The walk over pairs of subtrees;  returns non-zero if stopped */
+{
+	KDSearchSave a, b, sa[2], sb[2];
+	int has_a[2], has_b[2], s, t;
+
+	while (jn->top_index > 0)
+	{
+		jn->top_index--;
+		a = jn->stk[jn->top_index].a;
+		b = jn->stk[jn->top_index].b;
+		kd_data_tries++;
+		/* A's own items against all of B */
+		half->swap = 0;
+		if (join_items(fa, &a, fb, &b, half)) return 1;
+		if (is_bucket(fa, &a)) continue;
+		if (is_bucket(fb, &b))
+		{
+			/* B's bucket against what is left of A:  its sons */
+			half->swap = 1;
+			for (s = KD_LOSON;  s <= KD_HISON;  s++)
+				if (join_son(fa, &a, s, &sa[0]) && join_items(fb, &b, fa, &sa[0], half))
+					return 1;
+			continue;
+		}
+		for (s = KD_LOSON;  s <= KD_HISON;  s++)
+		{
+			has_a[s] = join_son(fa, &a, s, &sa[s]);
+			has_b[s] = join_son(fb, &b, s, &sb[s]);
+		}
+		/* B's own item against A's sons */
+		half->swap = 1;
+		for (s = KD_LOSON;  s <= KD_HISON;  s++)
+			if (has_a[s] && join_items(fb, &b, fa, &sa[s], half)) return 1;
+		/* Pairs of sons,  pushed so the low ones come off first */
+		for (s = KD_HISON;  s >= KD_LOSON;  s--)
+			for (t = KD_HISON;  t >= KD_LOSON;  t--)
+				if (has_a[s] && has_b[t] && BOXINTERSECT(sa[s].box, sb[t].box))
+					join_push(jn, &sa[s], &sb[t]);
+	}
+	return 0;
+}
+
+kd_status kd_join(kd_tree treeA, kd_tree treeB, kd_join_func func, kd_generic arg)
+/*
+ * Calls `func' once for every pair of an item in `treeA' and an item
+ * in `treeB' whose boxes touch,  as (*func)(a, a_size, b, b_size, arg).
+ * If it returns non-zero the join stops there and KD_STOPPED is
+ * returned;  otherwise KD_OK once every pair has been seen.
+ */
+{
+	KDTree *ta = (KDTree *) treeA, *tb = (KDTree *) treeB;
+	KDFrozen *fa = ta->frozen, *fb = tb->frozen;
+	KDSearchSave a, b;
+	KDJoin jn;
+	KDJoinHalf half;
+	int stopped, i;
+
+	kd_data_tries = 0;
+	if (fa ? !fa->num_nodes : !ta->tree) return KD_OK;
+	if (fb ? !fb->num_nodes : !tb->tree) return KD_OK;
+	if (!BOXINTERSECT(ta->extent, tb->extent)) return KD_OK;
+	a.elem = fa ? (KDElem *) 0 : ta->tree;
+	b.elem = fb ? (KDElem *) 0 : tb->tree;
+	a.node = b.node = 0;
+	a.disc = b.disc = 0;
+	for (i = 0;  i < KD_BOX_MAX;  i++)
+	{
+		a.box[i] = ta->extent[i];
+		b.box[i] = tb->extent[i];
+	}
+	half.func = func;
+	half.arg = arg;
+	half.stop = (atomic_int *) 0;
+	jn.stk = jn.local;
+	jn.stack_size = KD_SEARCH_STACK;
+	jn.top_index = 0;
+	join_push(&jn, &a, &b);
+	stopped = join_trees(&jn, fa, fb, &half);
+	if (jn.stk != jn.local) FREE(jn.stk);
+	return stopped ? KD_STOPPED : KD_OK;
+}
+
+
+/* ************** kd_self_join -- pairs of touching items in one tree ******************************** */
+
+/*
+ * The touching pairs within the subtree under a node N are:
+ *
+ *	N's item	times everything under N's sons
+ *	pairs within each son
+ *	the low son	times the high son
+ *
+ * The first is a search of each son with one box,  the second is the
+ * same again one level down,  and the last is a kd_join() walk of the
+ * two sons,  which are apart in the tree and so share no items;  it
+ * is skipped when the boxes holding them are apart.  Within a leaf
+ * bucket every two items are tried.  Every pair turns up once.
+ *
+ * kd_self_join_parallel() splits the top of this into tasks of those
+ * three kinds,  breadth first,  and threads take them in turn.
+ */
+
+#define KD_SELF_TREE	0	/* Pairs within a subtree       */
+#define KD_SELF_ITEMS	1	/* A node's items against its sons */
+#define KD_SELF_CROSS	2	/* One subtree against another  */
+#define KD_SELF_TASKS	16	/* Tasks per thread              */
+
+static int self_items(KDFrozen *fz, const KDSearchSave *n, KDJoinHalf *half)
+/* Pairs of the items at node `n' with each other and with its sons */
+{
+	KDSearchSave son;
+	KDFNode *node;
+	kd_box box;
+	unsigned int pos, end, other;
+	int s, e;
+
+	half->swap = 0;
+	if (is_bucket(fz, n))
+	{
+		node = &fz->nodes[n->node];
+		end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+		for (pos = KD_BUCKET_START(node);  pos < end;  pos++)
+		{
+			if (!fz->bucket_items[pos]) continue;
+			half->item = fz->bucket_items[pos];
+			for (e = 0;  e < KD_BOX_MAX;  e++) half->size[e] = fz->bucket_box[e][pos];
+			for (other = pos + 1;  other < end;  other++)
+			{
+				if (!fz->bucket_items[other]) continue;
+				for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][other];
+				if (BOXINTERSECT(half->size, box) &&
+					join_half(fz->bucket_items[other], box, (kd_generic) half))
+					return 1;
+			}
+		}
+		return 0;
+	}
+	for (s = KD_LOSON;  s <= KD_HISON;  s++)
+		if (join_son(fz, n, s, &son) && join_items(fz, n, fz, &son, half)) return 1;
+	return 0;
+}
+
+static int self_cross(KDFrozen *fz, const KDSearchSave *a, const KDSearchSave *b, KDJoinHalf *half)
+/* kd_join() of two subtrees of the same tree */
+{
+	KDJoin jn;
+	int stopped;
+
+	if (!BOXINTERSECT(a->box, b->box)) return 0;
+	jn.stk = jn.local;
+	jn.stack_size = KD_SEARCH_STACK;
+	jn.top_index = 0;
+	join_push(&jn, a, b);
+	stopped = join_trees(&jn, fz, fz, half);
+	if (jn.stk != jn.local) FREE(jn.stk);
+	return stopped;
+}
+
+static int self_tree(KDFrozen *fz, const KDSearchSave *root, KDJoinHalf *half)
+/* Pairs within the subtree `root';  returns non-zero if stopped */
+{
+	KDSearch sr;
+	KDSearchSave n, lo, hi;
+	int has_lo, has_hi, stopped = 0;
+
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	search_push(&sr, root->elem, root->node, root->disc, root->box);
+	while (!stopped && sr.top_index > 0)
+	{
+		n = sr.stk[--sr.top_index];
+		kd_data_tries++;
+		if (self_items(fz, &n, half))
+		{
+			stopped = 1;
+			break;
+		}
+		has_lo = join_son(fz, &n, KD_LOSON, &lo);
+		has_hi = join_son(fz, &n, KD_HISON, &hi);
+		if (has_lo && has_hi) stopped = self_cross(fz, &lo, &hi, half);
+		if (has_hi) search_push(&sr, hi.elem, hi.node, hi.disc, hi.box);
+		if (has_lo) search_push(&sr, lo.elem, lo.node, lo.disc, lo.box);
+	}
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return stopped;
+}
+
+static int self_root(KDTree *tree, KDSearchSave *root)
+/* Fills `root' with the whole of `tree';  zero if it is empty */
+{
+	int i;
+
+	if (tree->frozen ? !tree->frozen->num_nodes : !tree->tree) return 0;
+	root->elem = tree->frozen ? (KDElem *) 0 : tree->tree;
+	root->node = 0;
+	root->disc = 0;
+	for (i = 0;  i < KD_BOX_MAX;  i++) root->box[i] = tree->extent[i];
+	return 1;
+}
+
+kd_status kd_self_join(kd_tree theTree, kd_join_func func, kd_generic arg)
+/*
+ * Calls `func' once for every pair of distinct items in `theTree'
+ * whose boxes touch,  as (*func)(a, a_size, b, b_size, arg);  which
+ * of the two comes first is not defined.  If it returns non-zero the
+ * walk stops there and KD_STOPPED is returned;  otherwise KD_OK.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDSearchSave root;
+	KDJoinHalf half;
+
+	kd_data_tries = 0;
+	if (!self_root(realTree, &root)) return KD_OK;
+	half.func = func;
+	half.arg = arg;
+	half.stop = (atomic_int *) 0;
+	return self_tree(realTree->frozen, &root, &half) ? KD_STOPPED : KD_OK;
+}
+
+typedef struct {
+	int kind;				/* KD_SELF_TREE and so on    */
+	KDSearchSave a, b;		/* Subtrees it covers        */
+} KDSelfTask;
+
+typedef struct {
+	KDFrozen *fz;			/* Tree,  if frozen          */
+	KDSelfTask *tasks;		/* All the tasks             */
+	int num_tasks;
+	atomic_int next;		/* Next task to take         */
+	atomic_int stop;		/* Set once func stops       */
+	kd_join_func func;		/* Caller's function         */
+	kd_generic arg;			/* and its argument          */
+} KDSelfWork;
+
+static void *self_worker(void *arg)
+/* Takes tasks until there are none left or the join is stopped */
+{
+	KDSelfWork *w = (KDSelfWork *) arg;
+	KDSelfTask *t;
+	KDJoinHalf half;
+	int i, stopped;
+
+	half.func = w->func;
+	half.arg = w->arg;
+	half.stop = &w->stop;
+	while (!atomic_load(&w->stop))
+	{
+		i = atomic_fetch_add(&w->next, 1);
+		if (i >= w->num_tasks) break;
+		t = &w->tasks[i];
+		if (t->kind == KD_SELF_TREE) stopped = self_tree(w->fz, &t->a, &half);
+		else if (t->kind == KD_SELF_ITEMS) stopped = self_items(w->fz, &t->a, &half);
+		else stopped = self_cross(w->fz, &t->a, &t->b, &half);
+		if (stopped) atomic_store(&w->stop, 1);
+	}
+	return (void *) 0;
+}
+
+static void self_task(KDSelfWork *w, int *alloc, int kind, const KDSearchSave *a, const KDSearchSave *b)
+/* Adds a task to the list */
+{
+	if (w->num_tasks >= *alloc)
+	{
+		*alloc *= 2;
+		w->tasks = REALLOC(KDSelfTask, w->tasks, *alloc);
+	}
+	w->tasks[w->num_tasks].kind = kind;
+	w->tasks[w->num_tasks].a = *a;
+	if (b) w->tasks[w->num_tasks].b = *b;
+	w->num_tasks++;
+}
+
+kd_status kd_self_join_parallel(kd_tree theTree, kd_join_func func, kd_generic arg, int nthreads)
+/*
+ * kd_self_join() on up to `nthreads' threads,  counting the caller.
+ * `func' is called from all of them at once.  Once it has returned
+ * non-zero on one thread,  the others stop at their next pair.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDSelfWork w;
+	KDSearchSave root, lo, hi;
+	KDSelfTask t;
+	pthread_t *threads;
+	char *started;
+	int alloc, i, has_lo, has_hi;
+
+	if (nthreads <= 1) return kd_self_join(theTree, func, arg);
+	if (!self_root(realTree, &root)) return KD_OK;
+	w.fz = realTree->frozen;
+	w.func = func;
+	w.arg = arg;
+	w.num_tasks = 0;
+	alloc = 4 * KD_SELF_TASKS * nthreads;
+	w.tasks = MULTALLOC(KDSelfTask, alloc);
+	atomic_init(&w.next, 0);
+	atomic_init(&w.stop, 0);
+
+	/* Split whole subtrees,  breadth first,  until there are enough tasks */
+	self_task(&w, &alloc, KD_SELF_TREE, &root, (KDSearchSave *) 0);
+	for (i = 0;  i < w.num_tasks && w.num_tasks < KD_SELF_TASKS * nthreads;  i++)
+	{
+		t = w.tasks[i];
+		if (t.kind != KD_SELF_TREE || is_bucket(w.fz, &t.a)) continue;
+		w.tasks[i].kind = KD_SELF_ITEMS;
+		has_lo = join_son(w.fz, &t.a, KD_LOSON, &lo);
+		has_hi = join_son(w.fz, &t.a, KD_HISON, &hi);
+		if (has_lo) self_task(&w, &alloc, KD_SELF_TREE, &lo, (KDSearchSave *) 0);
+		if (has_hi) self_task(&w, &alloc, KD_SELF_TREE, &hi, (KDSearchSave *) 0);
+		if (has_lo && has_hi && BOXINTERSECT(lo.box, hi.box))
+			self_task(&w, &alloc, KD_SELF_CROSS, &lo, &hi);
+	}
+
+	threads = MULTALLOC(pthread_t, nthreads);
+	started = MULTALLOC(char, nthreads);
+	for (i = 1;  i < nthreads;  i++)
+		started[i] = (pthread_create(&threads[i], NULL, self_worker, &w) == 0);
+	(void) self_worker(&w);
+	for (i = 1;  i < nthreads;  i++)
+		if (started[i]) (void) pthread_join(threads[i], NULL);
+	FREE(started);
+	FREE(threads);
+	FREE(w.tasks);
+	return atomic_load(&w.stop) ? KD_STOPPED : KD_OK;
+}
+
+
+/* ************** kd_search_parallel -- one search on several threads ******************************* */
+
+/*
+ * The top of the tree is split breadth first,  as for
+ * kd_self_join_parallel(),  into subtrees touching the area until
+ * there are KD_PART_TASKS of them per thread;  the caller visits the
+ * items of the nodes split on the way.  Threads then take whole
+ * subtrees in turn and search them as kd_search() would.
+ */
+
+#define KD_PART_TASKS	16	/* Subtrees per thread           */
+
+typedef struct {
+	KDSearchSave sub;		/* Subtree to search         */
+	int split;				/* Handed on to its sons     */
+} KDPartTask;
+
+typedef struct {
+	KDFrozen *fz;			/* Tree,  if frozen          */
+	const int *area;		/* Area searched             */
+	KDPartTask *tasks;		/* All the tasks             */
+	int num_tasks;
+	atomic_int next;		/* Next task to take         */
+	atomic_int stop;		/* Set once a visitor stops  */
+	kd_visitor visitor;		/* Caller's visitor          */
+} KDPartWork;
+
+typedef struct {
+	KDPartWork *w;
+	kd_generic arg;			/* This thread's visitor argument */
+} KDPartWorker;
+
+static int part_visit(kd_generic item, kd_box size, kd_generic arg)
+/* kd_search() visitor:  the caller's,  giving up once any thread stops */
+{
+	KDPartWorker *pw = (KDPartWorker *) arg;
+
+	if (atomic_load_explicit(&pw->w->stop, memory_order_relaxed)) return 1;
+	if ((*pw->w->visitor)(item, size, pw->arg))
+	{
+		atomic_store(&pw->w->stop, 1);
+		return 1;
+	}
+	return 0;
+}
+
+static void *part_worker(void *arg)
+/* Takes subtrees until there are none left or the search is stopped */
+{
+	KDPartWorker *pw = (KDPartWorker *) arg;
+	KDPartWork *w = pw->w;
+	int i;
+
+	while (!atomic_load(&w->stop))
+	{
+		i = atomic_fetch_add(&w->next, 1);
+		if (i >= w->num_tasks) break;
+		if (w->tasks[i].split) continue;
+		if (search_sub(w->fz, &w->tasks[i].sub, w->area, part_visit, (kd_generic) pw))
+			atomic_store(&w->stop, 1);
+	}
+	return (void *) 0;
+}
+
+static void part_task(KDPartWork *w, int *alloc, const KDSearchSave *sub)
+/* Adds a subtree to the list,  if it touches the area */
+{
+	if (!BOXINTERSECT(sub->box, w->area)) return;
+	if (w->num_tasks >= *alloc)
+	{
+		*alloc *= 2;
+		w->tasks = REALLOC(KDPartTask, w->tasks, *alloc);
+	}
+	w->tasks[w->num_tasks].sub = *sub;
+	w->tasks[w->num_tasks].split = 0;
+	w->num_tasks++;
+}
+
+kd_status kd_search_parallel(kd_tree theTree, kd_box area, kd_visitor visitor, kd_generic *args, int nthreads)
+/*
+ * kd_search() on up to `nthreads' threads,  counting the caller.
+ * Each thread calls `visitor' with its own argument,  args[0] on the
+ * calling thread and args[1] .. args[nthreads-1] on the others,  so
+ * that each can gather what it finds without locking.  Items come in
+ * no particular order.  Once the visitor has returned non-zero on one
+ * thread,  the others stop at their next item.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDPartWork w;
+	KDPartWorker *workers;
+	KDSearchSave root, sub, son;
+	KDFNode *node;
+	pthread_t *threads;
+	char *started;
+	kd_generic item;
+	int *size;
+	int alloc, i, s;
+
+	if (nthreads <= 1) return kd_search(theTree, area, visitor, args[0]);
+	kd_data_tries = 0;
+	if (!self_root(realTree, &root)) return KD_OK;
+	w.fz = realTree->frozen;
+	w.area = area;
+	w.visitor = visitor;
+	w.num_tasks = 0;
+	alloc = 4 * KD_PART_TASKS * nthreads;
+	w.tasks = MULTALLOC(KDPartTask, alloc);
+	atomic_init(&w.next, 0);
+	atomic_init(&w.stop, 0);
+
+	/* Split subtrees,  breadth first,  visiting the items split off */
+	part_task(&w, &alloc, &root);
+	for (i = 0;  i < w.num_tasks && w.num_tasks < KD_PART_TASKS * nthreads;  i++)
+	{
+		sub = w.tasks[i].sub;
+		if (is_bucket(w.fz, &sub)) continue;
+		w.tasks[i].split = 1;
+		if (w.fz)
+		{
+			node = &w.fz->nodes[sub.node];
+			item = w.fz->items[sub.node];
+			size = node->size;
+		}
+		else
+		{
+			item = sub.elem->item;
+			size = sub.elem->size;
+		}
+		if (item && BOXINTERSECT(area, size) && visit_copy(visitor, item, size, args[0]))
+		{
+			FREE(w.tasks);
+			return KD_STOPPED;
+		}
+		for (s = KD_LOSON;  s <= KD_HISON;  s++)
+			if (join_son(w.fz, &sub, s, &son)) part_task(&w, &alloc, &son);
+	}
+
+	threads = MULTALLOC(pthread_t, nthreads);
+	started = MULTALLOC(char, nthreads);
+	workers = MULTALLOC(KDPartWorker, nthreads);
+	for (i = 0;  i < nthreads;  i++)
+	{
+		workers[i].w = &w;
+		workers[i].arg = args[i];
+	}
+	for (i = 1;  i < nthreads;  i++)
+		started[i] = (pthread_create(&threads[i], NULL, part_worker, &workers[i]) == 0);
+	(void) part_worker(&workers[0]);
+	for (i = 1;  i < nthreads;  i++)
+		if (started[i]) (void) pthread_join(threads[i], NULL);
+	FREE(workers);
+	FREE(started);
+	FREE(threads);
+	FREE(w.tasks);
+	return atomic_load(&w.stop) ? KD_STOPPED : KD_OK;
+}
+
+
+/* ************** kd_nearest_best_first -- kNN for large m ************************************** */
+
+/*
+ * kd_nearest() walks depth first and files each item with
+ * add_priority(),  which is fine for a handful of neighbors but costs
+ * O(m) per item once m runs into the hundreds.  Here the subtrees
+ * still to visit wait on a min-heap,  keyed by the distance from the
+ * point to the box holding each,  and the nearest one is always
+ * taken next;  the walk ends when that is no nearer than the m'th
+ * best so far.  The best m wait on a max-heap,  farthest on top,
+ * kept in the caller's list and sorted at the end.  Both cost
+ * O(log) per step.
+ */
+
+#define KD_NEAR_HEAP	64	/* Subtrees the heap starts with */
+
+typedef struct {
+	double dist;			/* Squared distance to box   */
+	kd_generic item;		/* Item waiting,  or zero    */
+	KDSearchSave sub;		/* else the subtree waiting  */
+} KDNearSave;
+
+typedef struct {
+	KDNearSave *heap;		/* Subtrees,  nearest on top */
+	int count, size;
+	KDPriority *best;		/* Best so far,  farthest on top */
+	int num_best, m;
+} KDNear;
+
+static void near_push(KDNear *nr, double dist, const KDSearchSave *sub, kd_generic item)
+/* Adds a subtree,  or an item,  to the min-heap */
+{
+	KDNearSave save;
+	int i, up;
+
+	if (nr->count >= nr->size)
+	{
+		nr->size *= 2;
+		nr->heap = REALLOC(KDNearSave, nr->heap, nr->size);
+	}
+	save.dist = dist;
+	save.item = item;
+	if (sub) save.sub = *sub;
+	for (i = nr->count++;  i > 0;  i = up)
+	{
+		up = (i - 1) / 2;
+		if (nr->heap[up].dist <= dist) break;
+		nr->heap[i] = nr->heap[up];
+	}
+	nr->heap[i] = save;
+}
+
+static void near_pop(KDNear *nr, KDNearSave *top)
+/* Takes the nearest entry off the min-heap */
+{
+	KDNearSave last;
+	int i, son;
+
+	*top = nr->heap[0];
+	last = nr->heap[--nr->count];
+	for (i = 0;  (son = 2 * i + 1) < nr->count;  i = son)
+	{
+		if (son + 1 < nr->count && nr->heap[son+1].dist < nr->heap[son].dist) son++;
+		if (last.dist <= nr->heap[son].dist) break;
+		nr->heap[i] = nr->heap[son];
+	}
+	nr->heap[i] = last;
+}
+
+static void best_sift(KDPriority *best, int n, int i)
+/* Moves best[i] down the max-heap best[0..n-1] to its place */
+{
+	KDPriority item = best[i];
+	int son;
+
+	for (;  (son = 2 * i + 1) < n;  i = son)
+	{
+		if (son + 1 < n && best[son+1].dist > best[son].dist) son++;
+		if (item.dist >= best[son].dist) break;
+		best[i] = best[son];
+	}
+	best[i] = item;
+}
+
+static double near_bound(const KDNear *nr)
+/* Squared distance an item has to beat */
+{
+	return (nr->m == 0 || nr->num_best < nr->m) ? HUGE_VAL : nr->best[0].dist;
+}
+
+static void near_item(KDNear *nr, double dist, kd_generic item)
+/*
+ * Files an item at squared distance `dist' among the best,  or with
+ * no best list (kd_nearest_start) queues it with the subtrees
+ */
+{
+	int i, up;
+
+	kd_data_tries++;
+	if (nr->m == 0)
+		near_push(nr, dist, (KDSearchSave *) 0, item);
+	else if (nr->num_best < nr->m)
+	{
+		for (i = nr->num_best++;  i > 0;  i = up)
+		{
+			up = (i - 1) / 2;
+			if (nr->best[up].dist >= dist) break;
+			nr->best[i] = nr->best[up];
+		}
+		nr->best[i].dist = dist;
+		nr->best[i].elem = item;
+	}
+	else if (dist < nr->best[0].dist)
+	{
+		nr->best[0].dist = dist;
+		nr->best[0].elem = item;
+		best_sift(nr->best, nr->m, 0);
+	}
+}
+
+/*
+ * Distance metrics (kd_nearest_metric).  The search code below is
+ * written once over a constant `metric' and forced inline into one
+ * copy per metric,  so each copy has its kernels compiled in:  no
+ * call per item,  and no test of the metric either.  A metric gives
+ * the distance of an item,  and a bound below the distance of any
+ * item inside a box,  which is what the searches prune with;  both
+ * may be kept squared,  to be put right by metric_final().
+ */
+
+#if defined(__GNUC__)
+#define KD_INLINE	static inline __attribute__((always_inline))
+#else
+#define KD_INLINE	static inline
+#endif
+
+KD_INLINE double metric_dist(int metric, const int *Xq, const int *size)
+/* Distance from the point `Xq' to an item of box `size' */
+{
+	double dx = 0.0, dy = 0.0;
+
+	if (metric == KD_CENTROID)
+	{
+		/* Squared,  to the middle of the box */
+		dx = ((double) size[KD_LEFT] + size[KD_RIGHT]) / 2.0 - Xq[KD_LEFT];
+		dy = ((double) size[KD_BOTTOM] + size[KD_TOP]) / 2.0 - Xq[KD_BOTTOM];
+		return dx*dx + dy*dy;
+	}
+	if (metric == KD_EUCLIDEAN) return KDdist(Xq, size);
+	if (Xq[KD_LEFT] > size[KD_RIGHT]) dx = (double) Xq[KD_LEFT] - size[KD_RIGHT];
+	else if (Xq[KD_RIGHT] < size[KD_LEFT]) dx = (double) size[KD_LEFT] - Xq[KD_RIGHT];
+	if (Xq[KD_BOTTOM] > size[KD_TOP]) dy = (double) Xq[KD_BOTTOM] - size[KD_TOP];
+	else if (Xq[KD_TOP] < size[KD_BOTTOM]) dy = (double) size[KD_BOTTOM] - Xq[KD_TOP];
+	return (metric == KD_MANHATTAN) ? dx + dy : MAX(dx, dy);
+}
+
+KD_INLINE double metric_bound(int metric, const int *Xq, const int *box)
+/*
+ * No item in `box' is nearer than this.  An item's edges lie inside
+ * the box,  so its edge distances are no less than the box's;  so
+ * does its middle,  which makes the squared edge distance the bound
+ * for KD_CENTROID.
+ */
+{
+	return (metric == KD_CENTROID) ? KDdist(Xq, box) : metric_dist(metric, Xq, box);
+}
+
+KD_INLINE double metric_final(int metric, double dist)
+/* The distance given back for one kept by the search */
+{
+	return (metric == KD_EUCLIDEAN || metric == KD_CENTROID) ? sqrt(dist) : dist;
+}
+
+KD_INLINE void near_node_metric(KDNear *nr, KDFrozen *fz, const KDSearchSave *top, kd_box Xq, int metric)
+/*
+ * Files the items at node `top' and below it goes on to the nearer
+ * son,  and so on down,  queueing only the farther sons:  half the
+ * heap traffic of queueing both,  and no less exact,  since all that
+ * is left unopened still waits on the heap.
+ */
+{
+	KDSearchSave n, son[2];
+	KDFNode *node;
+	kd_box box;
+	unsigned int pos, end;
+	double dist[2];
+	int s, e, has[2];
+
+	n = *top;
+	for (;;)
+	{
+		if (fz)
+		{
+			node = &fz->nodes[n.node];
+			if (KD_IS_BUCKET(node))
+			{
+				end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+				for (pos = KD_BUCKET_START(node);  pos < end;  pos++)
+				{
+					if (!fz->bucket_items[pos]) continue;
+					for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][pos];
+					near_item(nr, metric_dist(metric, Xq, box), fz->bucket_items[pos]);
+				}
+				return;
+			}
+			if (fz->items[n.node])
+				near_item(nr, metric_dist(metric, Xq, node->size), fz->items[n.node]);
+		}
+		else if (n.elem->item)
+			near_item(nr, metric_dist(metric, Xq, n.elem->size), n.elem->item);
+		for (s = KD_LOSON;  s <= KD_HISON;  s++)
+		{
+			has[s] = join_son(fz, &n, s, &son[s]);
+			if (!has[s]) continue;
+			/* A bucket knows its own box,  which is tighter */
+			dist[s] = metric_bound(metric, Xq,
+				is_bucket(fz, &son[s]) ? fz->nodes[son[s].node].size : son[s].box);
+			has[s] = dist[s] < near_bound(nr);
+		}
+		if (has[KD_LOSON] && has[KD_HISON])
+		{
+			s = dist[KD_HISON] < dist[KD_LOSON];
+			near_push(nr, dist[!s], &son[!s], (kd_generic) 0);
+		}
+		else if (has[KD_LOSON] || has[KD_HISON])
+			s = has[KD_HISON];
+		else
+			return;
+		n = son[s];
+	}
+}
+
+KD_INLINE void near_best_metric(KDNear *nr, KDTree *tree, kd_box Xq, int m, KDPriority *list, int metric)
+/*
+ * The m nearest to `Xq' into list[0..m-1],  nearest first,  as
+ * kd_nearest() leaves them;  the heap of `nr' is reused as it is.
+ */
+{
+	KDSearchSave root;
+	KDNearSave top;
+	KDPriority t;
+	int i;
+
+	for (i = 0;  i < m;  i++)
+	{
+		list[i].dist = 1.79769313486231470e+308;
+		list[i].elem = (kd_generic) 0;
+	}
+	nr->best = list;
+	nr->num_best = 0;
+	nr->m = m;
+	nr->count = 0;
+	if (self_root(tree, &root))
+		near_push(nr, metric_bound(metric, Xq, root.box), &root, (kd_generic) 0);
+	while (nr->count > 0 && nr->heap[0].dist < near_bound(nr))
+	{
+		near_pop(nr, &top);
+		near_node_metric(nr, tree->frozen, &top.sub, Xq, metric);
+	}
+
+	/* Heap order to nearest first */
+	for (i = nr->num_best - 1;  i > 0;  i--)
+	{
+		t = list[0];
+		list[0] = list[i];
+		list[i] = t;
+		best_sift(list, i, 0);
+	}
+	for (i = 0;  i < m;  i++) list[i].dist = metric_final(metric, list[i].dist);
+}
+
+/* The copies of near_node_metric() and near_best_metric() in use */
+
+static void near_node(KDNear *nr, KDFrozen *fz, const KDSearchSave *top, kd_box Xq)
+{
+	near_node_metric(nr, fz, top, Xq, KD_EUCLIDEAN);
+}
+
+static void near_best(KDNear *nr, KDTree *tree, kd_box Xq, int m, KDPriority *list)
+{
+	near_best_metric(nr, tree, Xq, m, list, KD_EUCLIDEAN);
+}
+
+static void near_best_manhattan(KDNear *nr, KDTree *tree, kd_box Xq, int m, KDPriority *list)
+{
+	near_best_metric(nr, tree, Xq, m, list, KD_MANHATTAN);
+}
+
+static void near_best_chebyshev(KDNear *nr, KDTree *tree, kd_box Xq, int m, KDPriority *list)
+{
+	near_best_metric(nr, tree, Xq, m, list, KD_CHEBYSHEV);
+}
+
+static void near_best_centroid(KDNear *nr, KDTree *tree, kd_box Xq, int m, KDPriority *list)
+{
+	near_best_metric(nr, tree, Xq, m, list, KD_CENTROID);
+}
+
+int kd_nearest_best_first(kd_tree tree, int x, int y, int m, kd_priority **alist)
+/*
+ * kd_nearest() for large m:  the same list,  nearest first,  but
+ * found best first.  Returns the number of items looked at.
+ */
+{
+	KDPriority *list;
+	KDNear nr;
+	kd_box Xq;
+
+	kd_data_tries = 0;
+	list = (KDPriority *) calloc(m > 0 ? m : 1, sizeof(struct kd_priority));
+	*alist = (kd_priority *) list;
+	if (m <= 0) return 0;
+	Xq[KD_LEFT] = Xq[KD_RIGHT] = x;
+	Xq[KD_BOTTOM] = Xq[KD_TOP] = y;
+	nr.size = KD_NEAR_HEAP;
+	nr.heap = MULTALLOC(KDNearSave, nr.size);
+	near_best(&nr, (KDTree *) tree, Xq, m, list);
+	FREE(nr.heap);
+	return kd_data_tries;
+}
+
+
+int kd_nearest_metric(kd_tree tree, int x, int y, int m, int metric, kd_priority **alist)
+/*
+ * kd_nearest_best_first() by another measure of distance:  one of
+ * KD_EUCLIDEAN (kd_nearest's own),  KD_MANHATTAN,  KD_CHEBYSHEV,  all
+ * edge to edge,  or KD_CENTROID,  straight to the middle of each box.
+ * Returns the number of items looked at,  or KD_BADARG,  with no
+ * list,  for any other metric.
+ */
+{
+	KDPriority *list;
+	KDNear nr;
+	kd_box Xq;
+
+	if (metric != KD_EUCLIDEAN && metric != KD_MANHATTAN &&
+		metric != KD_CHEBYSHEV && metric != KD_CENTROID)
+	{
+		*alist = (kd_priority *) 0;
+		return kd_set_error(KD_BADARG);
+	}
+	kd_data_tries = 0;
+	list = (KDPriority *) calloc(m > 0 ? m : 1, sizeof(struct kd_priority));
+	*alist = (kd_priority *) list;
+	if (m <= 0) return 0;
+	Xq[KD_LEFT] = Xq[KD_RIGHT] = x;
+	Xq[KD_BOTTOM] = Xq[KD_TOP] = y;
+	nr.size = KD_NEAR_HEAP;
+	nr.heap = MULTALLOC(KDNearSave, nr.size);
+	switch (metric)
+	{
+	case KD_MANHATTAN:
+		near_best_manhattan(&nr, (KDTree *) tree, Xq, m, list);
+		break;
+	case KD_CHEBYSHEV:
+		near_best_chebyshev(&nr, (KDTree *) tree, Xq, m, list);
+		break;
+	case KD_CENTROID:
+		near_best_centroid(&nr, (KDTree *) tree, Xq, m, list);
+		break;
+	case KD_EUCLIDEAN:
+		near_best(&nr, (KDTree *) tree, Xq, m, list);
+		break;
+	}
+	FREE(nr.heap);
+	return kd_data_tries;
+}
+
+/* ************** kd_nearest_start -- neighbors one at a time *********************************** */
+
+/*
+ * The best first walk with no m:  items go on the heap with the
+ * subtrees,  and whenever an item comes to the top nothing left can
+ * be nearer,  so it is the next neighbor.  Each kd_nearest_next()
+ * opens subtrees only until that happens.
+ */
+
+typedef struct {
+	KDTree *tree;			/* Tree searched             */
+	kd_box Xq;				/* Query point               */
+	KDNear nr;				/* Heap of items and subtrees */
+	int tries;				/* Items looked at so far    */
+} KDNearGen;
+
+kd_near_gen kd_nearest_start(kd_tree tree, int x, int y)
+/*
+ * Starts a walk through the items of `tree' in order of distance
+ * from (x,y),  nearest first.  The tree must not change until
+ * kd_nearest_finish() is called.
+ */
+{
+	KDNearGen *gen;
+	KDSearchSave root;
+
+	gen = ALLOC(KDNearGen);
+	gen->tree = (KDTree *) tree;
+	gen->Xq[KD_LEFT] = gen->Xq[KD_RIGHT] = x;
+	gen->Xq[KD_BOTTOM] = gen->Xq[KD_TOP] = y;
+	gen->nr.best = (KDPriority *) 0;
+	gen->nr.num_best = gen->nr.m = 0;
+	gen->nr.count = 0;
+	gen->nr.size = KD_NEAR_HEAP;
+	gen->nr.heap = MULTALLOC(KDNearSave, gen->nr.size);
+	gen->tries = 0;
+	if (self_root(gen->tree, &root))
+		near_push(&gen->nr, KDdist(gen->Xq, root.box), &root, (kd_generic) 0);
+	return (kd_near_gen) gen;
+}
+
+kd_status kd_nearest_next(kd_near_gen theGen, kd_generic *item, double *dist)
+/*
+ * Returns the next nearest item in `item',  and its distance in
+ * `dist' if that is not zero.  Returns KD_NOMORE once every item has
+ * been returned.
+ */
+{
+	KDNearGen *gen = (KDNearGen *) theGen;
+	KDNearSave top;
+
+	kd_data_tries = 0;
+	while (gen->nr.count > 0)
+	{
+		near_pop(&gen->nr, &top);
+		if (top.item)
+		{
+			gen->tries += kd_data_tries;
+			*item = top.item;
+			if (dist) *dist = sqrt(top.dist);
+			return KD_OK;
+		}
+		near_node(&gen->nr, gen->tree->frozen, &top.sub, gen->Xq);
+	}
+	gen->tries += kd_data_tries;
+	return KD_NOMORE;
+}
+
+int kd_nearest_finish(kd_near_gen theGen)
+/* Frees the walk;  returns the number of items it looked at */
+{
+	KDNearGen *gen = (KDNearGen *) theGen;
+	int tries = gen->tries;
+
+	FREE(gen->nr.heap);
+	FREE(gen);
+	return tries;
+}
+
+
+/* ************** kd_nearest_batch -- many points at once *************************************** */
+
+/*
+ * Queries near each other on the ground open the same subtrees,  so
+ * the batch is taken in the order of a Hilbert curve through the
+ * query points,  in runs of KD_BATCH_RUN;  each thread takes the next
+ * run and keeps one heap for all of them.  Nothing is allocated per
+ * query.
+ */
+
+#define KD_HILBERT_BITS	16	/* Curve resolution,  per axis      */
+#define KD_BATCH_RUN	64	/* Queries a thread takes at a time */
+
+typedef struct {
+	unsigned int key;		/* Place along the curve     */
+	int query;				/* Index into the batch      */
+} KDCurvePlace;
+
+static unsigned int hilbert_key(unsigned int x, unsigned int y)
+/* Distance along the Hilbert curve of the cell (x,y) */
+{
+	unsigned int rx, ry, s, t, d = 0;
+
+	for (s = 1u << (KD_HILBERT_BITS - 1);  s > 0;  s >>= 1)
+	{
+		rx = (x & s) != 0;
+		ry = (y & s) != 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (!ry)
+		{
+			/* Rotate the quadrant */
+			if (rx)
+			{
+				x = s - 1 - (x & (s - 1));
+				y = s - 1 - (y & (s - 1));
+			}
+			t = x;  x = y;  y = t;
+		}
+	}
+	return d;
+}
+
+static int cmp_curve(const void *a, const void *b)
+{
+	unsigned int ka = ((const KDCurvePlace *) a)->key, kb = ((const KDCurvePlace *) b)->key;
+
+	return (ka > kb) - (ka < kb);
+}
+
+typedef struct {
+	KDTree *tree;			/* Tree searched             */
+	const int *xy;			/* Query points              */
+	const KDCurvePlace *order;	/* Queries in curve order   */
+	int nq, m;
+	KDPriority *out;		/* m results per query       */
+	atomic_int next;		/* Next run to take          */
+} KDBatchWork;
+
+static void *batch_worker(void *arg)
+/* Takes runs of queries until there are none left */
+{
+	KDBatchWork *w = (KDBatchWork *) arg;
+	KDNear nr;
+	kd_box Xq;
+	int i, end, q;
+
+	nr.size = KD_NEAR_HEAP;
+	nr.heap = MULTALLOC(KDNearSave, nr.size);
+	while ((i = atomic_fetch_add(&w->next, KD_BATCH_RUN)) < w->nq)
+	{
+		for (end = MIN(i + KD_BATCH_RUN, w->nq);  i < end;  i++)
+		{
+			q = w->order[i].query;
+			Xq[KD_LEFT] = Xq[KD_RIGHT] = w->xy[2*q];
+			Xq[KD_BOTTOM] = Xq[KD_TOP] = w->xy[2*q+1];
+			near_best(&nr, w->tree, Xq, w->m, &w->out[(size_t) q * w->m]);
+		}
+	}
+	FREE(nr.heap);
+	return (void *) 0;
+}
+
+kd_status kd_nearest_batch(kd_tree tree, const int *xy, int nq, int m, kd_priority *out, int nthreads)
+/*
+ * kd_nearest() for the `nq' points xy[0],xy[1]  xy[2],xy[3] ... on
+ * up to `nthreads' threads,  counting the caller.  The m nearest to
+ * point q go to out[q*m] .. out[q*m+m-1],  nearest first,  as
+ * kd_nearest() would give them;  `out' holds nq*m entries.
+ */
+{
+	KDBatchWork w;
+	KDCurvePlace *order;
+	pthread_t *threads;
+	char *started;
+	double span[2];
+	int lo[2], hi[2], i, j;
+
+	kd_data_tries = 0;
+	if (nq <= 0 || m <= 0) return KD_OK;
+
+	/* Places along the curve,  over the box holding the points */
+	lo[0] = hi[0] = xy[0];
+	lo[1] = hi[1] = xy[1];
+	for (i = 1;  i < nq;  i++)
+		for (j = 0;  j < 2;  j++)
+		{
+			lo[j] = MIN(lo[j], xy[2*i+j]);
+			hi[j] = MAX(hi[j], xy[2*i+j]);
+		}
+	for (j = 0;  j < 2;  j++)
+		span[j] = ((double) hi[j] - lo[j] + 1.0) / (1u << KD_HILBERT_BITS);
+	order = MULTALLOC(KDCurvePlace, nq);
+	for (i = 0;  i < nq;  i++)
+	{
+		order[i].key = hilbert_key((unsigned int) (((double) xy[2*i] - lo[0]) / span[0]),
+								   (unsigned int) (((double) xy[2*i+1] - lo[1]) / span[1]));
+		order[i].query = i;
+	}
+	qsort(order, nq, sizeof(KDCurvePlace), cmp_curve);
+
+	w.tree = (KDTree *) tree;
+	w.xy = xy;
+	w.order = order;
+	w.nq = nq;
+	w.m = m;
+	w.out = (KDPriority *) out;
+	atomic_init(&w.next, 0);
+	if (nthreads > (nq + KD_BATCH_RUN - 1) / KD_BATCH_RUN)
+		nthreads = (nq + KD_BATCH_RUN - 1) / KD_BATCH_RUN;
+	if (nthreads < 1) nthreads = 1;
+	threads = MULTALLOC(pthread_t, nthreads);
+	started = MULTALLOC(char, nthreads);
+	for (i = 1;  i < nthreads;  i++)
+		started[i] = (pthread_create(&threads[i], NULL, batch_worker, &w) == 0);
+	(void) batch_worker(&w);
+	for (i = 1;  i < nthreads;  i++)
+		if (started[i]) (void) pthread_join(threads[i], NULL);
+	FREE(started);
+	FREE(threads);
+	FREE(order);
+	return KD_OK;
+}
+
+
+/* ************** kd_within_distance -- fixed radius queries ******************************** */
+
+/*
+ * The ball test kd_nearest() prunes with (bounds_overlap_ball),  with
+ * a radius that does not shrink:  a subtree is skipped when the box
+ * holding it is farther than r from the query,  and taken whole,
+ * without a test per item,  when even its far corner is within r.
+ * The query may be a box,  a point being a box of no area;  distances
+ * are edge to edge,  as KDdist() measures them.
+ */
+
+static double far_dist(const int *Xq, const int *box)
+/* Squared distance from `Xq' to the farthest point of `box' */
+{
+	double dx, dy;
+
+	dx = MAX(MAX((double) Xq[KD_LEFT] - box[KD_LEFT], (double) box[KD_RIGHT] - Xq[KD_RIGHT]), 0.0);
+	dy = MAX(MAX((double) Xq[KD_BOTTOM] - box[KD_BOTTOM], (double) box[KD_TOP] - Xq[KD_TOP]), 0.0);
+	return dx*dx + dy*dy;
+}
+
+typedef struct {
+	kd_box area;			/* Query box                 */
+	kd_box square;			/* Box holding the ball      */
+	double r2;				/* Squared radius            */
+} KDBall;
+
+/* Is the box `b' within the ball?  The square rules most boxes out */
+#define KD_IN_BALL(ball, b) \
+    (BOXINTERSECT((ball)->square, b) && KDdist((ball)->area, b) <= (ball)->r2)
+
+static int within_tree(KDSearch *sr, KDFrozen *fz, const KDBall *ball, kd_visitor visitor, kd_generic arg)
+/* Visits each item in the ball;  returns non-zero if stopped */
+{
+	KDSearchSave n, son;
+	KDFNode *node;
+	kd_box box;
+	const int *held;
+	unsigned int pos, end, hits;
+	int near[2], m, hort, s, e, i;
+
+	while (sr->top_index > 0)
+	{
+		n = sr->stk[--sr->top_index];
+		node = fz ? &fz->nodes[n.node] : (KDFNode *) 0;
+		held = (node && KD_IS_BUCKET(node)) ? node->size : n.box;
+		if (BOXWITHIN(held, ball->square) && far_dist(ball->area, held) <= ball->r2)
+		{
+			/* All of this subtree is near enough */
+			if (fz ? search_all_frozen(sr, fz, n.node, visitor, arg)
+				: search_all_tree(sr, n.elem, visitor, arg))
+				return 1;
+			continue;
+		}
+		if (node && KD_IS_BUCKET(node))
+		{
+			end = KD_BUCKET_START(node) + node->sons[KD_HISON];
+			kd_data_tries += node->sons[KD_HISON];
+			for (pos = KD_BUCKET_START(node);  pos < end;  pos += KD_BUCKET_WIDTH)
+			{
+				hits = bucket_hits(fz, pos, ball->square);
+				if (end - pos < KD_BUCKET_WIDTH) hits &= (1u << (end - pos)) - 1;
+				while (hits)
+				{
+					i = pos + low_bit(hits);
+					hits &= hits - 1;
+					for (e = 0;  e < KD_BOX_MAX;  e++) box[e] = fz->bucket_box[e][i];
+					if (KDdist(ball->area, box) <= ball->r2 &&
+						(*visitor)(fz->bucket_items[i], box, arg))
+						return 1;
+				}
+			}
+			continue;
+		}
+		kd_data_tries++;
+		if (node)
+		{
+			if (fz->items[n.node] && KD_IN_BALL(ball, node->size) &&
+				visit_copy(visitor, fz->items[n.node], node->size, arg))
+				return 1;
+		}
+		else if (n.elem->item && KD_IN_BALL(ball, n.elem->size) &&
+				 visit_copy(visitor, n.elem->item, n.elem->size, arg))
+			return 1;
+		/* The same cheap tests as kd_search() on the square first */
+		m = n.disc;
+		hort = m & 0x01;
+		if (node)
+		{
+			near[KD_LOSON] = KD_LO_OVERLAP(ball->square, node, m, hort);
+			near[KD_HISON] = KD_HI_OVERLAP(ball->square, node, m, hort);
+		}
+		else
+		{
+			near[KD_LOSON] = KD_LO_OVERLAP(ball->square, n.elem, m, hort);
+			near[KD_HISON] = KD_HI_OVERLAP(ball->square, n.elem, m, hort);
+		}
+		for (s = KD_HISON;  s >= KD_LOSON;  s--)
+		{
+			if (!near[s] || !join_son(fz, &n, s, &son)) continue;
+			if (KD_IN_BALL(ball, is_bucket(fz, &son) ? fz->nodes[son.node].size : son.box))
+				search_push(sr, son.elem, son.node, son.disc, son.box);
+		}
+	}
+	return 0;
+}
+
+kd_status kd_within_distance_box(kd_tree theTree, kd_box area, double r, kd_visitor visitor, kd_generic arg)
+/*
+ * Calls `visitor',  as kd_search() does,  with each item whose box
+ * lies within distance `r' of `area',  edge to edge.  Items touching
+ * `area' are at distance zero.  Returns KD_STOPPED if the visitor
+ * stopped the search,  KD_OK otherwise.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDSearchSave root;
+	KDSearch sr;
+	KDBall ball;
+	double reach = ceil(r);
+	int i, stopped;
+
+	kd_data_tries = 0;
+	if (r < 0.0 || !self_root(realTree, &root)) return KD_OK;
+	for (i = 0;  i < KD_BOX_MAX;  i++) ball.area[i] = area[i];
+	ball.square[KD_LEFT] = (int) MAX(area[KD_LEFT] - reach, (double) MININT);
+	ball.square[KD_BOTTOM] = (int) MAX(area[KD_BOTTOM] - reach, (double) MININT);
+	ball.square[KD_RIGHT] = (int) MIN(area[KD_RIGHT] + reach, (double) MAXINT);
+	ball.square[KD_TOP] = (int) MIN(area[KD_TOP] + reach, (double) MAXINT);
+	ball.r2 = r*r;
+	sr.stk = sr.local;
+	sr.stack_size = KD_SEARCH_STACK;
+	sr.top_index = 0;
+	if (KD_IN_BALL(&ball, root.box))
+		search_push(&sr, root.elem, root.node, root.disc, root.box);
+	stopped = within_tree(&sr, realTree->frozen, &ball, visitor, arg);
+	if (sr.stk != sr.local) FREE(sr.stk);
+	return stopped ? KD_STOPPED : KD_OK;
+}
+
+kd_status kd_within_distance(kd_tree theTree, int x, int y, double r, kd_visitor visitor, kd_generic arg)
+/* kd_within_distance_box() about the point (x,y) */
+{
+	kd_box Xq;
+
+	Xq[KD_LEFT] = Xq[KD_RIGHT] = x;
+	Xq[KD_BOTTOM] = Xq[KD_TOP] = y;
+	return kd_within_distance_box(theTree, Xq, r, visitor, arg);
+}
+
+
+/* ************** kd_save -- frozen tree images                   ********************************** */
+
+/*
+ * A tree image is the frozen layout written out as it is in memory,
+ * so that kd_open_mmap() can map it and point a frozen tree straight
+ * at it.  The header is followed by the arrays,  each starting at a
+ * multiple of KD_IMAGE_ALIGN;  the header records where.  Everything
+ * is in the byte order and word sizes of the machine that wrote it,
+ * which the header also records,  and an image from any other kind
+ * of machine is refused rather than converted.
+ */
+
+#define KD_IMAGE_MAGIC		"kd-tree\n"
+#define KD_IMAGE_VERSION	1
+#define KD_IMAGE_ENDIAN		0x01020304u
+#define KD_IMAGE_ALIGN		64
+
+typedef struct {
+	char magic[8];			/* KD_IMAGE_MAGIC            */
+	uint32_t version;		/* KD_IMAGE_VERSION          */
+	uint32_t endian;		/* KD_IMAGE_ENDIAN,  as written */
+	uint32_t node_size;		/* sizeof(KDFNode)           */
+	uint32_t item_size;		/* sizeof(kd_generic)        */
+	int32_t item_count;		/* Tree counts               */
+	int32_t dead_count;
+	int32_t items_balanced;
+	int32_t depth;
+	int32_t extent[KD_BOX_MAX];	/* Extent of the tree    */
+	uint32_t num_nodes;		/* Length of node arrays     */
+	uint32_t bucket_len;	/* Length of bucket arrays   */
+	uint64_t nodes_off;		/* Offsets of the arrays     */
+	uint64_t items_off;
+	uint64_t bucket_box_off[KD_BOX_MAX];
+	uint64_t bucket_items_off;
+	uint64_t file_len;		/* Length of the whole image */
+} KDImageHeader;
+
+#define KD_IMAGE_ROUND(off)	(((off) + KD_IMAGE_ALIGN - 1) / KD_IMAGE_ALIGN * KD_IMAGE_ALIGN)
+
+static int write_section(FILE *fp, uint64_t *pos, uint64_t off, const void *data, size_t len)
+/* Pads the file from `pos' up to `off' and writes `len' bytes there */
+{
+	static const char zeros[KD_IMAGE_ALIGN];
+
+	if (fwrite(zeros, 1, (size_t) (off - *pos), fp) != off - *pos) return 0;
+	if (len && fwrite(data, 1, len, fp) != len) return 0;
+	*pos = off + len;
+	return 1;
+}
+
+kd_status kd_save(kd_tree theTree, const char *path)
+/*
+ * Writes the frozen layout of `theTree' to the file `path'.  Trees
+ * that are not frozen are frozen (without buckets) for the purpose.
+ * Items are written as their raw values,  so they must be
+ * identifiers (indices,  keys) rather than pointers for the image
+ * to mean anything to another process.  Returns KD_OK,  or
+ * KD_BADFILE if the file cannot be written.
+ */
+{
+	KDTree *realTree = (KDTree *) theTree;
+	KDTree *tmp = (KDTree *) 0;
+	KDFrozen *fz;
+	KDImageHeader hdr;
+	FILE *fp;
+	uint64_t off, pos;
+	int i, ok;
+
+	if (!realTree->frozen) tmp = (KDTree *) kd_freeze(theTree);
+	fz = tmp ? tmp->frozen : realTree->frozen;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, KD_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = KD_IMAGE_VERSION;
+	hdr.endian = KD_IMAGE_ENDIAN;
+	hdr.node_size = sizeof(KDFNode);
+	hdr.item_size = sizeof(kd_generic);
+	hdr.item_count = realTree->item_count;
+	hdr.dead_count = realTree->dead_count;
+	hdr.items_balanced = realTree->items_balanced;
+	hdr.depth = fz->depth;
+	for (i = 0;  i < KD_BOX_MAX;  i++) hdr.extent[i] = realTree->extent[i];
+	hdr.num_nodes = fz->num_nodes;
+	hdr.bucket_len = fz->bucket_len;
+	off = KD_IMAGE_ROUND(sizeof(hdr));
+	hdr.nodes_off = off;
+	off = KD_IMAGE_ROUND(off + (uint64_t) fz->num_nodes * sizeof(KDFNode));
+	hdr.items_off = off;
+	off = KD_IMAGE_ROUND(off + (uint64_t) fz->num_nodes * sizeof(kd_generic));
+	for (i = 0;  i < KD_BOX_MAX;  i++)
+	{
+		hdr.bucket_box_off[i] = off;
+		off = KD_IMAGE_ROUND(off + (uint64_t) fz->bucket_len * sizeof(int));
+	}
+	hdr.bucket_items_off = off;
+	hdr.file_len = off + (uint64_t) fz->bucket_len * sizeof(kd_generic);
+
+	ok = 0;
+	if ((fp = fopen(path, "wb")))
+	{
+		pos = 0;
+		ok = write_section(fp, &pos, 0, &hdr, sizeof(hdr)) &&
+			write_section(fp, &pos, hdr.nodes_off, fz->nodes, fz->num_nodes * sizeof(KDFNode)) &&
+			write_section(fp, &pos, hdr.items_off, fz->items, fz->num_nodes * sizeof(kd_generic));
+		for (i = 0;  ok && i < KD_BOX_MAX;  i++)
+			ok = write_section(fp, &pos, hdr.bucket_box_off[i], fz->bucket_box[i],
+							   fz->bucket_len * sizeof(int));
+		ok = ok && write_section(fp, &pos, hdr.bucket_items_off, fz->bucket_items,
+								 fz->bucket_len * sizeof(kd_generic));
+		ok = (fclose(fp) == 0) && ok;
+	}
+	if (tmp) kd_destroy((kd_tree) tmp, NULL);
+	return ok ? KD_OK : kd_set_error(KD_BADFILE);
+}
+
+static void *map_image(const char *path, size_t *len)
+/*
+ * Maps the file `path' read-only and returns its address and length.
+ * Where there is no mmap(),  the file is read into memory instead.
+ */
+{
+#ifdef _WIN32
+	FILE *fp;
+	long size;
+	char *image;
+
+	if (!(fp = fopen(path, "rb"))) return (void *) 0;
+	if (fseek(fp, 0L, SEEK_END) != 0 || (size = ftell(fp)) <= 0 ||
+		fseek(fp, 0L, SEEK_SET) != 0)
+	{
+		fclose(fp);
+		return (void *) 0;
+	}
+	image = MULTALLOC(char, size);
+	if (fread(image, 1, (size_t) size, fp) != (size_t) size)
+	{
+		FREE(image);
+		image = (char *) 0;
+	}
+	fclose(fp);
+	*len = (size_t) size;
+	return (void *) image;
+#else
+	struct stat st;
+	void *image;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return (void *) 0;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return (void *) 0;
+	}
+	image = mmap((void *) 0, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) return (void *) 0;
+	*len = (size_t) st.st_size;
+	return image;
+#endif
+}
+
+static void unmap_image(void *image, size_t len)
+{
+#ifdef _WIN32
+	(void) len;
+	FREE(image);
+#else
+	(void) munmap(image, len);
+#endif
+}
+
+static int image_fits(uint64_t off, uint64_t n, size_t size, size_t len)
+/*
+ * An array of `n' things of `size' bytes at `off' lies in an image
+ * of `len' bytes,  past the header and aligned as kd_save() puts it.
+ * The sums are arranged so that they cannot wrap.
+ */
+{
+	return off % KD_IMAGE_ALIGN == 0 && off >= sizeof(KDImageHeader) &&
+		off <= len && n <= (len - off) / size;
+}
+
+static int image_depth(KDFrozen *fz)
+/*
+ * Walks the nodes of a mapped image from the root,  checking that
+ * every son is a node seen no more than once and every bucket lies
+ * in the bucket arrays,  so that nothing read from the file can send
+ * a search outside the image or round a loop.  Returns the number of
+ * levels,  which sizes search stacks,  or -1 if the nodes are bad.
+ */
+{
+	KDFNode *node;
+	unsigned int *stack, son, start, count;
+	int *level;
+	char *seen;
+	int sp, s, lev, depth = 0;
+
+	if (!fz->num_nodes) return 0;
+	if (fz->num_nodes >= KD_BUCKET || fz->bucket_len % KD_BUCKET_WIDTH) return -1;
+	stack = MULTALLOC(unsigned int, fz->num_nodes);
+	level = MULTALLOC(int, fz->num_nodes);
+	seen = MULTALLOC(char, fz->num_nodes);
+	memset(seen, 0, fz->num_nodes);
+	sp = 0;
+	stack[sp] = 0;
+	level[sp++] = 1;
+	seen[0] = 1;
+	while (sp > 0 && depth >= 0)
+	{
+		sp--;
+		lev = level[sp];
+		depth = MAX(depth, lev);
+		node = &fz->nodes[stack[sp]];
+		if (KD_IS_BUCKET(node))
+		{
+			/* Whole groups of KD_BUCKET_WIDTH are read at a time */
+			start = KD_BUCKET_START(node);
+			count = node->sons[KD_HISON];
+			if (start % KD_BUCKET_WIDTH || count > fz->bucket_len ||
+				start > fz->bucket_len - count)
+				depth = -1;
+			continue;
+		}
+		for (s = KD_LOSON;  s <= KD_HISON;  s++)
+		{
+			if (!(son = node->sons[s])) continue;
+			if (son >= fz->num_nodes || seen[son])
+			{
+				depth = -1;
+				break;
+			}
+			seen[son] = 1;
+			stack[sp] = son;
+			level[sp++] = lev + 1;
+		}
+	}
+	FREE(stack);
+	FREE(level);
+	FREE(seen);
+	return depth;
+}
+
+kd_tree kd_open_mmap(const char *path)
+/*
+ * Maps an image written by kd_save() and returns a frozen tree that
+ * searches it in place.  Returns zero (and sets KD_BADFILE) if the
+ * file cannot be read,  was not written by kd_save() on this kind
+ * of machine,  or does not hold a whole tree:  every offset,  son
+ * and bucket is checked before the tree is handed out,  and its
+ * depth is taken from the nodes rather than the header.  The items
+ * are the values kd_save() wrote,  so they must be identifiers
+ * that mean the same in this process,  not pointers.  kd_destroy()
+ * unmaps the image,  without calling its `delfunc' on them.
+ */
+{
+	KDTree *newTree;
+	KDFrozen *fz;
+	KDImageHeader *hdr;
+	char *image;
+	size_t len;
+	int i, ok;
+
+	if (!(image = (char *) map_image(path, &len)))
+	{
+		kd_set_error(KD_BADFILE);
+		return (kd_tree) 0;
+	}
+	hdr = (KDImageHeader *) image;
+	ok = len >= sizeof(KDImageHeader) &&
+		memcmp(hdr->magic, KD_IMAGE_MAGIC, sizeof(hdr->magic)) == 0 &&
+		hdr->version == KD_IMAGE_VERSION &&
+		hdr->endian == KD_IMAGE_ENDIAN &&
+		hdr->node_size == sizeof(KDFNode) &&
+		hdr->item_size == sizeof(kd_generic) &&
+		hdr->file_len == len &&
+		image_fits(hdr->nodes_off, hdr->num_nodes, sizeof(KDFNode), len) &&
+		image_fits(hdr->items_off, hdr->num_nodes, sizeof(kd_generic), len) &&
+		image_fits(hdr->bucket_items_off, hdr->bucket_len, sizeof(kd_generic), len);
+	for (i = 0;  ok && i < KD_BOX_MAX;  i++)
+		ok = image_fits(hdr->bucket_box_off[i], hdr->bucket_len, sizeof(int), len);
+	if (!ok)
+	{
+		unmap_image(image, len);
+		kd_set_error(KD_BADFILE);
+		return (kd_tree) 0;
+	}
+
+	newTree = (KDTree *) kd_create();
+	newTree->item_count = hdr->item_count;
+	newTree->dead_count = hdr->dead_count;
+	newTree->items_balanced = hdr->items_balanced;
+	for (i = 0;  i < KD_BOX_MAX;  i++) newTree->extent[i] = hdr->extent[i];
+	fz = new_frozen(0);
+	fz->num_nodes = hdr->num_nodes;
+	fz->nodes = (KDFNode *) (image + hdr->nodes_off);
+	fz->items = (kd_generic *) (image + hdr->items_off);
+	fz->bucket_len = hdr->bucket_len;
+	for (i = 0;  i < KD_BOX_MAX;  i++)
+		fz->bucket_box[i] = (int *) (image + hdr->bucket_box_off[i]);
+	fz->bucket_items = (kd_generic *) (image + hdr->bucket_items_off);
+	fz->image = (void *) image;
+	fz->image_len = len;
+	newTree->frozen = fz;
+	if ((fz->depth = image_depth(fz)) < 0)
+	{
+		kd_destroy((kd_tree) newTree, NULL);
+		kd_set_error(KD_BADFILE);
+		return (kd_tree) 0;
+	}
+	newTree->max_depth = fz->depth;
+	return (kd_tree) newTree;
 }
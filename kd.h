@@ -57,6 +57,21 @@ typedef struct kd_dummy_defn {
 
 typedef kd_dummy *kd_tree;
 typedef kd_dummy *kd_gen;
+typedef kd_dummy *kd_near_gen;
+
+/*
+ * Room for a generator in caller storage (kd_gen_init).  Trees more
+ * than KD_GEN_FRAMES levels deep put the rest of the stack on the heap.
+ * Sized in bytes,  up to 64 a frame,  so it fits on any word size;
+ * the union keeps it aligned for what goes in it.
+ */
+#define KD_GEN_FRAMES	48
+typedef union kd_gen_storage {
+    void *align_p;
+    long long align_l;
+    double align_d;
+    char opaque[KD_GEN_FRAMES * 64 + 128];
+} kd_gen_storage;
 
 #define KD_LEFT		0
 #define KD_BOTTOM	1
@@ -74,25 +89,56 @@ typedef char *kd_generic;
 
 #define KD_OK		1
 #define KD_NOMORE	2
+#define KD_STOPPED	3
 
 #define KD_NOTIMPL	-3
 #define KD_NOTFOUND	-4 
+#define KD_BADFILE	-5
+#define KD_BADARG	-6
 /* Fatal Faults */
 #define KDF_M		0	/* Memory fault    */
 #define KDF_ZEROID	1	/* Insert zero     */
 #define KDF_MD		2	/* Bad median      */
 #define KDF_F		3	/* Father fault    */
 #define KDF_DUPL	4	/* Duplicate entry */
+#define KDF_FROZEN	5	/* Modify frozen   */
 #define KDF_UNKNOWN	99	/* Unknown error   */
 
 #define KD_DISC(lev) (lev%4)
 
+/* Region tests (kd_start_mode) */
+#define KD_INTERSECTS	0	/* Items touching the area (kd_start) */
+#define KD_WITHIN	1	/* Items lying wholly inside the area  */
+#define KD_CONTAINS	2	/* Items covering the whole area       */
+
+/* Distance metrics (kd_nearest_metric) */
+#define KD_EUCLIDEAN	0	/* Straight line,  edge to edge (kd_nearest) */
+#define KD_MANHATTAN	1	/* |dx| + |dy|,  edge to edge                */
+#define KD_CHEBYSHEV	2	/* max(|dx|, |dy|),  edge to edge            */
+#define KD_CENTROID	3	/* Straight line to the middle of the box    */
+
+/* Build strategies (kd_set_build_strategy) */
+#define KD_BUILD_MEAN	0	/* Split near the mean of the edge (default) */
+#define KD_BUILD_MEDIAN	1	/* Split at the exact median of the edge      */
+
 typedef struct kd_priority
 {
 	double dist;
 	kd_generic elem;
 } kd_priority;
 
+typedef int (*kd_visitor)(kd_generic item, kd_box size, kd_generic arg);
+  /* Called by kd_search for each item found,  with a copy of its box;  non-zero stops it */
+
+typedef int (*kd_filter)(kd_generic item, kd_box size, kd_generic arg);
+  /* Called by kd_nearest_filtered for each candidate;  non-zero accepts it */
+
+typedef int (*kd_join_func)(kd_generic a, kd_box a_size, kd_generic b, kd_box b_size, kd_generic arg);
+  /* Called by kd_join for each pair of items that touch;  non-zero stops it */
+
+typedef void (*kd_batch_func)(int region, kd_generic item, kd_box size, kd_generic arg);
+  /* Called by kd_query_batch for each region and item that touch */
+
 extern char *kd_err_string(void);
   /* Returns a textual description of a k-d error */
 
@@ -102,6 +148,18 @@ extern kd_tree kd_create(void);
 extern kd_tree kd_build(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic );
   /* Makes a new kd-tree from a given set of items */
 
+extern int kd_set_build_depth(int depth);
+  /* Limits the depth of the balanced part of later builds */
+
+extern int kd_set_build_strategy(int strategy);
+  /* Chooses KD_BUILD_MEAN or KD_BUILD_MEDIAN for later builds */
+
+extern kd_tree kd_build_parallel(int (*itemfunc)(kd_generic arg, kd_generic *val, kd_box size), kd_generic, int nthreads);
+  /* Same as kd_build, using up to nthreads threads */
+
+extern kd_tree kd_build_from_arrays(const kd_box *boxes, const kd_generic *items, size_t n);
+  /* Makes a new kd-tree from parallel arrays of boxes and items */
+
 extern void kd_destroy(kd_tree this_one, void (*delfunc)(kd_generic item));
   /* Destroys an existing k-d tree */
 
@@ -119,22 +177,108 @@ extern kd_status kd_really_delete (kd_tree theTree, kd_generic data, kd_box old_
 extern kd_gen kd_start (kd_tree tree, kd_box size);
   /* Initializes a generation of items in a region */
 
+extern kd_gen kd_start_mode (kd_tree tree, kd_box size, int mode);
+  /* Same as kd_start,  for items within or containing the region */
+
 extern kd_status kd_next (kd_gen , kd_generic *, kd_box);
   /* Generates the next item in a region */
 
 extern int kd_finish (kd_gen);
   /* Ends generation of items in a region */
 
+extern kd_gen kd_gen_init (kd_gen_storage *buf, kd_tree tree, kd_box size);
+  /* Same as kd_start,  with the generator kept in buf */
+
+extern void kd_gen_reset (kd_gen gen, kd_box size);
+  /* Restarts a generator on a new region */
+
+extern kd_status kd_search (kd_tree tree, kd_box area, kd_visitor visitor, kd_generic arg);
+  /* Calls visitor for each item in a region,  without a generator */
+
+extern kd_status kd_search_parallel (kd_tree tree, kd_box area, kd_visitor visitor,
+				     kd_generic *args, int nthreads);
+  /* Same,  using up to nthreads threads,  each with its own args[i] */
+
+extern kd_status kd_stab (kd_tree tree, int x, int y, kd_visitor visitor, kd_generic arg);
+  /* Calls visitor for each item whose box holds a point */
+
+extern kd_status kd_search_segment (kd_tree tree, int x0, int y0, int x1, int y1,
+				    kd_visitor visitor, kd_generic arg);
+  /* Calls visitor for each item a line segment touches */
+
+extern kd_status kd_search_polyline (kd_tree tree, const int *points, int npoints,
+				     kd_visitor visitor, kd_generic arg);
+  /* Same,  for a polyline given as x,y pairs */
+
+extern kd_status kd_query_batch (kd_tree tree, const kd_box *regions, int nregions,
+				 kd_batch_func func, kd_generic arg);
+  /* Finds the items in many regions in one pass over the tree */
+
+extern kd_status kd_join (kd_tree tree_a, kd_tree tree_b, kd_join_func func, kd_generic arg);
+  /* Finds every pair of touching items,  one from each tree */
+
+extern kd_status kd_self_join (kd_tree tree, kd_join_func func, kd_generic arg);
+  /* Finds every pair of touching items in one tree,  once */
+
+extern kd_status kd_self_join_parallel (kd_tree tree, kd_join_func func, kd_generic arg, int nthreads);
+  /* Same as kd_self_join,  using up to nthreads threads */
+
 extern int kd_count (kd_tree tree);
   /* Returns the number of objects stored in tree */
 
+extern int kd_count_region (kd_tree tree, kd_box area);
+  /* Returns the number of objects touching a region */
+
 extern void kd_print (kd_tree);
 
 extern void kd_badness (kd_tree);
 
 extern kd_tree kd_rebuild ( kd_tree );
 
+extern kd_tree kd_freeze ( kd_tree );
+  /* Returns a compact read-only copy of a tree */
+
+extern kd_tree kd_freeze_buckets ( kd_tree, int bucket_size );
+  /* Same,  with small subtrees collapsed into leaf buckets */
+
+extern kd_status kd_save ( kd_tree, const char *path );
+  /* Writes the frozen layout of a tree to a file;  items must be identifiers,  not pointers */
+
+extern kd_tree kd_open_mmap ( const char *path );
+  /* Maps a file written by kd_save as a frozen tree */
+
+extern kd_tree kd_rebuild_parallel ( kd_tree, int nthreads );
+
 extern int kd_nearest (kd_tree tree, int x, int y, int m, kd_priority **alist);
+extern int kd_nearest_best_first (kd_tree tree, int x, int y, int m, kd_priority **alist);
+  /* Same,  best first,  for m in the hundreds or more */
+
+extern int kd_nearest_metric (kd_tree tree, int x, int y, int m, int metric, kd_priority **alist);
+  /* Same,  measuring distance by one of the KD_EUCLIDEAN ... metrics */
+extern int kd_nearest_filtered (kd_tree tree, int x, int y, int m, kd_filter filter,
+				kd_generic arg, kd_priority **alist);
+  /* kd_nearest,  counting only items the filter accepts */
+
+extern kd_near_gen kd_nearest_start (kd_tree tree, int x, int y);
+  /* Starts a walk through the items nearest (x,y) first */
+
+extern kd_status kd_nearest_next (kd_near_gen gen, kd_generic *item, double *dist);
+  /* Returns the next nearest item and its distance */
+
+extern int kd_nearest_finish (kd_near_gen gen);
+  /* Ends a walk started by kd_nearest_start */
+
+extern kd_status kd_nearest_batch (kd_tree tree, const int *xy, int nq, int m,
+				   kd_priority *out, int nthreads);
+  /* kd_nearest for nq points at once,  m results each into out */
+
+extern kd_status kd_within_distance (kd_tree tree, int x, int y, double r,
+				     kd_visitor visitor, kd_generic arg);
+  /* Calls visitor for each item within distance r of a point */
+
+extern kd_status kd_within_distance_box (kd_tree tree, kd_box area, double r,
+					 kd_visitor visitor, kd_generic arg);
+  /* Same,  for items within distance r of a box */
 extern void kd_print_nearest (kd_tree tree, int x, int y, int m);
 
 #endif /* KD_HEADER */
@@ -0,0 +1,787 @@
+/*
+ * K-d tree benchmark
+ *
+ * Times region searches and nearest neighbor queries on a tree of
+ * random boxes,  first on the ordinary pointer tree,  then on its
+ * frozen copy (kd_freeze) and on a frozen copy with leaf buckets
+ * (kd_freeze_buckets),  which is also saved and mapped back in
+ * (kd_save, kd_open_mmap).  All of them answer every query with the
+ * same items;  only the time taken should differ.  Last,  the same
+ * queries are shared out between several reader threads.
+ * Usage: kd_bench [boxes]
+ */
+
+#define _DEFAULT_SOURCE		/* clock_gettime(),  random() and srandom() */
+#include "kd.h"
+#include <stdlib.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#define random() rand()
+#define srandom(x) srand(x)
+#endif
+
+#define KD_BOXES	1000000
+#define KD_REGIONS      20000
+#define KD_ZOOMED       50
+#define KD_NEAREST      20000
+#define KD_NEIGHBORS    8
+#define KD_WIDE         1000
+#define KD_WIDE_NEIGHBORS 500
+#define KD_RADIUS       5000.0
+#define KD_PICKY        97	/* Items a filter lets through:  one in this many */
+#define KD_LAYER        200000
+#define KD_THREADS      4
+#define KD_READERS      8
+#define KD_BUCKET_SIZE  32
+#define KD_IMAGE	"kd_bench.img"
+
+#define MIN_RANGE	-1000000
+#define MAX_RANGE	1000000
+#define RANGE_SPAN	(MAX_RANGE - MIN_RANGE + 1)
+#define BOX_RANGE	1000
+#define REGION_RANGE	10000
+#define ZOOMED_RANGE	(RANGE_SPAN / 2)
+#define SEGMENT_RANGE	(RANGE_SPAN / 20)
+
+static kd_box *boxes;
+static kd_box *regions;
+static kd_box *zoomed;
+static kd_box *layer_boxes;
+static int (*points)[2];
+static int num_boxes = KD_BOXES;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void rand_box(kd_box box, int span)
+{
+    box[KD_LEFT] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_BOTTOM] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_RIGHT] = box[KD_LEFT] + (random() % span);
+    box[KD_TOP] = box[KD_BOTTOM] + (random() % span);
+}
+
+/* Returns the number of items found,  so the work cannot be skipped */
+static long time_regions(const char *name, kd_tree tree)
+{
+    kd_gen gen;
+    kd_generic item;
+    double start;
+    long found = 0;
+    int i;
+
+    start = now();
+    for (i = 0;  i < KD_REGIONS;  i++) {
+	gen = kd_start(tree, regions[i]);
+	while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) found++;
+	kd_finish(gen);
+    }
+    printf("[bench] %-8s %6d regions:  %8.3f s  (%ld items)\n",
+	   name, KD_REGIONS, now() - start, found);
+    return found;
+}
+
+/* The same regions,  through one generator kept on the stack */
+static long time_gen_storage(const char *name, kd_tree tree)
+{
+    kd_gen_storage buf;
+    kd_gen gen;
+    kd_generic item;
+    double start;
+    long found = 0;
+    int i;
+
+    start = now();
+    gen = kd_gen_init(&buf, tree, regions[0]);
+    for (i = 0;  i < KD_REGIONS;  i++) {
+	if (i > 0) kd_gen_reset(gen, regions[i]);
+	while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) found++;
+    }
+    kd_finish(gen);
+    printf("[bench] %-8s %6d reused:   %8.3f s  (%ld items)\n",
+	   name, KD_REGIONS, now() - start, found);
+    return found;
+}
+
+static long batch_found;
+
+static void count_hit(int region, kd_generic item, kd_box size, kd_generic arg)
+{
+    batch_found++;
+}
+
+static int count_item(kd_generic item, kd_box size, kd_generic arg)
+{
+    batch_found++;
+    return 0;
+}
+
+/* The same regions,  through kd_search() */
+static long time_search(const char *name, kd_tree tree)
+{
+    double start;
+    int i;
+
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_REGIONS;  i++)
+	(void) kd_search(tree, regions[i], count_item, (kd_generic) 0);
+    printf("[bench] %-8s %6d searched: %8.3f s  (%ld items)\n",
+	   name, KD_REGIONS, now() - start, batch_found);
+    return batch_found;
+}
+
+/* The same regions,  all in one kd_query_batch() call */
+static long time_batch(const char *name, kd_tree tree)
+{
+    double start;
+
+    batch_found = 0;
+    start = now();
+    (void) kd_query_batch(tree, (const kd_box *) regions, KD_REGIONS, count_hit, (kd_generic) 0);
+    printf("[bench] %-8s %6d batched:  %8.3f s  (%ld items)\n",
+	   name, KD_REGIONS, now() - start, batch_found);
+    return batch_found;
+}
+
+/* The same regions,  only counted (kd_count_region) */
+static long time_count(const char *name, kd_tree tree)
+{
+    double start;
+    long found = 0;
+    int i;
+
+    start = now();
+    for (i = 0;  i < KD_REGIONS;  i++)
+	found += kd_count_region(tree, regions[i]);
+    printf("[bench] %-8s %6d counted:  %8.3f s  (%ld items)\n",
+	   name, KD_REGIONS, now() - start, found);
+    return found;
+}
+
+/* Zoomed out views:  a few windows holding a good part of the tree */
+/* kd_search_parallel() visitor:  counts into its thread's own counter */
+static int count_own(kd_generic item, kd_box size, kd_generic arg)
+{
+    (void) item; (void) size;
+    (*(long *) arg)++;
+    return 0;
+}
+
+static long time_zoomed(const char *name, kd_tree tree)
+{
+    kd_gen gen;
+    kd_generic item;
+    kd_generic args[KD_THREADS];
+    long thread_found[KD_THREADS][8];	/* A cache line each */
+    double start;
+    long found = 0, counted = 0, parallel = 0;
+    int i, j;
+
+    start = now();
+    for (i = 0;  i < KD_ZOOMED;  i++) {
+	gen = kd_start(tree, zoomed[i]);
+	while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) found++;
+	kd_finish(gen);
+    }
+    printf("[bench] %-8s %6d zoomed:   %8.3f s  (%ld items)\n",
+	   name, KD_ZOOMED, now() - start, found);
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_ZOOMED;  i++)
+	(void) kd_search(tree, zoomed[i], count_item, (kd_generic) 0);
+    printf("[bench] %-8s %6d zoomed searched: %8.3f s\n",
+	   name, KD_ZOOMED, now() - start);
+    for (j = 0;  j < KD_THREADS;  j++) {
+	thread_found[j][0] = 0;
+	args[j] = (kd_generic) thread_found[j];
+    }
+    start = now();
+    for (i = 0;  i < KD_ZOOMED;  i++)
+	(void) kd_search_parallel(tree, zoomed[i], count_own, args, KD_THREADS);
+    for (j = 0;  j < KD_THREADS;  j++) parallel += thread_found[j][0];
+    printf("[bench] %-8s %6d zoomed parallel: %8.3f s  (%d threads)\n",
+	   name, KD_ZOOMED, now() - start, KD_THREADS);
+    start = now();
+    for (i = 0;  i < KD_ZOOMED;  i++)
+	counted += kd_count_region(tree, zoomed[i]);
+    printf("[bench] %-8s %6d zoomed counted:  %8.3f s\n",
+	   name, KD_ZOOMED, now() - start);
+    return (batch_found == found && counted == found && parallel == found) ? found : -1;
+}
+
+/* Hit tests at the nearest points:  kd_stab() against kd_search() */
+static long time_stab(const char *name, kd_tree tree)
+{
+    kd_box point;
+    double start, took;
+    long found;
+    int i;
+
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++) {
+	point[KD_LEFT] = point[KD_RIGHT] = points[i][0];
+	point[KD_BOTTOM] = point[KD_TOP] = points[i][1];
+	(void) kd_search(tree, point, count_item, (kd_generic) 0);
+    }
+    took = now() - start;
+    printf("[bench] %-8s %6d pointed:  %8.3f s  (%.0f ns each)\n",
+	   name, KD_NEAREST, took, took * 1e9 / KD_NEAREST);
+    found = batch_found;
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++)
+	(void) kd_stab(tree, points[i][0], points[i][1], count_item, (kd_generic) 0);
+    took = now() - start;
+    printf("[bench] %-8s %6d stabbed:  %8.3f s  (%.0f ns each,  %ld items)\n",
+	   name, KD_NEAREST, took, took * 1e9 / KD_NEAREST, batch_found);
+    return batch_found == found ? found : -1;
+}
+
+/* Slanted wires:  the box around each segment,  then the segment itself */
+static long time_segment(const char *name, kd_tree tree)
+{
+    kd_box bbox;
+    double start;
+    long candidates;
+    int i, x1, y1;
+
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++) {
+	x1 = points[i][0] + SEGMENT_RANGE;
+	y1 = points[i][1] + SEGMENT_RANGE / 2;
+	bbox[KD_LEFT] = points[i][0];
+	bbox[KD_BOTTOM] = points[i][1];
+	bbox[KD_RIGHT] = x1;
+	bbox[KD_TOP] = y1;
+	(void) kd_search(tree, bbox, count_item, (kd_generic) 0);
+    }
+    printf("[bench] %-8s %6d wire boxes:    %8.3f s  (%ld items)\n",
+	   name, KD_NEAREST, now() - start, batch_found);
+    candidates = batch_found;
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++) {
+	x1 = points[i][0] + SEGMENT_RANGE;
+	y1 = points[i][1] + SEGMENT_RANGE / 2;
+	(void) kd_search_segment(tree, points[i][0], points[i][1], x1, y1,
+				 count_item, (kd_generic) 0);
+    }
+    printf("[bench] %-8s %6d wire segments: %8.3f s  (%ld items)\n",
+	   name, KD_NEAREST, now() - start, batch_found);
+    return batch_found <= candidates ? batch_found : -1;
+}
+
+static int count_pair(kd_generic a, kd_box a_size, kd_generic b, kd_box b_size, kd_generic arg)
+{
+    batch_found++;
+    return 0;
+}
+
+static atomic_long pairs_found;
+
+static int count_pair_shared(kd_generic a, kd_box a_size, kd_generic b, kd_box b_size, kd_generic arg)
+{
+    atomic_fetch_add_explicit(&pairs_found, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* A second layer of boxes against the tree:  one search per box,  then kd_join */
+static long time_join(const char *name, kd_tree tree, kd_tree layer)
+{
+    double start;
+    long found;
+    int i;
+
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_LAYER;  i++)
+	(void) kd_search(tree, layer_boxes[i], count_item, (kd_generic) 0);
+    printf("[bench] %-8s %6d layer searched: %8.3f s  (%ld pairs)\n",
+	   name, KD_LAYER, now() - start, batch_found);
+    found = batch_found;
+    batch_found = 0;
+    start = now();
+    (void) kd_join(layer, tree, count_pair, (kd_generic) 0);
+    printf("[bench] %-8s %6d layer joined:   %8.3f s  (%ld pairs)\n",
+	   name, KD_LAYER, now() - start, batch_found);
+    return batch_found == found ? found : -1;
+}
+
+/* Touching pairs within the tree:  one search per box,  then kd_self_join */
+static long time_self_join(const char *name, kd_tree tree)
+{
+    double start;
+    long found;
+    int i;
+
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < num_boxes;  i++)
+	(void) kd_search(tree, boxes[i], count_item, (kd_generic) 0);
+    /* Each pair twice,  and each box with itself */
+    found = (batch_found - num_boxes) / 2;
+    printf("[bench] %-8s %7d self searched: %8.3f s  (%ld pairs)\n",
+	   name, num_boxes, now() - start, found);
+    batch_found = 0;
+    start = now();
+    (void) kd_self_join(tree, count_pair, (kd_generic) 0);
+    printf("[bench] %-8s %7d self joined:   %8.3f s  (%ld pairs)\n",
+	   name, num_boxes, now() - start, batch_found);
+    if (batch_found != found) return -1;
+    start = now();
+    (void) kd_self_join_parallel(tree, count_pair_shared, (kd_generic) 0, KD_THREADS);
+    printf("[bench] %-8s %7d self joined:   %8.3f s  (%d threads)\n",
+	   name, num_boxes, now() - start, KD_THREADS);
+    return found;
+}
+
+static double time_nearest(const char *name, kd_tree tree)
+{
+    kd_priority *list;
+    double start, sum = 0.0;
+    int i;
+
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++) {
+	(void) kd_nearest(tree, points[i][0], points[i][1], KD_NEIGHBORS, &list);
+	sum += list[KD_NEIGHBORS-1].dist;
+	free(list);
+    }
+    printf("[bench] %-8s %6d nearest:  %8.3f s  (%d neighbors each)\n",
+	   name, KD_NEAREST, now() - start, KD_NEIGHBORS);
+    return sum;
+}
+
+/* The points of time_nearest(),  by kd_nearest_metric */
+static double time_nearest_metric(const char *name, kd_tree tree, int metric)
+{
+    static const char *names[] = { "euclidean", "manhattan", "chebyshev", "centroid" };
+    kd_priority *list;
+    double start, sum = 0.0;
+    int i;
+
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++) {
+	(void) kd_nearest_metric(tree, points[i][0], points[i][1], KD_NEIGHBORS, metric, &list);
+	sum += list[KD_NEIGHBORS-1].dist;
+	free(list);
+    }
+    printf("[bench] %-8s %6d nearest:  %8.3f s  (%d neighbors each,  %s)\n",
+	   name, KD_NEAREST, now() - start, KD_NEIGHBORS, names[metric]);
+    return sum;
+}
+
+/* kd_search() visitor:  counts items within KD_RADIUS of the point in arg */
+static int count_near(kd_generic item, kd_box size, kd_generic arg)
+{
+    const int *p = (const int *) arg;
+    double dx = 0.0, dy = 0.0;
+
+    (void) item;
+    if (p[0] < size[KD_LEFT]) dx = size[KD_LEFT] - p[0];
+    else if (p[0] > size[KD_RIGHT]) dx = p[0] - size[KD_RIGHT];
+    if (p[1] < size[KD_BOTTOM]) dy = size[KD_BOTTOM] - p[1];
+    else if (p[1] > size[KD_TOP]) dy = p[1] - size[KD_TOP];
+    if (dx*dx + dy*dy <= KD_RADIUS * KD_RADIUS) batch_found++;
+    return 0;
+}
+
+/* Items within a distance:  a square searched and filtered,  then kd_within_distance */
+static long time_within(const char *name, kd_tree tree)
+{
+    kd_box square;
+    double start;
+    long found;
+    int i, r = (int) KD_RADIUS;
+
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++) {
+	square[KD_LEFT] = points[i][0] - r;
+	square[KD_BOTTOM] = points[i][1] - r;
+	square[KD_RIGHT] = points[i][0] + r;
+	square[KD_TOP] = points[i][1] + r;
+	(void) kd_search(tree, square, count_near, (kd_generic) points[i]);
+    }
+    found = batch_found;
+    printf("[bench] %-8s %6d squares:  %8.3f s  (%ld items)\n",
+	   name, KD_NEAREST, now() - start, found);
+    batch_found = 0;
+    start = now();
+    for (i = 0;  i < KD_NEAREST;  i++)
+	(void) kd_within_distance(tree, points[i][0], points[i][1], KD_RADIUS,
+				  count_item, (kd_generic) 0);
+    printf("[bench] %-8s %6d within:   %8.3f s  (radius %g)\n",
+	   name, KD_NEAREST, now() - start, KD_RADIUS);
+    return batch_found == found ? found : -1;
+}
+
+/* The same points as time_nearest(),  in one kd_nearest_batch */
+static double time_nearest_batch(const char *name, kd_tree tree, int nthreads)
+{
+    kd_priority *out;
+    double start, elapsed, sum = 0.0;
+    int i;
+
+    out = (kd_priority *) malloc(KD_NEAREST * KD_NEIGHBORS * sizeof(kd_priority));
+    start = now();
+    (void) kd_nearest_batch(tree, (const int *) points, KD_NEAREST, KD_NEIGHBORS, out, nthreads);
+    elapsed = now() - start;
+    for (i = 0;  i < KD_NEAREST;  i++) sum += out[i * KD_NEIGHBORS + KD_NEIGHBORS - 1].dist;
+    printf("[bench] %-8s %6d nearest batch: %5.3f s  (%d threads,  %.0f queries/s per thread)\n",
+	   name, KD_NEAREST, elapsed, nthreads, KD_NEAREST / elapsed / nthreads);
+    free(out);
+    return sum;
+}
+
+/* Many neighbors each:  kd_nearest against kd_nearest_best_first */
+static double time_nearest_wide(const char *name, kd_tree tree)
+{
+    kd_priority *list;
+    double start, sum = 0.0, best_sum = 0.0;
+    long tried = 0, best_tried = 0;
+    int i;
+
+    start = now();
+    for (i = 0;  i < KD_WIDE;  i++) {
+	tried += kd_nearest(tree, points[i][0], points[i][1], KD_WIDE_NEIGHBORS, &list);
+	sum += list[KD_WIDE_NEIGHBORS-1].dist;
+	free(list);
+    }
+    printf("[bench] %-8s %6d nearest:  %8.3f s  (%d neighbors,  %ld items tried)\n",
+	   name, KD_WIDE, now() - start, KD_WIDE_NEIGHBORS, tried);
+    start = now();
+    for (i = 0;  i < KD_WIDE;  i++) {
+	best_tried += kd_nearest_best_first(tree, points[i][0], points[i][1],
+					    KD_WIDE_NEIGHBORS, &list);
+	best_sum += list[KD_WIDE_NEIGHBORS-1].dist;
+	free(list);
+    }
+    printf("[bench] %-8s %6d best first: %7.3f s  (%d neighbors,  %ld items tried)\n",
+	   name, KD_WIDE, now() - start, KD_WIDE_NEIGHBORS, best_tried);
+    return best_sum == sum ? sum : -1.0;
+}
+
+/*
+ * The nearest item passing a filter:  kd_nearest with m doubled until
+ * one turns up,  then a kd_nearest_start walk.  Returns the sum of
+ * the distances.
+ */
+static double time_nearest_walk(const char *name, kd_tree tree)
+{
+    kd_priority *list;
+    kd_near_gen gen;
+    kd_generic item;
+    double start, dist, sum = 0.0, walk_sum = 0.0;
+    int i, j, m;
+
+    start = now();
+    for (i = 0;  i < KD_WIDE;  i++) {
+	for (m = 8;  ;  m *= 2) {
+	    (void) kd_nearest_best_first(tree, points[i][0], points[i][1], m, &list);
+	    for (j = 0;  j < m && (long) list[j].elem % KD_PICKY;  j++) ;
+	    if (j < m) break;
+	    free(list);
+	}
+	sum += list[j].dist;
+	free(list);
+    }
+    printf("[bench] %-8s %6d growing m: %7.3f s  (first of 1 in %d)\n",
+	   name, KD_WIDE, now() - start, KD_PICKY);
+    start = now();
+    for (i = 0;  i < KD_WIDE;  i++) {
+	gen = kd_nearest_start(tree, points[i][0], points[i][1]);
+	while (kd_nearest_next(gen, &item, &dist) == KD_OK && (long) item % KD_PICKY) ;
+	walk_sum += dist;
+	(void) kd_nearest_finish(gen);
+    }
+    printf("[bench] %-8s %6d walked:   %8.3f s  (first of 1 in %d)\n",
+	   name, KD_WIDE, now() - start, KD_PICKY);
+    return walk_sum == sum ? sum : -1.0;
+}
+
+/* kd_nearest_filtered filter:  the items time_nearest_walk() looks for */
+static int picky(kd_generic item, kd_box size, kd_generic arg)
+{
+    (void) size;  (void) arg;
+    return (long) item % KD_PICKY == 0;
+}
+
+/*
+ * The KD_NEIGHBORS nearest items passing a filter:  kd_nearest for
+ * ten times as many,  m doubled until enough pass,  then one
+ * kd_nearest_filtered.  Returns the sum of the last distances.
+ */
+static double time_nearest_filtered(const char *name, kd_tree tree)
+{
+    kd_priority *list;
+    double start, sum = 0.0, filtered_sum = 0.0;
+    int i, j, n, m;
+
+    start = now();
+    for (i = 0;  i < KD_WIDE;  i++) {
+	for (m = 10 * KD_NEIGHBORS;  ;  m *= 2) {
+	    (void) kd_nearest(tree, points[i][0], points[i][1], m, &list);
+	    for (n = 0, j = 0;  j < m;  j++)
+		if (list[j].elem && picky(list[j].elem, (kd_box_r) 0, (kd_generic) 0) &&
+		    ++n == KD_NEIGHBORS) break;
+	    if (j < m) break;
+	    free(list);
+	}
+	sum += list[j].dist;
+	free(list);
+    }
+    printf("[bench] %-8s %6d filtered after: %5.3f s  (%d of 1 in %d)\n",
+	   name, KD_WIDE, now() - start, KD_NEIGHBORS, KD_PICKY);
+    start = now();
+    for (i = 0;  i < KD_WIDE;  i++) {
+	(void) kd_nearest_filtered(tree, points[i][0], points[i][1], KD_NEIGHBORS,
+				   picky, (kd_generic) 0, &list);
+	filtered_sum += list[KD_NEIGHBORS-1].dist;
+	free(list);
+    }
+    printf("[bench] %-8s %6d filtered:  %7.3f s  (%d of 1 in %d)\n",
+	   name, KD_WIDE, now() - start, KD_NEIGHBORS, KD_PICKY);
+    return filtered_sum == sum ? sum : -1.0;
+}
+
+/*
+ * Readers share one tree:  reader `id' of `count' takes every
+ * count'th region,  nearest point and member lookup.
+ */
+typedef struct {
+    kd_tree tree;
+    int id, count;
+    long found;
+} reader;
+
+static void *read_tree(void *arg)
+{
+    reader *rd = (reader *) arg;
+    kd_priority *list;
+    kd_gen_storage buf;
+    kd_gen gen;
+    kd_generic item;
+    int i;
+
+    gen = kd_gen_init(&buf, rd->tree, regions[rd->id]);
+    for (i = rd->id;  i < KD_REGIONS;  i += rd->count) {
+	if (i > rd->id) kd_gen_reset(gen, regions[i]);
+	while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) rd->found++;
+    }
+    kd_finish(gen);
+    for (i = rd->id;  i < KD_NEAREST;  i += rd->count) {
+	(void) kd_nearest(rd->tree, points[i][0], points[i][1], KD_NEIGHBORS, &list);
+	free(list);
+	if (kd_is_member(rd->tree, (kd_generic) (long) (i+1), boxes[i]) == KD_OK)
+	    rd->found++;
+    }
+    return (void *) 0;
+}
+
+/* The same work on 1,  2,  4 ... KD_READERS threads */
+static long time_readers(const char *name, kd_tree tree)
+{
+    pthread_t threads[KD_READERS];
+    reader readers[KD_READERS];
+    double start, elapsed;
+    long found, first = -1;
+    int n, i;
+
+    for (n = 1;  n <= KD_READERS;  n *= 2) {
+	start = now();
+	for (i = 0;  i < n;  i++) {
+	    readers[i].tree = tree;
+	    readers[i].id = i;
+	    readers[i].count = n;
+	    readers[i].found = 0;
+	    if (pthread_create(&threads[i], NULL, read_tree, &readers[i]) != 0)
+		return -1;
+	}
+	found = 0;
+	for (i = 0;  i < n;  i++) {
+	    (void) pthread_join(threads[i], NULL);
+	    found += readers[i].found;
+	}
+	elapsed = now() - start;
+	printf("[bench] %-8s %d readers:       %8.3f s  (%.0f queries/s)\n",
+	       name, n, elapsed, (KD_REGIONS + 2.0 * KD_NEAREST) / elapsed);
+	if (first >= 0 && found != first) return -1;
+	first = found;
+    }
+    return first;
+}
+
+int main(int argc, char **argv)
+{
+    kd_generic *items, *layer_items;
+    kd_tree tree, frozen, bucketed, mapped, layer;
+    double start, sum;
+    long found;
+    int i;
+
+    if (argc > 1) num_boxes = atoi(argv[1]);
+    if (num_boxes <= 0) num_boxes = KD_BOXES;
+    srandom(12345);
+    boxes = (kd_box *) malloc(num_boxes * sizeof(kd_box));
+    items = (kd_generic *) malloc(num_boxes * sizeof(kd_generic));
+    regions = (kd_box *) malloc(KD_REGIONS * sizeof(kd_box));
+    zoomed = (kd_box *) malloc(KD_ZOOMED * sizeof(kd_box));
+    layer_boxes = (kd_box *) malloc(KD_LAYER * sizeof(kd_box));
+    layer_items = (kd_generic *) malloc(KD_LAYER * sizeof(kd_generic));
+    points = (int (*)[2]) malloc(KD_NEAREST * sizeof(*points));
+    for (i = 0;  i < num_boxes;  i++) {
+	rand_box(boxes[i], BOX_RANGE);
+	items[i] = (kd_generic) (long) (i+1);
+    }
+    for (i = 0;  i < KD_REGIONS;  i++) rand_box(regions[i], REGION_RANGE);
+    for (i = 0;  i < KD_ZOOMED;  i++) rand_box(zoomed[i], ZOOMED_RANGE);
+    for (i = 0;  i < KD_LAYER;  i++) {
+	rand_box(layer_boxes[i], BOX_RANGE);
+	layer_items[i] = (kd_generic) (long) (i+1);
+    }
+    for (i = 0;  i < KD_NEAREST;  i++) {
+	points[i][0] = (random() % RANGE_SPAN) + MIN_RANGE;
+	points[i][1] = (random() % RANGE_SPAN) + MIN_RANGE;
+    }
+
+    start = now();
+    tree = kd_build_from_arrays((const kd_box *) boxes, items, num_boxes);
+    printf("[bench] build    %7d boxes:   %8.3f s\n", num_boxes, now() - start);
+    start = now();
+    frozen = kd_freeze(tree);
+    printf("[bench] freeze   %7d boxes:   %8.3f s\n", num_boxes, now() - start);
+    start = now();
+    bucketed = kd_freeze_buckets(tree, KD_BUCKET_SIZE);
+    printf("[bench] buckets  %7d boxes:   %8.3f s  (%d per bucket)\n",
+	   num_boxes, now() - start, KD_BUCKET_SIZE);
+    start = now();
+    if (kd_save(bucketed, KD_IMAGE) != KD_OK) {
+	fprintf(stderr, "[bench] %s\n", kd_err_string());
+	return 1;
+    }
+    printf("[bench] save     %7d boxes:   %8.3f s\n", num_boxes, now() - start);
+    start = now();
+    mapped = kd_open_mmap(KD_IMAGE);
+    if (!mapped) {
+	fprintf(stderr, "[bench] %s\n", kd_err_string());
+	return 1;
+    }
+    printf("[bench] open     %7d boxes:   %8.3f s\n", num_boxes, now() - start);
+
+    found = time_regions("pointer", tree);
+    if (time_regions("frozen", frozen) != found ||
+	time_regions("bucketed", bucketed) != found ||
+	time_regions("mapped", mapped) != found ||
+	time_gen_storage("pointer", tree) != found ||
+	time_gen_storage("bucketed", bucketed) != found ||
+	time_search("pointer", tree) != found ||
+	time_search("bucketed", bucketed) != found ||
+	time_batch("pointer", tree) != found ||
+	time_batch("bucketed", bucketed) != found ||
+	time_count("pointer", tree) != found) {
+	fprintf(stderr, "[bench] trees disagree on region searches\n");
+	return 1;
+    }
+    found = time_zoomed("pointer", tree);
+    if (found < 0 || time_zoomed("bucketed", bucketed) != found) {
+	fprintf(stderr, "[bench] trees disagree on zoomed out searches\n");
+	return 1;
+    }
+    found = time_stab("pointer", tree);
+    if (found < 0 || time_stab("bucketed", bucketed) != found) {
+	fprintf(stderr, "[bench] trees disagree on hit tests\n");
+	return 1;
+    }
+    found = time_segment("pointer", tree);
+    if (found < 0 || time_segment("bucketed", bucketed) != found) {
+	fprintf(stderr, "[bench] trees disagree on wire searches\n");
+	return 1;
+    }
+    layer = kd_build_from_arrays((const kd_box *) layer_boxes, layer_items, KD_LAYER);
+    found = time_join("pointer", tree, layer);
+    if (found < 0 || time_join("bucketed", bucketed, layer) != found) {
+	fprintf(stderr, "[bench] trees disagree on joins\n");
+	return 1;
+    }
+    kd_destroy(layer, NULL);
+    found = time_self_join("pointer", tree);
+    if (found < 0 || time_self_join("bucketed", bucketed) != found ||
+	atomic_load(&pairs_found) != 2 * found) {
+	fprintf(stderr, "[bench] trees disagree on self joins\n");
+	return 1;
+    }
+    sum = time_nearest("pointer", tree);
+    if (time_nearest("frozen", frozen) != sum ||
+	time_nearest("bucketed", bucketed) != sum ||
+	time_nearest_batch("pointer", tree, 1) != sum ||
+	time_nearest_batch("pointer", tree, KD_THREADS) != sum ||
+	time_nearest_batch("bucketed", bucketed, 1) != sum ||
+	time_nearest_batch("bucketed", bucketed, KD_THREADS) != sum) {
+	fprintf(stderr, "[bench] trees disagree on nearest neighbors\n");
+	return 1;
+    }
+    if (time_nearest_metric("pointer", tree, KD_EUCLIDEAN) != sum ||
+	time_nearest_metric("bucketed", bucketed, KD_EUCLIDEAN) != sum) {
+	fprintf(stderr, "[bench] kd_nearest_metric disagrees with kd_nearest\n");
+	return 1;
+    }
+    for (i = KD_MANHATTAN;  i <= KD_CENTROID;  i++) {
+	if (time_nearest_metric("pointer", tree, i) !=
+	    time_nearest_metric("bucketed", bucketed, i)) {
+	    fprintf(stderr, "[bench] trees disagree on nearest neighbors by metric\n");
+	    return 1;
+	}
+    }
+    sum = time_nearest_walk("pointer", tree);
+    if (sum < 0 || time_nearest_walk("bucketed", bucketed) != sum) {
+	fprintf(stderr, "[bench] trees disagree on nearest walks\n");
+	return 1;
+    }
+    sum = time_nearest_filtered("pointer", tree);
+    if (sum < 0 || time_nearest_filtered("bucketed", bucketed) != sum) {
+	fprintf(stderr, "[bench] trees disagree on filtered nearest neighbors\n");
+	return 1;
+    }
+    found = time_within("pointer", tree);
+    if (found < 0 || time_within("bucketed", bucketed) != found) {
+	fprintf(stderr, "[bench] trees disagree on items within a distance\n");
+	return 1;
+    }
+    sum = time_nearest_wide("pointer", tree);
+    if (sum < 0 || time_nearest_wide("bucketed", bucketed) != sum) {
+	fprintf(stderr, "[bench] trees disagree on wide nearest neighbors\n");
+	return 1;
+    }
+
+    found = time_readers("pointer", tree);
+    if (found < 0 || time_readers("bucketed", bucketed) != found) {
+	fprintf(stderr, "[bench] reader threads disagree\n");
+	return 1;
+    }
+
+    kd_destroy(mapped, NULL);
+    (void) remove(KD_IMAGE);
+    kd_destroy(bucketed, NULL);
+    kd_destroy(frozen, NULL);
+    kd_destroy(tree, NULL);
+    free(points);
+    free(layer_items);
+    free(layer_boxes);
+    free(zoomed);
+    free(regions);
+    free(items);
+    free(boxes);
+    return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * K-d tree test: alternate build paths
+ *
+ * Builds trees of random boxes through each of the bulk build
+ * entry points and checks that every one of them answers region
+ * queries exactly like a linear scan, holds every item, and can
+ * be torn down again.
+ * Returns 0 on success, non-zero on failure.
+ */
+
+#define _DEFAULT_SOURCE		/* random() and srandom() */
+#include "kd.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define random() rand()
+#define srandom(x) srand(x)
+#endif
+
+#define KD_BOXES	200000
+#define KD_REGIONS      200
+
+#define MIN_RANGE	-100000
+#define MAX_RANGE	100000
+#define RANGE_SPAN	(MAX_RANGE - MIN_RANGE + 1)
+#define BOX_RANGE	1000
+
+static kd_box boxes[KD_BOXES];
+static kd_generic items[KD_BOXES];
+static int local[KD_BOXES];
+
+#define BOXINTERSECT(b1, b2) \
+  (((b1)[KD_RIGHT] >= (b2)[KD_LEFT]) && \
+   ((b2)[KD_RIGHT] >= (b1)[KD_LEFT]) && \
+   ((b1)[KD_TOP] >= (b2)[KD_BOTTOM]) && \
+   ((b2)[KD_TOP] >= (b1)[KD_BOTTOM]))
+
+static void rand_box(kd_box box)
+{
+    static int init = 0;
+
+    if (!init) {
+	(void) srandom((int) time(NULL));
+	init = 1;
+    }
+
+    box[KD_LEFT] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_BOTTOM] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_RIGHT] = box[KD_LEFT] + (random() % BOX_RANGE);
+    box[KD_TOP] = box[KD_BOTTOM] + (random() % BOX_RANGE);
+}
+
+static int gen_box(kd_generic arg, kd_generic *val, kd_box size)
+{
+    int *offsetp = ((int *) arg);
+    int offset = *((int *) arg);
+
+    if (offset < KD_BOXES) {
+	*val = items[offset];
+	size[KD_LEFT] = boxes[offset][KD_LEFT];
+	size[KD_BOTTOM] = boxes[offset][KD_BOTTOM];
+	size[KD_RIGHT] = boxes[offset][KD_RIGHT];
+	size[KD_TOP] = boxes[offset][KD_TOP];
+	*offsetp += 1;
+	return 1;
+    } else {
+	return 0;
+    }
+}
+
+static void gen_boxes(void)
+{
+    int i;
+    for (i = 0;  i < KD_BOXES;  i++) {
+	rand_box(boxes[i]);
+	items[i] = (kd_generic) (long)(i+1);
+    }
+}
+
+/*
+ * Runs random region queries against `tree' and compares them
+ * with a linear scan.  Then makes sure every item can be found.
+ */
+static int check_tree(const char *name, kd_tree tree)
+{
+    kd_box region, size;
+    kd_gen gen;
+    int i, j, k, n;
+
+    if (kd_count(tree) != KD_BOXES) {
+	fprintf(stderr, "[build] FAIL: %s: tree holds %d items, expected %d\n",
+		name, kd_count(tree), KD_BOXES);
+	return 1;
+    }
+    for (i = 0;  i < KD_REGIONS;  i++) {
+	rand_box(region);
+	gen = kd_start(tree, region);
+	n = 0;
+	while (kd_next(gen, (kd_generic *) &(local[n]), size) == KD_OK) {
+	    n++;
+	}
+	kd_finish(gen);
+	for (j = 0;  j < KD_BOXES;  j++) {
+	    if (BOXINTERSECT(region, boxes[j])) {
+		for (k = 0;  k < n;  k++) {
+		    if (local[k] == j+1) {
+			local[k] = -1;
+			break;
+		    }
+		}
+		if (k >= n) {
+		    fprintf(stderr, "[build] FAIL: %s: missing item in search\n", name);
+		    return 1;
+		}
+	    }
+	}
+	for (k = 0;  k < n;  k++) {
+	    if (local[k] >= 0) {
+		fprintf(stderr, "[build] FAIL: %s: extra item in search\n", name);
+		return 1;
+	    }
+	}
+    }
+    for (j = 0;  j < KD_BOXES;  j++) {
+	if (kd_is_member(tree, items[j], boxes[j]) != KD_OK) {
+	    fprintf(stderr, "[build] FAIL: %s: item %d not a member\n", name, j);
+	    return 1;
+	}
+    }
+    printf("[build] %s: %d regions and %d lookups verified\n",
+	   name, KD_REGIONS, KD_BOXES);
+    return 0;
+}
+
+/*
+ * Two trees of identical shape generate the whole space in the
+ * same order.  Returns non-zero if `a' and `b' differ.
+ */
+static int same_order(kd_tree a, kd_tree b)
+{
+    static kd_box all = { MIN_RANGE-1, MIN_RANGE-1,
+			  MAX_RANGE+BOX_RANGE+1, MAX_RANGE+BOX_RANGE+1 };
+    kd_gen ga, gb;
+    kd_generic ia, ib;
+    kd_status sa, sb;
+    int diff = 0;
+
+    ga = kd_start(a, all);
+    gb = kd_start(b, all);
+    do {
+	sa = kd_next(ga, &ia, (kd_box_r) 0);
+	sb = kd_next(gb, &ib, (kd_box_r) 0);
+	if (sa != sb || (sa == KD_OK && ia != ib)) diff = 1;
+    } while (!diff && sa == KD_OK);
+    kd_finish(ga);
+    kd_finish(gb);
+    return diff;
+}
+
+int main(int argc, char **argv)
+{
+    kd_tree tree, serial;
+    int idx, i, tries, dels;
+
+    (void)argc; (void)argv;
+    gen_boxes();
+
+    tree = kd_build_from_arrays((const kd_box *) boxes, items, KD_BOXES);
+    kd_badness(tree);
+    if (check_tree("kd_build_from_arrays", tree)) return 1;
+
+    /* Deleted nodes are handed out again by later inserts */
+    for (i = 1;  i < KD_BOXES;  i += 2) {
+	if (kd_really_delete(tree, items[i], boxes[i], &tries, &dels) != KD_OK) {
+	    fprintf(stderr, "[build] FAIL: could not really_delete item %d\n", i);
+	    return 1;
+	}
+    }
+    for (i = 1;  i < KD_BOXES;  i += 2) {
+	kd_insert(tree, items[i], boxes[i], (kd_generic) 0);
+    }
+    if (check_tree("reinserted nodes", tree)) return 1;
+    kd_destroy(tree, NULL);
+
+    idx = 0;
+    serial = kd_build(gen_box, (kd_generic) &idx);
+    idx = 0;
+    tree = kd_build_parallel(gen_box, (kd_generic) &idx, 4);
+    if (check_tree("kd_build_parallel", tree)) return 1;
+    if (same_order(serial, tree)) {
+	fprintf(stderr, "[build] FAIL: parallel build differs from kd_build\n");
+	return 1;
+    }
+    serial = kd_rebuild(serial);
+    tree = kd_rebuild_parallel(tree, 4);
+    if (check_tree("kd_rebuild_parallel", tree)) return 1;
+    if (same_order(serial, tree)) {
+	fprintf(stderr, "[build] FAIL: parallel rebuild differs from kd_rebuild\n");
+	return 1;
+    }
+    kd_destroy(serial, NULL);
+    kd_destroy(tree, NULL);
+
+    /* Exact median splits, serial and parallel */
+    kd_set_build_strategy(KD_BUILD_MEDIAN);
+    tree = kd_build_from_arrays((const kd_box *) boxes, items, KD_BOXES);
+    kd_badness(tree);
+    if (check_tree("KD_BUILD_MEDIAN", tree)) return 1;
+    idx = 0;
+    serial = kd_build_parallel(gen_box, (kd_generic) &idx, 4);
+    if (check_tree("KD_BUILD_MEDIAN parallel", serial)) return 1;
+    if (same_order(serial, tree)) {
+	fprintf(stderr, "[build] FAIL: parallel median build differs\n");
+	return 1;
+    }
+    kd_destroy(serial, NULL);
+    tree = kd_rebuild(tree);
+    if (check_tree("KD_BUILD_MEDIAN rebuild", tree)) return 1;
+    kd_destroy(tree, NULL);
+    kd_set_build_strategy(KD_BUILD_MEAN);
+
+    tree = kd_build_from_arrays((const kd_box *) boxes, items, 0);
+    if (kd_count(tree) != 0) {
+	fprintf(stderr, "[build] FAIL: empty array build is not empty\n");
+	return 1;
+    }
+    kd_destroy(tree, NULL);
+
+    printf("[build] All build paths verified. PASS\n");
+    return 0;
+}
@@ -0,0 +1,444 @@
+/*
+ * K-d tree test: frozen trees (kd_freeze)
+ *
+ * Builds a tree of random boxes, freezes it, and checks that the
+ * frozen copy answers region queries like a linear scan, holds every
+ * item, finds the same nearest neighbors as the original and refuses
+ * to be modified.  Then does the same for trees frozen with leaf
+ * buckets (kd_freeze_buckets),  and for trees saved with kd_save
+ * and mapped back with kd_open_mmap,  which must refuse images with
+ * damaged headers,  offsets,  sons or buckets.
+ * Returns 0 on success, non-zero on failure.
+ */
+
+#define _DEFAULT_SOURCE		/* random() and srandom() */
+#include "kd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define random() rand()
+#define srandom(x) srand(x)
+#endif
+
+#define KD_BOXES	200000
+#define KD_REGIONS      200
+#define KD_NEAREST      200
+#define KD_IMAGE	"kd_test_frozen.img"
+
+#define MIN_RANGE	-100000
+#define MAX_RANGE	100000
+#define RANGE_SPAN	(MAX_RANGE - MIN_RANGE + 1)
+#define BOX_RANGE	1000
+
+static kd_box boxes[KD_BOXES];
+static kd_generic items[KD_BOXES];
+static int local[KD_BOXES];
+
+#define BOXINTERSECT(b1, b2) \
+  (((b1)[KD_RIGHT] >= (b2)[KD_LEFT]) && \
+   ((b2)[KD_RIGHT] >= (b1)[KD_LEFT]) && \
+   ((b1)[KD_TOP] >= (b2)[KD_BOTTOM]) && \
+   ((b2)[KD_TOP] >= (b1)[KD_BOTTOM]))
+
+static void rand_box(kd_box box)
+{
+    static int init = 0;
+
+    if (!init) {
+	(void) srandom((int) time(NULL));
+	init = 1;
+    }
+
+    box[KD_LEFT] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_BOTTOM] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_RIGHT] = box[KD_LEFT] + (random() % BOX_RANGE);
+    box[KD_TOP] = box[KD_BOTTOM] + (random() % BOX_RANGE);
+}
+
+static int gen_box(kd_generic arg, kd_generic *val, kd_box size)
+{
+    int *offsetp = ((int *) arg);
+    int offset = *((int *) arg);
+
+    if (offset < KD_BOXES) {
+	*val = items[offset];
+	size[KD_LEFT] = boxes[offset][KD_LEFT];
+	size[KD_BOTTOM] = boxes[offset][KD_BOTTOM];
+	size[KD_RIGHT] = boxes[offset][KD_RIGHT];
+	size[KD_TOP] = boxes[offset][KD_TOP];
+	*offsetp += 1;
+	return 1;
+    } else {
+	return 0;
+    }
+}
+
+static void gen_boxes(void)
+{
+    int i;
+    for (i = 0;  i < KD_BOXES;  i++) {
+	rand_box(boxes[i]);
+	items[i] = (kd_generic) (long)(i+1);
+    }
+}
+
+/*
+ * Runs random region queries against `tree' and compares them
+ * with a linear scan.  Then makes sure every item can be found.
+ */
+static int check_tree(const char *name, kd_tree tree, int count)
+{
+    kd_box region, size;
+    kd_gen gen;
+    int i, j, k, n;
+
+    if (kd_count(tree) != count) {
+	fprintf(stderr, "[frozen] FAIL: %s: tree holds %d items, expected %d\n",
+		name, kd_count(tree), count);
+	return 1;
+    }
+    for (i = 0;  i < KD_REGIONS;  i++) {
+	rand_box(region);
+	gen = kd_start(tree, region);
+	n = 0;
+	while (kd_next(gen, (kd_generic *) &(local[n]), size) == KD_OK) {
+	    n++;
+	}
+	kd_finish(gen);
+	for (j = 0;  j < KD_BOXES;  j++) {
+	    if (j % 2 && count < KD_BOXES) continue;
+	    if (BOXINTERSECT(region, boxes[j])) {
+		for (k = 0;  k < n;  k++) {
+		    if (local[k] == j+1) {
+			local[k] = -1;
+			break;
+		    }
+		}
+		if (k >= n) {
+		    fprintf(stderr, "[frozen] FAIL: %s: missing item in search\n", name);
+		    return 1;
+		}
+	    }
+	}
+	for (k = 0;  k < n;  k++) {
+	    if (local[k] >= 0) {
+		fprintf(stderr, "[frozen] FAIL: %s: extra item in search\n", name);
+		return 1;
+	    }
+	}
+    }
+    for (j = 0;  j < KD_BOXES;  j++) {
+	if (kd_is_member(tree, items[j], boxes[j]) !=
+	    ((j % 2 && count < KD_BOXES) ? KD_NOTFOUND : KD_OK)) {
+	    fprintf(stderr, "[frozen] FAIL: %s: membership of item %d wrong\n", name, j);
+	    return 1;
+	}
+    }
+    printf("[frozen] %s: %d regions and %d lookups verified\n",
+	   name, KD_REGIONS, KD_BOXES);
+    return 0;
+}
+
+/*
+ * Both trees generate the whole space in the same order:  freezing
+ * changes where nodes live,  not the shape of the tree.
+ */
+static int same_order(kd_tree a, kd_tree b)
+{
+    static kd_box all = { MIN_RANGE-1, MIN_RANGE-1,
+			  MAX_RANGE+BOX_RANGE+1, MAX_RANGE+BOX_RANGE+1 };
+    kd_gen ga, gb;
+    kd_generic ia, ib;
+    kd_status sa, sb;
+    int diff = 0;
+
+    ga = kd_start(a, all);
+    gb = kd_start(b, all);
+    do {
+	sa = kd_next(ga, &ia, (kd_box_r) 0);
+	sb = kd_next(gb, &ib, (kd_box_r) 0);
+	if (sa != sb || (sa == KD_OK && ia != ib)) diff = 1;
+    } while (!diff && sa == KD_OK);
+    kd_finish(ga);
+    kd_finish(gb);
+    return diff;
+}
+
+/* Nearest neighbor lists of `a' and `b' agree on distances */
+static int same_nearest(kd_tree a, kd_tree b)
+{
+    kd_priority *la, *lb;
+    int q, i, m, qx, qy;
+
+    for (q = 0;  q < KD_NEAREST;  q++) {
+	m = 1 + q % 16;
+	qx = (random() % RANGE_SPAN) + MIN_RANGE;
+	qy = (random() % RANGE_SPAN) + MIN_RANGE;
+	(void) kd_nearest(a, qx, qy, m, &la);
+	(void) kd_nearest(b, qx, qy, m, &lb);
+	for (i = 0;  i < m;  i++) {
+	    if (la[i].dist != lb[i].dist) {
+		fprintf(stderr, "[frozen] FAIL: nearest %d of (%d,%d): %g vs %g\n",
+			i, qx, qy, la[i].dist, lb[i].dist);
+		return 1;
+	    }
+	}
+	free(la);
+	free(lb);
+    }
+    return 0;
+}
+
+/*
+ * Where kd_save puts things,  for damaging images on purpose:  header
+ * fields by byte offset,  and the sons of a node after its box and
+ * bounds.
+ */
+#define HDR_NODE_SIZE	16
+#define HDR_DEPTH	36
+#define HDR_BUCKET_LEN	60
+#define HDR_NODES_OFF	64
+#define NODE_SONS	28
+#define KD_BUCKET_BIT	0x80000000u
+
+static int image_io(long off, void *data, size_t len, int write)
+{
+    FILE *fp = fopen(KD_IMAGE, "r+b");
+    int ok;
+
+    if (!fp) return 0;
+    ok = fseek(fp, off, SEEK_SET) == 0 &&
+	(write ? fwrite(data, 1, len, fp) : fread(data, 1, len, fp)) == len;
+    return (fclose(fp) == 0) && ok;
+}
+
+/* Offset of the sons of node `n',  or -1 */
+static long sons_at(unsigned int n)
+{
+    uint64_t nodes_off;
+    uint32_t node_size;
+
+    if (!image_io(HDR_NODES_OFF, &nodes_off, sizeof(nodes_off), 0) ||
+	!image_io(HDR_NODE_SIZE, &node_size, sizeof(node_size), 0)) return -1;
+    return (long) (nodes_off + (uint64_t) n * node_size + NODE_SONS);
+}
+
+/* An image of `tree' with `len' bytes of `data' written at `off' must be refused */
+static int refused(const char *what, kd_tree tree, long off, void *data, size_t len)
+{
+    kd_tree mapped;
+
+    if (kd_save(tree, KD_IMAGE) != KD_OK || off < 0 || !image_io(off, data, len, 1)) {
+	fprintf(stderr, "[frozen] FAIL: could not damage an image (%s)\n", what);
+	return 1;
+    }
+    if ((mapped = kd_open_mmap(KD_IMAGE))) {
+	fprintf(stderr, "[frozen] FAIL: opened an image with %s\n", what);
+	kd_destroy(mapped, NULL);
+	return 1;
+    }
+    if (!strstr(kd_err_string(), "image")) {
+	fprintf(stderr, "[frozen] FAIL: %s: %s\n", what, kd_err_string());
+	return 1;
+    }
+    return 0;
+}
+
+/* Damaged or missing images are refused,  not searched */
+static int bad_image(kd_tree tree)
+{
+    FILE *fp;
+    kd_tree bucketed, mapped;
+    uint32_t sons[2], bad_son = 0x7ffffff0u, bucket_len, n;
+    uint64_t off;
+    int32_t depth = 1;
+    char byte;
+
+    if (kd_open_mmap("no/such/" KD_IMAGE)) {
+	fprintf(stderr, "[frozen] FAIL: opened a missing image\n");
+	return 1;
+    }
+
+    /* Sons out of range,  or shared so that the tree is not a tree */
+    if (kd_save(tree, KD_IMAGE) != KD_OK ||
+	!image_io(sons_at(0), sons, sizeof(sons), 0) || !sons[0] || !sons[1]) {
+	fprintf(stderr, "[frozen] FAIL: no root sons to damage\n");
+	return 1;
+    }
+    if (refused("a son past the nodes", tree, sons_at(0), &bad_son, sizeof(bad_son)) ||
+	refused("a son shared", tree, sons_at(0) + 4, &sons[0], sizeof(sons[0])))
+	return 1;
+
+    /* Offsets out of line,  past the end,  or wrapping round */
+    if (!image_io(HDR_NODES_OFF, &off, sizeof(off), 0)) return 1;
+    off += 8;
+    if (refused("misaligned nodes", tree, HDR_NODES_OFF, &off, sizeof(off))) return 1;
+    off = 0;
+    if (refused("nodes over the header", tree, HDR_NODES_OFF, &off, sizeof(off))) return 1;
+    off = UINT64_MAX - 63;
+    if (refused("nodes off the end", tree, HDR_NODES_OFF, &off, sizeof(off))) return 1;
+
+    /* A bucket reaching past the bucket arrays */
+    bucketed = kd_freeze_buckets(tree, 32);
+    if (kd_save(bucketed, KD_IMAGE) != KD_OK ||
+	!image_io(HDR_BUCKET_LEN, &bucket_len, sizeof(bucket_len), 0)) return 1;
+    for (n = 0;  image_io(sons_at(n), sons, sizeof(sons), 0);  n++)
+	if (sons[0] & KD_BUCKET_BIT) break;
+    sons[1] = bucket_len - (sons[0] & ~KD_BUCKET_BIT) + 1;
+    if (!(sons[0] & KD_BUCKET_BIT) ||
+	refused("a bucket past the end", bucketed, sons_at(n), sons, sizeof(sons))) {
+	kd_destroy(bucketed, NULL);
+	return 1;
+    }
+    kd_destroy(bucketed, NULL);
+
+    /* The depth is worked out from the nodes,  not trusted */
+    if (kd_save(tree, KD_IMAGE) != KD_OK ||
+	!image_io(HDR_DEPTH, &depth, sizeof(depth), 1) || !(mapped = kd_open_mmap(KD_IMAGE)) ||
+	check_tree("low depth image", mapped, KD_BOXES)) {
+	fprintf(stderr, "[frozen] FAIL: image with a low depth\n");
+	return 1;
+    }
+    kd_destroy(mapped, NULL);
+
+    /* Flip the first byte of the magic number */
+    fp = fopen(KD_IMAGE, "r+b");
+    if (!fp || fread(&byte, 1, 1, fp) != 1) return 1;
+    byte ^= 0x20;
+    (void) fseek(fp, 0L, SEEK_SET);
+    (void) fwrite(&byte, 1, 1, fp);
+    (void) fclose(fp);
+    if (kd_open_mmap(KD_IMAGE) || kd_open_mmap(__FILE__)) {
+	fprintf(stderr, "[frozen] FAIL: opened a damaged image\n");
+	return 1;
+    }
+    printf("[frozen] images saved, mapped and checked\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static int bucket_sizes[3] = { 16, 32, 61 };
+    kd_tree tree, frozen, copy;
+    kd_priority *list;
+    int idx, i, tries, dels;
+
+    (void)argc; (void)argv;
+    gen_boxes();
+
+    idx = 0;
+    tree = kd_build(gen_box, (kd_generic) &idx);
+    frozen = kd_freeze(tree);
+    if (check_tree("kd_freeze", frozen, KD_BOXES)) return 1;
+    if (same_order(tree, frozen)) {
+	fprintf(stderr, "[frozen] FAIL: frozen tree generates in another order\n");
+	return 1;
+    }
+    if (same_nearest(tree, frozen)) return 1;
+    printf("[frozen] %d nearest neighbor queries verified\n", KD_NEAREST);
+
+    /* Read-only:  changes are refused and leave the tree alone */
+    if (kd_delete(frozen, items[0], boxes[0]) != KD_NOTIMPL ||
+	kd_really_delete(frozen, items[0], boxes[0], &tries, &dels) != KD_NOTIMPL) {
+	fprintf(stderr, "[frozen] FAIL: frozen tree accepted a delete\n");
+	return 1;
+    }
+    if (kd_rebuild(frozen) != frozen || kd_count(frozen) != KD_BOXES) {
+	fprintf(stderr, "[frozen] FAIL: frozen tree was rebuilt\n");
+	return 1;
+    }
+    copy = kd_freeze(frozen);
+    kd_destroy(frozen, NULL);
+    if (same_order(tree, copy)) {
+	fprintf(stderr, "[frozen] FAIL: copy of a frozen tree differs\n");
+	return 1;
+    }
+    kd_destroy(copy, NULL);
+
+    /* Leaf buckets of several sizes,  one of them not a block multiple */
+    for (i = 0;  i < 3;  i++) {
+	frozen = kd_freeze_buckets(tree, bucket_sizes[i]);
+	if (check_tree("kd_freeze_buckets", frozen, KD_BOXES)) return 1;
+	if (same_order(tree, frozen)) {
+	    fprintf(stderr, "[frozen] FAIL: bucketed tree generates in another order\n");
+	    return 1;
+	}
+	if (same_nearest(tree, frozen)) return 1;
+	copy = kd_freeze(frozen);
+	kd_destroy(frozen, NULL);
+	if (same_order(tree, copy)) {
+	    fprintf(stderr, "[frozen] FAIL: copy of a bucketed tree differs\n");
+	    return 1;
+	}
+	kd_destroy(copy, NULL);
+    }
+
+    /* Images:  plain and bucketed,  then ones that must be refused */
+    for (i = 0;  i < 2;  i++) {
+	if (i == 0) {
+	    if (kd_save(tree, KD_IMAGE) != KD_OK) {
+		fprintf(stderr, "[frozen] FAIL: kd_save: %s\n", kd_err_string());
+		return 1;
+	    }
+	} else {
+	    frozen = kd_freeze_buckets(tree, 32);
+	    if (kd_save(frozen, KD_IMAGE) != KD_OK) {
+		fprintf(stderr, "[frozen] FAIL: kd_save: %s\n", kd_err_string());
+		return 1;
+	    }
+	    kd_destroy(frozen, NULL);
+	}
+	frozen = kd_open_mmap(KD_IMAGE);
+	if (!frozen) {
+	    fprintf(stderr, "[frozen] FAIL: kd_open_mmap: %s\n", kd_err_string());
+	    return 1;
+	}
+	if (check_tree("kd_open_mmap", frozen, KD_BOXES)) return 1;
+	if (same_order(tree, frozen) || same_nearest(tree, frozen)) {
+	    fprintf(stderr, "[frozen] FAIL: mapped tree differs\n");
+	    return 1;
+	}
+	kd_destroy(frozen, NULL);
+    }
+    if (bad_image(tree)) return 1;
+    (void) remove(KD_IMAGE);
+
+    /* Dead nodes are carried over,  but never returned */
+    for (i = 1;  i < KD_BOXES;  i += 2) {
+	if (kd_delete(tree, items[i], boxes[i]) != KD_OK) {
+	    fprintf(stderr, "[frozen] FAIL: could not delete item %d\n", i);
+	    return 1;
+	}
+    }
+    frozen = kd_freeze(tree);
+    if (check_tree("kd_freeze with dead nodes", frozen, KD_BOXES/2)) return 1;
+    if (same_nearest(tree, frozen)) return 1;
+    kd_destroy(frozen, NULL);
+    frozen = kd_freeze_buckets(tree, 32);
+    if (check_tree("kd_freeze_buckets with dead nodes", frozen, KD_BOXES/2)) return 1;
+    if (same_order(tree, frozen) || same_nearest(tree, frozen)) return 1;
+    kd_destroy(frozen, NULL);
+    kd_destroy(tree, NULL);
+
+    tree = kd_create();
+    frozen = kd_freeze(tree);
+    if (kd_count(frozen) != 0 ||
+	kd_is_member(frozen, items[0], boxes[0]) != KD_NOTFOUND) {
+	fprintf(stderr, "[frozen] FAIL: frozen empty tree is not empty\n");
+	return 1;
+    }
+    (void) kd_nearest(frozen, 0, 0, 2, &list);
+    if (list[0].elem || list[1].elem) {
+	fprintf(stderr, "[frozen] FAIL: nearest found items in an empty tree\n");
+	return 1;
+    }
+    free(list);
+    kd_destroy(frozen, NULL);
+    kd_destroy(tree, NULL);
+
+    printf("[frozen] All frozen tree checks passed. PASS\n");
+    return 0;
+}
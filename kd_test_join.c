@@ -0,0 +1,296 @@
+/*
+ * K-d tree test: spatial joins
+ *
+ * Builds two trees of random boxes,  standing for two layers,  and
+ * checks that kd_join finds exactly the touching pairs a scan of
+ * every pair finds,  each once,  on pointer trees,  on frozen and
+ * bucketed copies,  and after deletions.  Then does the same for
+ * kd_self_join and kd_self_join_parallel within one of the trees.
+ * Returns 0 on success, non-zero on failure.
+ */
+
+#define _DEFAULT_SOURCE		/* random() and srandom() */
+#include "kd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#define random() rand()
+#define srandom(x) srand(x)
+#endif
+
+#define KD_A_BOXES	10000
+#define KD_B_BOXES	15000
+
+#define MIN_RANGE	-100000
+#define MAX_RANGE	100000
+#define RANGE_SPAN	(MAX_RANGE - MIN_RANGE + 1)
+#define BOX_RANGE	3000
+
+static kd_box a_boxes[KD_A_BOXES], b_boxes[KD_B_BOXES];
+static kd_generic a_items[KD_A_BOXES], b_items[KD_B_BOXES];
+static char a_live[KD_A_BOXES];
+
+#define BOXINTERSECT(b1, b2) \
+  (((b1)[KD_RIGHT] >= (b2)[KD_LEFT]) && \
+   ((b2)[KD_RIGHT] >= (b1)[KD_LEFT]) && \
+   ((b1)[KD_TOP] >= (b2)[KD_BOTTOM]) && \
+   ((b2)[KD_TOP] >= (b1)[KD_BOTTOM]))
+
+static void rand_box(kd_box box)
+{
+    static int init = 0;
+
+    if (!init) {
+	(void) srandom((int) time(NULL));
+	init = 1;
+    }
+
+    box[KD_LEFT] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_BOTTOM] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_RIGHT] = box[KD_LEFT] + (random() % BOX_RANGE);
+    box[KD_TOP] = box[KD_BOTTOM] + (random() % BOX_RANGE);
+}
+
+/* A pair is kept as a * KD_B_BOXES + b,  so that lists sort and compare */
+static long *expect, *found;
+static long num_expect, num_found, max_found, limit;
+static int bad_pair;
+
+static void expected(void)
+{
+    int i, j;
+
+    num_expect = 0;
+    for (i = 0;  i < KD_A_BOXES;  i++) {
+	if (!a_live[i]) continue;
+	for (j = 0;  j < KD_B_BOXES;  j++) {
+	    if (BOXINTERSECT(a_boxes[i], b_boxes[j])) {
+		if (num_expect >= max_found) {
+		    max_found *= 2;
+		    expect = (long *) realloc(expect, max_found * sizeof(long));
+		    found = (long *) realloc(found, max_found * sizeof(long));
+		}
+		expect[num_expect++] = (long) i * KD_B_BOXES + j;
+	    }
+	}
+    }
+}
+
+static int record_pair(kd_generic a, kd_box a_size, kd_generic b, kd_box b_size, kd_generic arg)
+{
+    long i = (long) a - 1, j = (long) b - 1;
+
+    (void) arg;
+    if (i < 0 || i >= KD_A_BOXES || j < 0 || j >= KD_B_BOXES ||
+	memcmp(a_size, a_boxes[i], sizeof(kd_box)) ||
+	memcmp(b_size, b_boxes[j], sizeof(kd_box)) || num_found >= max_found) {
+	bad_pair = 1;
+	return 1;
+    }
+    found[num_found++] = i * KD_B_BOXES + j;
+    return num_found >= limit;
+}
+
+static int cmp_pair(const void *x, const void *y)
+{
+    long a = *(const long *) x, b = *(const long *) y;
+
+    return (a > b) - (a < b);
+}
+
+static int check_join(const char *name, kd_tree a, kd_tree b)
+{
+    num_found = 0;
+    bad_pair = 0;
+    limit = max_found + 1;
+    if (kd_join(a, b, record_pair, (kd_generic) 0) != KD_OK || bad_pair) {
+	fprintf(stderr, "[join] FAIL: %s: kd_join returned a bad pair\n", name);
+	return 1;
+    }
+    qsort(found, num_found, sizeof(long), cmp_pair);
+    if (num_found != num_expect ||
+	memcmp(found, expect, num_expect * sizeof(long))) {
+	fprintf(stderr, "[join] FAIL: %s: kd_join found %ld pairs,  expected %ld\n",
+		name, num_found, num_expect);
+	return 1;
+    }
+    if (num_expect > 1) {
+	num_found = 0;
+	limit = num_expect / 2;
+	if (kd_join(a, b, record_pair, (kd_generic) 0) != KD_STOPPED ||
+	    num_found != num_expect / 2) {
+	    fprintf(stderr, "[join] FAIL: %s: kd_join did not stop\n", name);
+	    return 1;
+	}
+    }
+    printf("[join] %s: kd_join matched a scan (%ld pairs)\n", name, num_expect);
+    return 0;
+}
+
+/* Pairs within layer B,  the lower item first */
+static void self_expected(void)
+{
+    int i, j;
+
+    num_expect = 0;
+    for (i = 0;  i < KD_B_BOXES;  i++) {
+	for (j = i + 1;  j < KD_B_BOXES;  j++) {
+	    if (BOXINTERSECT(b_boxes[i], b_boxes[j])) {
+		if (num_expect >= max_found) {
+		    max_found *= 2;
+		    expect = (long *) realloc(expect, max_found * sizeof(long));
+		    found = (long *) realloc(found, max_found * sizeof(long));
+		}
+		expect[num_expect++] = (long) i * KD_B_BOXES + j;
+	    }
+	}
+    }
+}
+
+static pthread_mutex_t self_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* kd_self_join function:  may be called from several threads */
+static int record_self(kd_generic a, kd_box a_size, kd_generic b, kd_box b_size, kd_generic arg)
+{
+    long i = (long) a - 1, j = (long) b - 1, t;
+    int stop;
+
+    (void) arg;
+    pthread_mutex_lock(&self_lock);
+    if (i < 0 || i >= KD_B_BOXES || j < 0 || j >= KD_B_BOXES || i == j ||
+	memcmp(a_size, b_boxes[i], sizeof(kd_box)) ||
+	memcmp(b_size, b_boxes[j], sizeof(kd_box)) || num_found >= max_found) {
+	bad_pair = 1;
+	pthread_mutex_unlock(&self_lock);
+	return 1;
+    }
+    if (i > j) {
+	t = i;  i = j;  j = t;
+    }
+    found[num_found++] = i * KD_B_BOXES + j;
+    stop = num_found >= limit;
+    pthread_mutex_unlock(&self_lock);
+    return stop;
+}
+
+static int check_self(const char *name, kd_tree tree, int nthreads)
+{
+    kd_status status;
+
+    num_found = 0;
+    bad_pair = 0;
+    limit = max_found + 1;
+    status = (nthreads > 1) ?
+	kd_self_join_parallel(tree, record_self, (kd_generic) 0, nthreads) :
+	kd_self_join(tree, record_self, (kd_generic) 0);
+    if (status != KD_OK || bad_pair) {
+	fprintf(stderr, "[join] FAIL: %s: kd_self_join returned a bad pair\n", name);
+	return 1;
+    }
+    qsort(found, num_found, sizeof(long), cmp_pair);
+    if (num_found != num_expect ||
+	memcmp(found, expect, num_expect * sizeof(long))) {
+	fprintf(stderr, "[join] FAIL: %s: kd_self_join found %ld pairs,  expected %ld\n",
+		name, num_found, num_expect);
+	return 1;
+    }
+    if (num_expect > 1) {
+	num_found = 0;
+	limit = num_expect / 2;
+	status = (nthreads > 1) ?
+	    kd_self_join_parallel(tree, record_self, (kd_generic) 0, nthreads) :
+	    kd_self_join(tree, record_self, (kd_generic) 0);
+	/* Other threads may each finish the pair they were reporting */
+	if (status != KD_STOPPED || num_found < num_expect / 2 ||
+	    num_found >= num_expect / 2 + nthreads) {
+	    fprintf(stderr, "[join] FAIL: %s: kd_self_join did not stop\n", name);
+	    return 1;
+	}
+    }
+    printf("[join] %s: kd_self_join matched a scan (%ld pairs)\n", name, num_expect);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    kd_tree a, b, fa, fb, empty;
+    int i;
+
+    (void)argc; (void)argv;
+    for (i = 0;  i < KD_A_BOXES;  i++) {
+	rand_box(a_boxes[i]);
+	a_items[i] = (kd_generic) (long) (i+1);
+	a_live[i] = 1;
+    }
+    for (i = 0;  i < KD_B_BOXES;  i++) {
+	rand_box(b_boxes[i]);
+	b_items[i] = (kd_generic) (long) (i+1);
+    }
+    max_found = 1024;
+    expect = (long *) malloc(max_found * sizeof(long));
+    found = (long *) malloc(max_found * sizeof(long));
+    expected();
+    qsort(expect, num_expect, sizeof(long), cmp_pair);
+
+    /* A built in one go,  B one insert at a time:  trees of other shapes */
+    a = kd_build_from_arrays((const kd_box *) a_boxes, a_items, KD_A_BOXES);
+    b = kd_create();
+    for (i = 0;  i < KD_B_BOXES;  i++) kd_insert(b, b_items[i], b_boxes[i], (kd_generic) 0);
+    if (check_join("pointer trees", a, b)) return 1;
+
+    fa = kd_freeze(a);
+    fb = kd_freeze_buckets(b, 16);
+    if (check_join("frozen with bucketed", fa, fb) ||
+	check_join("pointer with bucketed", a, fb)) return 1;
+    kd_destroy(fa, NULL);
+    fa = kd_freeze_buckets(a, 5);
+    if (check_join("bucketed with pointer", fa, b) ||
+	check_join("bucketed trees", fa, fb)) return 1;
+    kd_destroy(fa, NULL);
+    kd_destroy(fb, NULL);
+
+    /* Deleted items drop out of the join */
+    for (i = 0;  i < KD_A_BOXES;  i += 3) {
+	if (kd_delete(a, a_items[i], a_boxes[i]) != KD_OK) {
+	    fprintf(stderr, "[join] FAIL: could not delete item %d\n", i);
+	    return 1;
+	}
+	a_live[i] = 0;
+    }
+    expected();
+    qsort(expect, num_expect, sizeof(long), cmp_pair);
+    if (check_join("after deletes", a, b)) return 1;
+    fa = kd_freeze_buckets(a, 8);
+    if (check_join("after deletes,  bucketed", fa, b)) return 1;
+    kd_destroy(fa, NULL);
+
+    /* Pairs within one tree */
+    self_expected();
+    qsort(expect, num_expect, sizeof(long), cmp_pair);
+    fb = kd_freeze_buckets(b, 16);
+    if (check_self("pointer tree", b, 1) || check_self("bucketed tree", fb, 1) ||
+	check_self("pointer tree,  4 threads", b, 4) ||
+	check_self("bucketed tree,  3 threads", fb, 3)) return 1;
+    kd_destroy(fb, NULL);
+
+    empty = kd_create();
+    num_found = 0;
+    if (kd_join(a, empty, record_pair, (kd_generic) 0) != KD_OK ||
+	kd_join(empty, b, record_pair, (kd_generic) 0) != KD_OK ||
+	kd_self_join(empty, record_pair, (kd_generic) 0) != KD_OK ||
+	kd_self_join_parallel(empty, record_pair, (kd_generic) 0, 4) != KD_OK || num_found) {
+	fprintf(stderr, "[join] FAIL: join with an empty tree found pairs\n");
+	return 1;
+    }
+    kd_destroy(empty, NULL);
+    kd_destroy(a, NULL);
+    kd_destroy(b, NULL);
+    free(expect);
+    free(found);
+
+    printf("[join] All join checks passed. PASS\n");
+    return 0;
+}
@@ -3,7 +3,13 @@
  *
  * Builds a tree of random boxes, then for several random query points,
  * finds the m nearest neighbors and verifies the results against a
- * brute-force linear scan.
+ * brute-force linear scan.  kd_nearest_best_first is checked the same
+ * way for m up to more than the tree holds, on frozen and bucketed
+ * copies too, kd_nearest_metric for each metric, kd_nearest_filtered
+ * with a filter on the items, and kd_within_distance, about points
+ * and boxes.
+ * The kd_nearest_start walk must give every item in distance order,
+ * and kd_nearest_batch the same lists as kd_nearest, on 1 or 3 threads.
  * Returns 0 on success, non-zero on failure.
  */
 
@@ -101,6 +107,372 @@ static int cmp_double(const void *a, const void *b)
     return 0;
 }
 
+#define BEST_QUERIES	20
+
+static double brute[KD_BOXES];
+
+/*
+ * kd_nearest_best_first against the scan:  the m nearest distances
+ * exactly,  each entry the distance of its own item,  no item twice,
+ * and empty slots past the last item.
+ */
+static int check_best_first(const char *name, kd_tree tree)
+{
+    static const int ms[] = { 1, 10, 100, 1000, KD_BOXES + 5 };
+    static char seen[KD_BOXES];
+    kd_priority *list;
+    int i, k, q, m, n, qx, qy;
+    long item;
+
+    for (k = 0;  k < (int) (sizeof(ms) / sizeof(ms[0]));  k++) {
+	m = ms[k];
+	n = m < KD_BOXES ? m : KD_BOXES;
+	for (q = 0;  q < BEST_QUERIES;  q++) {
+	    qx = (random() % RANGE_SPAN) + MIN_RANGE;
+	    qy = (random() % RANGE_SPAN) + MIN_RANGE;
+	    for (i = 0;  i < KD_BOXES;  i++) brute[i] = box_dist(qx, qy, boxes[i]);
+	    qsort(brute, KD_BOXES, sizeof(double), cmp_double);
+	    memset(seen, 0, sizeof(seen));
+
+	    (void) kd_nearest_best_first(tree, qx, qy, m, &list);
+	    for (i = 0;  i < n;  i++) {
+		item = (long) list[i].elem - 1;
+		if (item < 0 || item >= KD_BOXES || seen[item] ||
+		    fabs(list[i].dist - brute[i]) > 1e-6 ||
+		    fabs(list[i].dist - box_dist(qx, qy, boxes[item])) > 1e-6) {
+		    fprintf(stderr, "[nearest] FAIL: %s: best first m=%d entry %d is wrong "
+			    "(dist=%g, brute=%g)\n", name, m, i, list[i].dist, brute[i]);
+		    free(list);
+		    return 1;
+		}
+		seen[item] = 1;
+	    }
+	    for (;  i < m;  i++) {
+		if (list[i].elem) {
+		    fprintf(stderr, "[nearest] FAIL: %s: best first filled slot %d of %d items\n",
+			    name, i, KD_BOXES);
+		    free(list);
+		    return 1;
+		}
+	    }
+	    free(list);
+	}
+	printf("[nearest] %s: best first m=%d: %d queries passed\n", name, m, BEST_QUERIES);
+    }
+    return 0;
+}
+
+/* The distance kd_nearest_metric should give from (qx, qy) to `box' */
+static double metric_dist(int metric, int qx, int qy, kd_box box)
+{
+    double dx = 0.0, dy = 0.0;
+
+    if (metric == KD_CENTROID) {
+	dx = (box[KD_LEFT] + (double) box[KD_RIGHT]) / 2.0 - qx;
+	dy = (box[KD_BOTTOM] + (double) box[KD_TOP]) / 2.0 - qy;
+	return sqrt(dx*dx + dy*dy);
+    }
+    if (qx < box[KD_LEFT]) dx = box[KD_LEFT] - qx;
+    else if (qx > box[KD_RIGHT]) dx = qx - box[KD_RIGHT];
+    if (qy < box[KD_BOTTOM]) dy = box[KD_BOTTOM] - qy;
+    else if (qy > box[KD_TOP]) dy = qy - box[KD_TOP];
+    switch (metric) {
+    case KD_MANHATTAN: return dx + dy;
+    case KD_CHEBYSHEV: return dx > dy ? dx : dy;
+    default: return sqrt(dx*dx + dy*dy);
+    }
+}
+
+/* kd_nearest_metric against the scan,  for each metric */
+static int check_metric(const char *name, kd_tree tree)
+{
+    static const char *names[] = { "euclidean", "manhattan", "chebyshev", "centroid" };
+    static const int ms[] = { 1, 10, 300 };
+    static char seen[KD_BOXES];
+    kd_priority *list;
+    int i, k, q, m, metric, qx, qy;
+    long item;
+
+    for (metric = KD_EUCLIDEAN;  metric <= KD_CENTROID;  metric++) {
+	for (k = 0;  k < (int) (sizeof(ms) / sizeof(ms[0]));  k++) {
+	    m = ms[k];
+	    for (q = 0;  q < BEST_QUERIES;  q++) {
+		qx = (random() % RANGE_SPAN) + MIN_RANGE;
+		qy = (random() % RANGE_SPAN) + MIN_RANGE;
+		for (i = 0;  i < KD_BOXES;  i++) brute[i] = metric_dist(metric, qx, qy, boxes[i]);
+		qsort(brute, KD_BOXES, sizeof(double), cmp_double);
+		memset(seen, 0, sizeof(seen));
+
+		(void) kd_nearest_metric(tree, qx, qy, m, metric, &list);
+		for (i = 0;  i < m;  i++) {
+		    item = (long) list[i].elem - 1;
+		    if (item < 0 || item >= KD_BOXES || seen[item] ||
+			fabs(list[i].dist - brute[i]) > 1e-6 ||
+			fabs(list[i].dist - metric_dist(metric, qx, qy, boxes[item])) > 1e-6) {
+			fprintf(stderr, "[nearest] FAIL: %s: %s m=%d entry %d is wrong "
+				"(dist=%g, brute=%g)\n", name, names[metric], m, i,
+				list[i].dist, brute[i]);
+			free(list);
+			return 1;
+		    }
+		    seen[item] = 1;
+		}
+		free(list);
+	    }
+	}
+	printf("[nearest] %s: %s metric: %d queries passed\n", name, names[metric],
+	       BEST_QUERIES * (int) (sizeof(ms) / sizeof(ms[0])));
+    }
+    if (kd_nearest_metric(tree, 0, 0, 5, KD_CENTROID + 1, &list) != KD_BADARG || list ||
+	kd_nearest_metric(tree, 0, 0, 5, -1, &list) != KD_BADARG || list) {
+	fprintf(stderr, "[nearest] FAIL: %s: kd_nearest_metric took a bad metric\n", name);
+	return 1;
+    }
+    return 0;
+}
+
+#define FILTER_EVERY	7
+
+static int filter_calls;
+
+/* kd_nearest_filtered filter:  one item in FILTER_EVERY,  none if arg is set */
+static int pick_item(kd_generic item, kd_box size, kd_generic arg)
+{
+    long i = (long) item - 1;
+
+    filter_calls++;
+    if (i < 0 || i >= KD_BOXES || memcmp(size, boxes[i], sizeof(kd_box))) return 0;
+    return !arg && i % FILTER_EVERY == 0;
+}
+
+/*
+ * kd_nearest_filtered against a scan of the items the filter takes:
+ * the m nearest of those,  and empty slots when there are too few.
+ */
+static int check_filtered(const char *name, kd_tree tree)
+{
+    static const int ms[] = { 1, 10, 100 };
+    kd_priority *list;
+    int i, k, q, m, n, qx, qy;
+    long item;
+
+    for (k = 0;  k < (int) (sizeof(ms) / sizeof(ms[0]));  k++) {
+	m = ms[k];
+	for (q = 0;  q < BEST_QUERIES;  q++) {
+	    qx = (random() % RANGE_SPAN) + MIN_RANGE;
+	    qy = (random() % RANGE_SPAN) + MIN_RANGE;
+	    for (n = 0, i = 0;  i < KD_BOXES;  i += FILTER_EVERY)
+		brute[n++] = box_dist(qx, qy, boxes[i]);
+	    qsort(brute, n, sizeof(double), cmp_double);
+
+	    (void) kd_nearest_filtered(tree, qx, qy, m, pick_item, (kd_generic) 0, &list);
+	    for (i = 0;  i < m;  i++) {
+		item = (long) list[i].elem - 1;
+		if (item < 0 || item % FILTER_EVERY ||
+		    fabs(list[i].dist - brute[i]) > 1e-6 ||
+		    fabs(list[i].dist - box_dist(qx, qy, boxes[item])) > 1e-6 ||
+		    (i > 0 && list[i].elem == list[i-1].elem)) {
+		    fprintf(stderr, "[nearest] FAIL: %s: filtered m=%d entry %d is wrong "
+			    "(dist=%g, brute=%g)\n", name, m, i, list[i].dist, brute[i]);
+		    free(list);
+		    return 1;
+		}
+	    }
+	    free(list);
+	}
+	printf("[nearest] %s: filtered m=%d: %d queries passed\n", name, m, BEST_QUERIES);
+    }
+
+    /* A filter that takes nothing leaves the list empty */
+    filter_calls = 0;
+    (void) kd_nearest_filtered(tree, 0, 0, 5, pick_item, (kd_generic) 1, &list);
+    for (i = 0;  i < 5;  i++) {
+	if (list[i].elem) {
+	    fprintf(stderr, "[nearest] FAIL: %s: filtered list holds a refused item\n", name);
+	    free(list);
+	    return 1;
+	}
+    }
+    free(list);
+    if (filter_calls != KD_BOXES) {
+	fprintf(stderr, "[nearest] FAIL: %s: filter asked %d times of %d items\n",
+		name, filter_calls, KD_BOXES);
+	return 1;
+    }
+    return 0;
+}
+
+/* Edge to edge distance between two boxes */
+static double boxes_dist(kd_box a, kd_box b)
+{
+    double dx = 0.0, dy = 0.0;
+
+    if (a[KD_RIGHT] < b[KD_LEFT]) dx = b[KD_LEFT] - a[KD_RIGHT];
+    else if (b[KD_RIGHT] < a[KD_LEFT]) dx = a[KD_LEFT] - b[KD_RIGHT];
+    if (a[KD_TOP] < b[KD_BOTTOM]) dy = b[KD_BOTTOM] - a[KD_TOP];
+    else if (b[KD_TOP] < a[KD_BOTTOM]) dy = a[KD_BOTTOM] - b[KD_TOP];
+    return sqrt(dx*dx + dy*dy);
+}
+
+/* kd_within_distance visitor:  marks items,  stopping after `limit' */
+static char marked[KD_BOXES];
+static int num_marked, mark_limit, bad_mark;
+
+static int mark_item(kd_generic item, kd_box size, kd_generic arg)
+{
+    long i = (long) item - 1;
+
+    (void) arg;
+    if (i < 0 || i >= KD_BOXES || marked[i] ||
+	memcmp(size, boxes[i], sizeof(kd_box))) bad_mark = 1;
+    else marked[i] = 1;
+    return ++num_marked >= mark_limit;
+}
+
+/*
+ * kd_within_distance and kd_within_distance_box against the scan,
+ * for radii from nothing to the whole space.
+ */
+static int check_within(const char *name, kd_tree tree)
+{
+    static const double radii[] = { 0.0, 500.0, 3000.0, 20000.5, 400000.0 };
+    kd_box area;
+    kd_status status;
+    int i, k, q, n;
+
+    for (k = 0;  k < (int) (sizeof(radii) / sizeof(radii[0]));  k++) {
+	for (q = 0;  q < BEST_QUERIES;  q++) {
+	    /* Even queries about a point,  odd ones about a box */
+	    rand_box(area);
+	    if (q % 2 == 0) {
+		area[KD_RIGHT] = area[KD_LEFT];
+		area[KD_TOP] = area[KD_BOTTOM];
+	    }
+	    memset(marked, 0, sizeof(marked));
+	    num_marked = bad_mark = 0;
+	    mark_limit = KD_BOXES + 1;
+	    status = (q % 2 == 0) ?
+		kd_within_distance(tree, area[KD_LEFT], area[KD_BOTTOM], radii[k],
+				   mark_item, (kd_generic) 0) :
+		kd_within_distance_box(tree, area, radii[k], mark_item, (kd_generic) 0);
+	    if (status != KD_OK || bad_mark) {
+		fprintf(stderr, "[nearest] FAIL: %s: kd_within_distance returned a bad item\n", name);
+		return 1;
+	    }
+	    for (i = n = 0;  i < KD_BOXES;  i++) {
+		if ((boxes_dist(area, boxes[i]) <= radii[k]) != marked[i]) {
+		    fprintf(stderr, "[nearest] FAIL: %s: kd_within_distance r=%g got item %d wrong "
+			    "(dist=%g)\n", name, radii[k], i, boxes_dist(area, boxes[i]));
+		    return 1;
+		}
+		n += marked[i];
+	    }
+	    if (n > 1) {
+		memset(marked, 0, sizeof(marked));
+		num_marked = 0;
+		mark_limit = n / 2;
+		if (kd_within_distance_box(tree, area, radii[k], mark_item, (kd_generic) 0)
+		    != KD_STOPPED || num_marked != n / 2) {
+		    fprintf(stderr, "[nearest] FAIL: %s: kd_within_distance did not stop\n", name);
+		    return 1;
+		}
+	    }
+	}
+	printf("[nearest] %s: within r=%g: %d queries passed\n", name, radii[k], BEST_QUERIES);
+    }
+    return 0;
+}
+
+/*
+ * kd_nearest_start/kd_nearest_next against the scan:  the items in
+ * order of distance,  each once,  all of them for the first few
+ * queries and a short walk,  cut off early,  for the rest.
+ */
+static int check_walk(const char *name, kd_tree tree)
+{
+    static char seen[KD_BOXES];
+    kd_near_gen gen;
+    kd_generic item;
+    double dist;
+    int i, q, n, qx, qy;
+    long idx;
+
+    for (q = 0;  q < BEST_QUERIES;  q++) {
+	qx = (random() % RANGE_SPAN) + MIN_RANGE;
+	qy = (random() % RANGE_SPAN) + MIN_RANGE;
+	for (i = 0;  i < KD_BOXES;  i++) brute[i] = box_dist(qx, qy, boxes[i]);
+	qsort(brute, KD_BOXES, sizeof(double), cmp_double);
+	memset(seen, 0, sizeof(seen));
+	n = (q < 3) ? KD_BOXES : 50;
+
+	gen = kd_nearest_start(tree, qx, qy);
+	for (i = 0;  i < n && kd_nearest_next(gen, &item, &dist) == KD_OK;  i++) {
+	    idx = (long) item - 1;
+	    if (idx < 0 || idx >= KD_BOXES || seen[idx] || fabs(dist - brute[i]) > 1e-6 ||
+		fabs(dist - box_dist(qx, qy, boxes[idx])) > 1e-6) {
+		fprintf(stderr, "[nearest] FAIL: %s: walk step %d is wrong (dist=%g, brute=%g)\n",
+			name, i, dist, brute[i]);
+		return 1;
+	    }
+	    seen[idx] = 1;
+	}
+	if (i < n || (n == KD_BOXES && kd_nearest_next(gen, &item, (double *) 0) != KD_NOMORE)) {
+	    fprintf(stderr, "[nearest] FAIL: %s: walk gave %d items, expected %d\n", name, i, n);
+	    return 1;
+	}
+	(void) kd_nearest_finish(gen);
+    }
+    printf("[nearest] %s: nearest walk: %d queries passed\n", name, BEST_QUERIES);
+    return 0;
+}
+
+#define BATCH_QUERIES	1000
+
+/*
+ * kd_nearest_batch against kd_nearest,  query by query:  the same
+ * distances,  each entry the distance of its own item.  Some points
+ * repeat,  and the rest are spread over the whole space.
+ */
+static int check_batch(const char *name, kd_tree tree, int m, int nthreads)
+{
+    static int xy[2 * BATCH_QUERIES];
+    kd_priority *out, *list;
+    long idx;
+    int i, q;
+
+    for (q = 0;  q < BATCH_QUERIES;  q++) {
+	if (q % 10 == 9) {
+	    xy[2*q] = xy[2*q-2];
+	    xy[2*q+1] = xy[2*q-1];
+	} else {
+	    xy[2*q] = (random() % RANGE_SPAN) + MIN_RANGE;
+	    xy[2*q+1] = (random() % RANGE_SPAN) + MIN_RANGE;
+	}
+    }
+    out = (kd_priority *) malloc(BATCH_QUERIES * m * sizeof(kd_priority));
+    if (kd_nearest_batch(tree, xy, BATCH_QUERIES, m, out, nthreads) != KD_OK) {
+	fprintf(stderr, "[nearest] FAIL: %s: kd_nearest_batch failed\n", name);
+	return 1;
+    }
+    for (q = 0;  q < BATCH_QUERIES;  q++) {
+	(void) kd_nearest(tree, xy[2*q], xy[2*q+1], m, &list);
+	for (i = 0;  i < m;  i++) {
+	    idx = (long) out[q*m+i].elem - 1;
+	    if (out[q*m+i].dist != list[i].dist || idx < 0 || idx >= KD_BOXES ||
+		fabs(out[q*m+i].dist - box_dist(xy[2*q], xy[2*q+1], boxes[idx])) > 1e-6) {
+		fprintf(stderr, "[nearest] FAIL: %s: batch query %d entry %d is wrong "
+			"(dist=%g, kd_nearest=%g)\n", name, q, i, out[q*m+i].dist, list[i].dist);
+		return 1;
+	    }
+	}
+	free(list);
+    }
+    free(out);
+    printf("[nearest] %s: batch of %d, m=%d, %d threads passed\n",
+	   name, BATCH_QUERIES, m, nthreads);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     kd_tree tree;
@@ -172,6 +544,56 @@ int main(int argc, char **argv)
 	printf("[nearest] Edge case (point inside box): PASS\n");
     }
 
+    /* Best first, fixed radius, walks and batches, on each kind of tree, and on an empty one */
+    {
+	kd_tree frozen, empty;
+
+	if (check_best_first("pointer tree", tree) || check_metric("pointer tree", tree) ||
+	    check_filtered("pointer tree", tree) ||
+	    check_within("pointer tree", tree) ||
+	    check_walk("pointer tree", tree) || check_batch("pointer tree", tree, 5, 1) ||
+	    check_batch("pointer tree", tree, 16, 3)) return 1;
+	frozen = kd_freeze(tree);
+	if (check_best_first("frozen tree", frozen) || check_metric("frozen tree", frozen) ||
+	    check_filtered("frozen tree", frozen) ||
+	    check_within("frozen tree", frozen) ||
+	    check_walk("frozen tree", frozen) || check_batch("frozen tree", frozen, 16, 3)) return 1;
+	kd_destroy(frozen, NULL);
+	frozen = kd_freeze_buckets(tree, 16);
+	if (check_best_first("bucketed tree", frozen) || check_metric("bucketed tree", frozen) ||
+	    check_filtered("bucketed tree", frozen) ||
+	    check_within("bucketed tree", frozen) ||
+	    check_walk("bucketed tree", frozen) || check_batch("bucketed tree", frozen, 5, 3))
+	    return 1;
+	kd_destroy(frozen, NULL);
+	empty = kd_create();
+	(void) kd_nearest_best_first(empty, 0, 0, 3, &list);
+	if (list[0].elem || list[2].elem) {
+	    fprintf(stderr, "[nearest] FAIL: best first found items in an empty tree\n");
+	    free(list);
+	    return 1;
+	}
+	free(list);
+	num_marked = 0;
+	mark_limit = 1;
+	if (kd_within_distance(empty, 0, 0, 1000.0, mark_item, (kd_generic) 0) != KD_OK ||
+	    num_marked) {
+	    fprintf(stderr, "[nearest] FAIL: within distance found items in an empty tree\n");
+	    return 1;
+	}
+	{
+	    kd_near_gen gen = kd_nearest_start(empty, 0, 0);
+	    kd_generic item;
+
+	    if (kd_nearest_next(gen, &item, (double *) 0) != KD_NOMORE) {
+		fprintf(stderr, "[nearest] FAIL: nearest walk found items in an empty tree\n");
+		return 1;
+	    }
+	    (void) kd_nearest_finish(gen);
+	}
+	kd_destroy(empty, NULL);
+    }
+
     printf("[nearest] All tests passed. PASS\n");
     kd_destroy(tree, NULL);
 
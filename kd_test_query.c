@@ -0,0 +1,786 @@
+/*
+ * K-d tree test: query entry points
+ *
+ * Builds a tree of random boxes and checks the other ways of asking
+ * it for the items in a region against kd_start/kd_next,  on the
+ * tree itself and on frozen copies of it (with and without leaf
+ * buckets).  kd_next itself,  and the stricter kd_start_mode tests,
+ * are checked against a linear scan.  Last,  several threads read
+ * each tree at once.
+ * Returns 0 on success, non-zero on failure.
+ */
+
+#define _DEFAULT_SOURCE		/* random() and srandom() */
+#include "kd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#define random() rand()
+#define srandom(x) srand(x)
+#endif
+
+#define KD_BOXES	100000
+#define KD_REGIONS      300
+
+#define MIN_RANGE	-100000
+#define MAX_RANGE	100000
+#define RANGE_SPAN	(MAX_RANGE - MIN_RANGE + 1)
+#define BOX_RANGE	1000
+#define REGION_RANGE	20000
+
+static kd_box boxes[KD_BOXES];
+static kd_generic items[KD_BOXES];
+static kd_box regions[KD_REGIONS];
+static char live[KD_BOXES];
+
+#define BOXINTERSECT(b1, b2) \
+  (((b1)[KD_RIGHT] >= (b2)[KD_LEFT]) && \
+   ((b2)[KD_RIGHT] >= (b1)[KD_LEFT]) && \
+   ((b1)[KD_TOP] >= (b2)[KD_BOTTOM]) && \
+   ((b2)[KD_TOP] >= (b1)[KD_BOTTOM]))
+
+static void rand_box(kd_box box, int span)
+{
+    static int init = 0;
+
+    if (!init) {
+	(void) srandom((int) time(NULL));
+	init = 1;
+    }
+
+    box[KD_LEFT] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_BOTTOM] = (random() % RANGE_SPAN) + MIN_RANGE;
+    box[KD_RIGHT] = box[KD_LEFT] + (random() % span);
+    box[KD_TOP] = box[KD_BOTTOM] + (random() % span);
+}
+
+/*
+ * Items found for each region by the generator,  one run per region:
+ * region r found expect[first[r]] .. expect[first[r+1]-1].
+ */
+static kd_generic *expect;
+static int first[KD_REGIONS+1];
+
+static void expected(kd_tree tree)
+{
+    kd_gen gen;
+    kd_generic item;
+    int r, n = 0, size = 1024;
+
+    expect = (kd_generic *) malloc(size * sizeof(kd_generic));
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	first[r] = n;
+	gen = kd_start(tree, regions[r]);
+	while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) {
+	    if (n >= size) {
+		size *= 2;
+		expect = (kd_generic *) realloc(expect, size * sizeof(kd_generic));
+	    }
+	    expect[n++] = item;
+	}
+	kd_finish(gen);
+    }
+    first[KD_REGIONS] = n;
+}
+
+/*
+ * The generator itself against a linear scan of the live boxes:  each
+ * run must hold every box touching its region,  and nothing else.
+ */
+static int check_expected(const char *name)
+{
+    static int seen[KD_BOXES];
+    static int stamp = 0;
+    long idx;
+    int r, j, k, n;
+
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	stamp++;
+	for (k = first[r];  k < first[r+1];  k++) {
+	    idx = (long) expect[k] - 1;
+	    if (!live[idx] || !BOXINTERSECT(regions[r], boxes[idx]) || seen[idx] == stamp) {
+		fprintf(stderr, "[query] FAIL: %s: kd_next returned a wrong item\n", name);
+		return 1;
+	    }
+	    seen[idx] = stamp;
+	}
+	for (j = n = 0;  j < KD_BOXES;  j++)
+	    if (live[j] && BOXINTERSECT(regions[r], boxes[j])) n++;
+	if (n != first[r+1] - first[r]) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_next missed items\n", name);
+	    return 1;
+	}
+    }
+    printf("[query] %s: kd_next matched a scan in %d regions\n", name, KD_REGIONS);
+    return 0;
+}
+
+/* Hits reported by kd_query_batch,  in the order reported */
+typedef struct {
+    int region;
+    kd_generic item;
+} hit;
+
+static hit *hits;
+static int num_hits, max_hits;
+static int bad_size;
+
+static void record_hit(int region, kd_generic item, kd_box size, kd_generic arg)
+{
+    long i = (long) item - 1;
+
+    (void) arg;
+    if (size[KD_LEFT] != boxes[i][KD_LEFT] || size[KD_BOTTOM] != boxes[i][KD_BOTTOM] ||
+	size[KD_RIGHT] != boxes[i][KD_RIGHT] || size[KD_TOP] != boxes[i][KD_TOP])
+	bad_size = 1;
+    if (num_hits >= max_hits) {
+	max_hits = max_hits ? 2 * max_hits : 1024;
+	hits = (hit *) realloc(hits, max_hits * sizeof(hit));
+    }
+    hits[num_hits].region = region;
+    hits[num_hits].item = item;
+    num_hits++;
+}
+
+/* Every region got exactly the generator's items,  in its order */
+static int check_batch(const char *name, kd_tree tree)
+{
+    int next[KD_REGIONS];
+    int r, i;
+
+    num_hits = 0;
+    bad_size = 0;
+    if (kd_query_batch(tree, (const kd_box *) regions, KD_REGIONS,
+		       record_hit, (kd_generic) 0) != KD_OK) {
+	fprintf(stderr, "[query] FAIL: %s: kd_query_batch failed\n", name);
+	return 1;
+    }
+    if (bad_size) {
+	fprintf(stderr, "[query] FAIL: %s: wrong size passed to callback\n", name);
+	return 1;
+    }
+    if (num_hits != first[KD_REGIONS]) {
+	fprintf(stderr, "[query] FAIL: %s: %d hits, expected %d\n",
+		name, num_hits, first[KD_REGIONS]);
+	return 1;
+    }
+    for (r = 0;  r < KD_REGIONS;  r++) next[r] = first[r];
+    for (i = 0;  i < num_hits;  i++) {
+	r = hits[i].region;
+	if (r < 0 || r >= KD_REGIONS || next[r] >= first[r+1] ||
+	    expect[next[r]] != hits[i].item) {
+	    fprintf(stderr, "[query] FAIL: %s: hit %d differs from kd_next\n", name, i);
+	    return 1;
+	}
+	next[r]++;
+    }
+    printf("[query] %s: kd_query_batch matched %d hits in %d regions\n",
+	   name, num_hits, KD_REGIONS);
+    return 0;
+}
+
+/* kd_search() visitor:  collects items,  stopping after `limit' */
+typedef struct {
+    kd_generic *found;
+    int num_found;
+    int limit;
+} visit;
+
+static int collect(kd_generic item, kd_box size, kd_generic arg)
+{
+    visit *v = (visit *) arg;
+
+    v->found[v->num_found++] = item;
+    /* The box is a copy:  scribbling on it must not harm the tree */
+    size[KD_LEFT] = size[KD_BOTTOM] = size[KD_RIGHT] = size[KD_TOP] = 0;
+    return v->num_found >= v->limit;
+}
+
+/* kd_search() finds the generator's items,  and stops when told to */
+static int check_search(const char *name, kd_tree tree)
+{
+    visit v;
+    int r, i, n;
+
+    v.found = (kd_generic *) malloc((first[KD_REGIONS] + 1) * sizeof(kd_generic));
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	n = first[r+1] - first[r];
+	v.num_found = 0;
+	v.limit = KD_BOXES + 1;
+	if (kd_search(tree, regions[r], collect, (kd_generic) &v) != KD_OK ||
+	    v.num_found != n) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_search found %d items, expected %d\n",
+		    name, v.num_found, n);
+	    return 1;
+	}
+	for (i = 0;  i < n;  i++) {
+	    if (v.found[i] != expect[first[r] + i]) {
+		fprintf(stderr, "[query] FAIL: %s: kd_search order differs\n", name);
+		return 1;
+	    }
+	}
+	if (n > 1) {
+	    v.num_found = 0;
+	    v.limit = n / 2;
+	    if (kd_search(tree, regions[r], collect, (kd_generic) &v) != KD_STOPPED ||
+		v.num_found != n / 2) {
+		fprintf(stderr, "[query] FAIL: %s: kd_search did not stop\n", name);
+		return 1;
+	    }
+	}
+    }
+    free(v.found);
+    printf("[query] %s: kd_search matched %d regions\n", name, KD_REGIONS);
+    return 0;
+}
+
+static int cmp_item(const void *x, const void *y)
+{
+    long a = (long) *(const kd_generic *) x, b = (long) *(const kd_generic *) y;
+
+    return (a > b) - (a < b);
+}
+
+/*
+ * kd_search_parallel() finds the generator's items,  in any order,
+ * each thread into its own list,  and stops when told to.
+ */
+#define KD_SEARCHERS	3
+
+static int check_parallel(const char *name, kd_tree tree)
+{
+    visit v[KD_SEARCHERS];
+    kd_generic args[KD_SEARCHERS];
+    kd_generic *all, *want;
+    int r, i, j, n, total;
+
+    all = (kd_generic *) malloc(KD_SEARCHERS * (KD_BOXES + 1) * sizeof(kd_generic));
+    want = (kd_generic *) malloc((KD_BOXES + 1) * sizeof(kd_generic));
+    for (j = 0;  j < KD_SEARCHERS;  j++) {
+	v[j].found = (kd_generic *) malloc((KD_BOXES + 1) * sizeof(kd_generic));
+	args[j] = (kd_generic) &v[j];
+    }
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	n = first[r+1] - first[r];
+	for (j = 0;  j < KD_SEARCHERS;  j++) {
+	    v[j].num_found = 0;
+	    v[j].limit = KD_BOXES + 1;
+	}
+	if (kd_search_parallel(tree, regions[r], collect, args, KD_SEARCHERS) != KD_OK) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_search_parallel stopped\n", name);
+	    return 1;
+	}
+	for (j = total = 0;  j < KD_SEARCHERS;  j++)
+	    for (i = 0;  i < v[j].num_found;  i++) all[total++] = v[j].found[i];
+	memcpy(want, &expect[first[r]], n * sizeof(kd_generic));
+	qsort(all, total, sizeof(kd_generic), cmp_item);
+	qsort(want, n, sizeof(kd_generic), cmp_item);
+	if (total != n || memcmp(all, want, n * sizeof(kd_generic))) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_search_parallel found other items\n", name);
+	    return 1;
+	}
+	if (n > KD_SEARCHERS) {
+	    for (j = 0;  j < KD_SEARCHERS;  j++) {
+		v[j].num_found = 0;
+		v[j].limit = 1;
+	    }
+	    /* Each thread may finish the item it was visiting */
+	    if (kd_search_parallel(tree, regions[r], collect, args, KD_SEARCHERS) != KD_STOPPED) total = -1;
+	    else for (j = total = 0;  j < KD_SEARCHERS;  j++) total += v[j].num_found;
+	    if (total < 1 || total > KD_SEARCHERS) {
+		fprintf(stderr, "[query] FAIL: %s: kd_search_parallel did not stop\n", name);
+		return 1;
+	    }
+	}
+    }
+    for (j = 0;  j < KD_SEARCHERS;  j++) free(v[j].found);
+    free(want);
+    free(all);
+    printf("[query] %s: kd_search_parallel matched %d regions\n", name, KD_REGIONS);
+    return 0;
+}
+
+/* One caller-owned generator,  reset for every region */
+static int check_gen_storage(const char *name, kd_tree tree)
+{
+    kd_gen_storage buf;
+    kd_gen gen;
+    kd_generic item;
+    int r, n;
+
+    gen = kd_gen_init(&buf, tree, regions[0]);
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	if (r > 0) kd_gen_reset(gen, regions[r]);
+	n = first[r];
+	while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) {
+	    if (n >= first[r+1] || expect[n] != item) {
+		fprintf(stderr, "[query] FAIL: %s: kd_gen_init generator differs\n", name);
+		return 1;
+	    }
+	    n++;
+	}
+	if (n != first[r+1]) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_gen_init generator stopped early\n", name);
+	    return 1;
+	}
+    }
+    (void) kd_finish(gen);
+    printf("[query] %s: kd_gen_init matched %d regions\n", name, KD_REGIONS);
+    return 0;
+}
+
+static int check_count(const char *name, kd_tree tree)
+{
+    static kd_box all = { MIN_RANGE-1, MIN_RANGE-1,
+			  MAX_RANGE+BOX_RANGE+1, MAX_RANGE+BOX_RANGE+1 };
+    int r;
+
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	if (kd_count_region(tree, regions[r]) != first[r+1] - first[r]) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_count_region gave %d,  expected %d\n",
+		    name, kd_count_region(tree, regions[r]), first[r+1] - first[r]);
+	    return 1;
+	}
+    }
+    if (kd_count_region(tree, all) != kd_count(tree)) {
+	fprintf(stderr, "[query] FAIL: %s: kd_count_region missed items\n", name);
+	return 1;
+    }
+    printf("[query] %s: kd_count_region matched %d regions\n", name, KD_REGIONS);
+    return 0;
+}
+
+/*
+ * kd_start_mode() against a linear scan of the live boxes.  The
+ * KD_CONTAINS areas are small corners of the regions,  so that some
+ * boxes can cover them.  One generator per mode is reset from region
+ * to region,  and must keep its mode.
+ */
+static int check_mode(const char *name, kd_tree tree, int mode)
+{
+    static const char *modes[] = { "KD_INTERSECTS", "KD_WITHIN", "KD_CONTAINS" };
+    static int seen[KD_BOXES];
+    static int stamp = 0;
+    kd_gen gen = (kd_gen) 0;
+    kd_generic item;
+    kd_box area, size;
+    long idx, tries, plain, total = 0;
+    int r, j, n, want, ok;
+
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	area[KD_LEFT] = regions[r][KD_LEFT];
+	area[KD_BOTTOM] = regions[r][KD_BOTTOM];
+	area[KD_RIGHT] = regions[r][KD_RIGHT];
+	area[KD_TOP] = regions[r][KD_TOP];
+	if (mode == KD_CONTAINS) {
+	    area[KD_RIGHT] = area[KD_LEFT] + r % (BOX_RANGE / 2);
+	    area[KD_TOP] = area[KD_BOTTOM] + r % (BOX_RANGE / 3);
+	}
+	if (r == 0) gen = kd_start_mode(tree, area, mode);
+	else kd_gen_reset(gen, area);
+	stamp++;
+	n = 0;
+	while (kd_next(gen, &item, size) == KD_OK) {
+	    idx = (long) item - 1;
+	    ok = (mode == KD_WITHIN) ?
+		(size[KD_LEFT] >= area[KD_LEFT] && size[KD_BOTTOM] >= area[KD_BOTTOM] &&
+		 size[KD_RIGHT] <= area[KD_RIGHT] && size[KD_TOP] <= area[KD_TOP]) :
+		(size[KD_LEFT] <= area[KD_LEFT] && size[KD_BOTTOM] <= area[KD_BOTTOM] &&
+		 size[KD_RIGHT] >= area[KD_RIGHT] && size[KD_TOP] >= area[KD_TOP]);
+	    if (!live[idx] || !ok || seen[idx] == stamp) {
+		fprintf(stderr, "[query] FAIL: %s: %s returned a wrong item\n", name, modes[mode]);
+		return 1;
+	    }
+	    seen[idx] = stamp;
+	    n++;
+	}
+	for (j = want = 0;  j < KD_BOXES;  j++) {
+	    if (!live[j]) continue;
+	    if (mode == KD_WITHIN ?
+		(boxes[j][KD_LEFT] >= area[KD_LEFT] && boxes[j][KD_BOTTOM] >= area[KD_BOTTOM] &&
+		 boxes[j][KD_RIGHT] <= area[KD_RIGHT] && boxes[j][KD_TOP] <= area[KD_TOP]) :
+		(boxes[j][KD_LEFT] <= area[KD_LEFT] && boxes[j][KD_BOTTOM] <= area[KD_BOTTOM] &&
+		 boxes[j][KD_RIGHT] >= area[KD_RIGHT] && boxes[j][KD_TOP] >= area[KD_TOP]))
+		want++;
+	}
+	if (n != want) {
+	    fprintf(stderr, "[query] FAIL: %s: %s found %d items,  expected %d\n",
+		    name, modes[mode], n, want);
+	    return 1;
+	}
+	total += n;
+    }
+    (void) kd_finish(gen);
+    /* Pruning by the stricter test never visits more than kd_start */
+    if (mode == KD_WITHIN) {
+	for (r = 0;  r < KD_REGIONS;  r++) {
+	    gen = kd_start_mode(tree, regions[r], KD_WITHIN);
+	    while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) ;
+	    tries = kd_finish(gen);
+	    gen = kd_start(tree, regions[r]);
+	    while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) ;
+	    plain = kd_finish(gen);
+	    if (tries > plain) {
+		fprintf(stderr, "[query] FAIL: %s: KD_WITHIN visited %ld nodes,  kd_start %ld\n",
+			name, tries, plain);
+		return 1;
+	    }
+	}
+    }
+    if (kd_start_mode(tree, regions[0], KD_CONTAINS + 1) ||
+	kd_start_mode(tree, regions[0], -1)) {
+	fprintf(stderr, "[query] FAIL: %s: kd_start_mode took a bad mode\n", name);
+	return 1;
+    }
+    printf("[query] %s: %s matched a scan in %d regions (%ld items)\n",
+	   name, modes[mode], KD_REGIONS, total);
+    return 0;
+}
+
+/*
+ * kd_stab() finds what kd_search() finds for a box of no area,  in
+ * the same order,  and what a scan of the live boxes finds.  Half
+ * the points are corners of boxes,  so that edges get hit.
+ */
+static int check_stab(const char *name, kd_tree tree)
+{
+    visit v, w;
+    kd_box point;
+    long total = 0;
+    int r, i, j, want;
+
+    v.found = (kd_generic *) malloc((KD_BOXES + 1) * sizeof(kd_generic));
+    w.found = (kd_generic *) malloc((KD_BOXES + 1) * sizeof(kd_generic));
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	j = (int) (random() % KD_BOXES);
+	if (r & 1) {
+	    point[KD_LEFT] = point[KD_RIGHT] = boxes[j][(r & 2) ? KD_LEFT : KD_RIGHT];
+	    point[KD_BOTTOM] = point[KD_TOP] = boxes[j][(r & 2) ? KD_BOTTOM : KD_TOP];
+	} else {
+	    point[KD_LEFT] = point[KD_RIGHT] = regions[r][KD_LEFT];
+	    point[KD_BOTTOM] = point[KD_TOP] = regions[r][KD_BOTTOM];
+	}
+	v.num_found = w.num_found = 0;
+	v.limit = w.limit = KD_BOXES + 1;
+	if (kd_stab(tree, point[KD_LEFT], point[KD_BOTTOM], collect, (kd_generic) &v) != KD_OK ||
+	    kd_search(tree, point, collect, (kd_generic) &w) != KD_OK ||
+	    v.num_found != w.num_found) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_stab found %d items,  kd_search %d\n",
+		    name, v.num_found, w.num_found);
+	    return 1;
+	}
+	for (i = 0;  i < v.num_found;  i++) {
+	    if (v.found[i] != w.found[i]) {
+		fprintf(stderr, "[query] FAIL: %s: kd_stab order differs\n", name);
+		return 1;
+	    }
+	}
+	for (j = want = 0;  j < KD_BOXES;  j++) {
+	    if (live[j] && BOXINTERSECT(point, boxes[j])) want++;
+	}
+	if (v.num_found != want) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_stab found %d items,  expected %d\n",
+		    name, v.num_found, want);
+	    return 1;
+	}
+	if (want > 1) {
+	    v.num_found = 0;
+	    v.limit = 1;
+	    if (kd_stab(tree, point[KD_LEFT], point[KD_BOTTOM], collect, (kd_generic) &v) != KD_STOPPED ||
+		v.num_found != 1) {
+		fprintf(stderr, "[query] FAIL: %s: kd_stab did not stop\n", name);
+		return 1;
+	    }
+	}
+	total += want;
+    }
+    free(v.found);
+    free(w.found);
+    printf("[query] %s: kd_stab matched %d points (%ld items)\n", name, KD_REGIONS, total);
+    return 0;
+}
+
+/* Does the segment (x0,y0) - (x1,y1) touch `box'?  Corners all on one side miss */
+static int seg_box(double x0, double y0, double x1, double y1, const int *box)
+{
+    double c[4];
+    int i;
+
+    if ((x0 < box[KD_LEFT] && x1 < box[KD_LEFT]) || (x0 > box[KD_RIGHT] && x1 > box[KD_RIGHT]) ||
+	(y0 < box[KD_BOTTOM] && y1 < box[KD_BOTTOM]) || (y0 > box[KD_TOP] && y1 > box[KD_TOP]))
+	return 0;
+    for (i = 0;  i < 4;  i++) {
+	c[i] = (x1 - x0) * (box[(i & 2) ? KD_TOP : KD_BOTTOM] - y0) -
+	    (y1 - y0) * (box[(i & 1) ? KD_RIGHT : KD_LEFT] - x0);
+    }
+    return !((c[0] > 0 && c[1] > 0 && c[2] > 0 && c[3] > 0) ||
+	     (c[0] < 0 && c[1] < 0 && c[2] < 0 && c[3] < 0));
+}
+
+/*
+ * kd_search_polyline() and kd_search_segment() against a scan of the
+ * live boxes.  The lines run between random points,  so most are long
+ * and slanted;  every tenth is a single point.
+ */
+static int check_line(const char *name, kd_tree tree)
+{
+    static int seen[KD_BOXES];
+    static int stamp = 0;
+    visit v, w;
+    int points[2 * 6];
+    long idx, total = 0;
+    int r, i, j, n, want;
+
+    v.found = (kd_generic *) malloc((KD_BOXES + 1) * sizeof(kd_generic));
+    w.found = (kd_generic *) malloc((KD_BOXES + 1) * sizeof(kd_generic));
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	n = (r % 10 == 0) ? 1 : 2 + r % 5;
+	for (i = 0;  i < 2 * n;  i++)
+	    points[i] = (random() % RANGE_SPAN) + MIN_RANGE;
+	v.num_found = 0;
+	v.limit = KD_BOXES + 1;
+	if (kd_search_polyline(tree, points, n, collect, (kd_generic) &v) != KD_OK) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_search_polyline stopped\n", name);
+	    return 1;
+	}
+	stamp++;
+	for (i = 0;  i < v.num_found;  i++) {
+	    idx = (long) v.found[i] - 1;
+	    for (j = 0;  j + 1 < n;  j++) {
+		if (seg_box(points[2*j], points[2*j+1], points[2*j+2], points[2*j+3], boxes[idx]))
+		    break;
+	    }
+	    if (!live[idx] || seen[idx] == stamp || (n > 1 && j + 1 >= n)) {
+		fprintf(stderr, "[query] FAIL: %s: kd_search_polyline returned a wrong item\n", name);
+		return 1;
+	    }
+	    seen[idx] = stamp;
+	}
+	for (idx = want = 0;  idx < KD_BOXES;  idx++) {
+	    if (!live[idx]) continue;
+	    for (j = 0;  j + 1 < n;  j++) {
+		if (seg_box(points[2*j], points[2*j+1], points[2*j+2], points[2*j+3], boxes[idx]))
+		    break;
+	    }
+	    if (n == 1 ? seg_box(points[0], points[1], points[0], points[1], boxes[idx]) : j + 1 < n)
+		want++;
+	}
+	if (v.num_found != want) {
+	    fprintf(stderr, "[query] FAIL: %s: kd_search_polyline found %d items,  expected %d\n",
+		    name, v.num_found, want);
+	    return 1;
+	}
+	if (n == 2) {
+	    w.num_found = 0;
+	    w.limit = KD_BOXES + 1;
+	    (void) kd_search_segment(tree, points[0], points[1], points[2], points[3],
+				     collect, (kd_generic) &w);
+	    if (w.num_found != v.num_found ||
+		memcmp(w.found, v.found, v.num_found * sizeof(kd_generic))) {
+		fprintf(stderr, "[query] FAIL: %s: kd_search_segment differs\n", name);
+		return 1;
+	    }
+	}
+	if (want > 1) {
+	    v.num_found = 0;
+	    v.limit = 1;
+	    if (kd_search_polyline(tree, points, n, collect, (kd_generic) &v) != KD_STOPPED ||
+		v.num_found != 1) {
+		fprintf(stderr, "[query] FAIL: %s: kd_search_polyline did not stop\n", name);
+		return 1;
+	    }
+	}
+	total += want;
+    }
+    free(v.found);
+    free(w.found);
+    printf("[query] %s: kd_search_polyline matched %d lines (%ld items)\n",
+	   name, KD_REGIONS, total);
+    return 0;
+}
+
+/*
+ * Several threads read the tree at once,  each with its own share of
+ * the regions:  generators,  kd_is_member and kd_nearest must give
+ * them what they give a single thread.
+ */
+#define KD_THREADS	4
+#define KD_NEIGHBORS	4
+
+typedef struct {
+    kd_tree tree;
+    int id;			/* Takes regions id,  id + KD_THREADS,  ... */
+    int failed;
+} reader;
+
+static double near_dist[KD_REGIONS][KD_NEIGHBORS];
+
+static void *read_tree(void *arg)
+{
+    reader *rd = (reader *) arg;
+    kd_priority *list;
+    kd_gen gen;
+    kd_generic item;
+    int r, n, j;
+
+    for (r = rd->id;  r < KD_REGIONS;  r += KD_THREADS) {
+	gen = kd_start(rd->tree, regions[r]);
+	n = first[r];
+	while (kd_next(gen, &item, (kd_box_r) 0) == KD_OK) {
+	    if (n >= first[r+1] || expect[n] != item) rd->failed = 1;
+	    n++;
+	}
+	(void) kd_finish(gen);
+	if (n != first[r+1]) rd->failed = 1;
+	for (j = r;  j < KD_BOXES;  j += KD_REGIONS) {
+	    if ((kd_is_member(rd->tree, items[j], boxes[j]) == KD_OK) != live[j])
+		rd->failed = 1;
+	}
+	(void) kd_nearest(rd->tree, regions[r][KD_LEFT], regions[r][KD_BOTTOM],
+			  KD_NEIGHBORS, &list);
+	for (j = 0;  j < KD_NEIGHBORS;  j++)
+	    if (list[j].dist != near_dist[r][j]) rd->failed = 1;
+	free(list);
+    }
+    return (void *) 0;
+}
+
+static int check_threads(const char *name, kd_tree tree)
+{
+    pthread_t threads[KD_THREADS];
+    reader readers[KD_THREADS];
+    kd_priority *list;
+    int r, j;
+
+    for (r = 0;  r < KD_REGIONS;  r++) {
+	(void) kd_nearest(tree, regions[r][KD_LEFT], regions[r][KD_BOTTOM],
+			  KD_NEIGHBORS, &list);
+	for (j = 0;  j < KD_NEIGHBORS;  j++) near_dist[r][j] = list[j].dist;
+	free(list);
+    }
+    for (j = 0;  j < KD_THREADS;  j++) {
+	readers[j].tree = tree;
+	readers[j].id = j;
+	readers[j].failed = 0;
+	if (pthread_create(&threads[j], NULL, read_tree, &readers[j]) != 0) {
+	    fprintf(stderr, "[query] FAIL: %s: cannot start a thread\n", name);
+	    return 1;
+	}
+    }
+    for (j = 0;  j < KD_THREADS;  j++) (void) pthread_join(threads[j], NULL);
+    for (j = 0;  j < KD_THREADS;  j++) {
+	if (readers[j].failed) {
+	    fprintf(stderr, "[query] FAIL: %s: reader thread %d got other answers\n", name, j);
+	    return 1;
+	}
+    }
+    printf("[query] %s: %d reader threads matched\n", name, KD_THREADS);
+    return 0;
+}
+
+static int check_all(const char *name, kd_tree tree)
+{
+    return check_batch(name, tree) || check_search(name, tree) || check_parallel(name, tree) ||
+	check_gen_storage(name, tree) || check_count(name, tree) ||
+	check_mode(name, tree, KD_WITHIN) || check_mode(name, tree, KD_CONTAINS) ||
+	check_stab(name, tree) || check_line(name, tree) || check_threads(name, tree);
+}
+
+int main(int argc, char **argv)
+{
+    kd_tree tree, frozen;
+    int i, tries, dels;
+
+    (void)argc; (void)argv;
+    for (i = 0;  i < KD_BOXES;  i++) {
+	rand_box(boxes[i], BOX_RANGE);
+	items[i] = (kd_generic) (long) (i+1);
+	live[i] = 1;
+    }
+    for (i = 0;  i < KD_REGIONS;  i++) {
+	/* Mostly small tiles,  some large areas,  a few zoomed right out */
+	rand_box(regions[i], (i % 10) ? REGION_RANGE / 10 : REGION_RANGE);
+	if (i % 50 == 0) {
+	    regions[i][KD_LEFT] -= 4 * REGION_RANGE;
+	    regions[i][KD_BOTTOM] -= 4 * REGION_RANGE;
+	    regions[i][KD_RIGHT] += 4 * REGION_RANGE;
+	    regions[i][KD_TOP] += 4 * REGION_RANGE;
+	}
+    }
+    regions[KD_REGIONS-1][KD_LEFT] = regions[KD_REGIONS-1][KD_BOTTOM] = MIN_RANGE;
+    regions[KD_REGIONS-1][KD_RIGHT] = regions[KD_REGIONS-1][KD_TOP] = MAX_RANGE + BOX_RANGE;
+    tree = kd_build_from_arrays((const kd_box *) boxes, items, KD_BOXES);
+    /* Leave some dead nodes in it */
+    for (i = 0;  i < KD_BOXES;  i += 7) {
+	(void) kd_delete(tree, items[i], boxes[i]);
+	live[i] = 0;
+    }
+    expected(tree);
+    if (check_expected("pointer tree")) return 1;
+
+    if (check_all("pointer tree", tree)) return 1;
+    frozen = kd_freeze(tree);
+    if (check_all("frozen tree", frozen)) return 1;
+    kd_destroy(frozen, NULL);
+    frozen = kd_freeze_buckets(tree, 32);
+    if (check_all("bucketed tree", frozen)) return 1;
+    kd_destroy(frozen, NULL);
+
+    /* Counts have to follow real deletes and inserts too */
+    for (i = 3;  i < KD_BOXES;  i += 5) {
+	if (i % 7 == 0) continue;
+	if (kd_really_delete(tree, items[i], boxes[i], &tries, &dels) != KD_OK) {
+	    fprintf(stderr, "[query] FAIL: could not really_delete item %d\n", i);
+	    return 1;
+	}
+	live[i] = 0;
+    }
+    for (i = 3;  i < KD_BOXES;  i += 10) {
+	if (i % 7 == 0) continue;
+	kd_insert(tree, items[i], boxes[i], (kd_generic) 0);
+	live[i] = 1;
+    }
+    free(expect);
+    expected(tree);
+    if (check_expected("changed tree") || check_count("changed tree", tree)) return 1;
+
+    /*
+     * Sorted inserts make a deep tree:  a chain of low sons,  each
+     * node with a leaf for a high son,  so a search has one son
+     * pending per level and outgrows the stack kd_search starts with.
+     */
+    kd_destroy(tree, NULL);
+    tree = kd_create();
+    for (i = 0;  i < KD_BOXES;  i++) live[i] = (i < KD_BOXES / 20);
+    for (i = KD_BOXES / 20;  i-- > 0; ) {
+	boxes[i][KD_LEFT] = boxes[i][KD_BOTTOM] = (i / 2) * 10 + (i % 2) * 5;
+	boxes[i][KD_RIGHT] = boxes[i][KD_TOP] = boxes[i][KD_LEFT] + BOX_RANGE;
+	if (i % 2 == 0) kd_insert(tree, items[i], boxes[i], (kd_generic) 0);
+    }
+    for (i = 1;  i < KD_BOXES / 20;  i += 2)
+	kd_insert(tree, items[i], boxes[i], (kd_generic) 0);
+    /* Aim a third of the regions at the diagonal the boxes lie on */
+    for (i = 0;  i < KD_REGIONS;  i += 3) {
+	regions[i][KD_LEFT] = regions[i][KD_BOTTOM] = random() % (KD_BOXES / 4);
+	regions[i][KD_RIGHT] = regions[i][KD_TOP] = regions[i][KD_LEFT] + REGION_RANGE / 4;
+    }
+    free(expect);
+    expected(tree);
+    if (check_expected("deep tree") || check_all("deep tree", tree)) return 1;
+
+    num_hits = 0;
+    if (kd_query_batch(tree, (const kd_box *) regions, 0, record_hit, (kd_generic) 0) != KD_OK ||
+	num_hits != 0) {
+	fprintf(stderr, "[query] FAIL: empty batch reported hits\n");
+	return 1;
+    }
+    kd_destroy(tree, NULL);
+    free(hits);
+    free(expect);
+
+    printf("[query] All query checks passed. PASS\n");
+    return 0;
+}